@@ -0,0 +1,1013 @@
+
+/*
+ * Description: GtkTreeModel of a collection that reads its rows from the
+ *              database on demand.
+ *
+ * Rows are read by the database worker. Until their page arrives they are
+ * shown empty, and views are told when it does through "row-changed".
+ * Operations that change every row (sorting, searching, reloading) emit
+ * "reset", after which views must set the model again.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gtkollection.h"
+
+/* rows loaded by each query */
+#define PAGE_SIZE                   256
+
+/* pages kept in memory for each collection */
+#define MAX_CACHED_PAGES            64
+
+/* database ids as keys of the updated lines table */
+#define ID_KEY(id)                  GSIZE_TO_POINTER((gsize)(id))
+
+#define COLLECTION_TYPE_MODEL       (collection_model_get_type())
+#define COLLECTION_MODEL(obj)       \
+    (G_TYPE_CHECK_INSTANCE_CAST((obj), COLLECTION_TYPE_MODEL, CollectionModel))
+
+struct row_page {
+    int                 idx;
+    GArray              *lines;     /* dlg_line structures */
+    struct row_store    *store;     /* values of @lines */
+    GList               *lru_link;
+};
+
+/* Sort key of the last row of a page, where the next page starts from */
+struct page_key {
+    int                 valid;
+    char                *value;
+    unsigned long long  id;
+};
+
+/* A page being read by the database worker */
+struct page_request {
+    struct _CollectionModel *model;
+    struct db_job           *job;
+    int                     idx;
+    int                     stale;      /* rows have moved since it was made */
+    struct db_page_query    q;
+    GArray                  *lines;
+    struct row_store        *store;
+};
+
+/* Number of rows matching a search, being counted by the database worker */
+struct count_request {
+    struct _CollectionModel *model;
+    struct db_job           *job;
+    int                     stamp;
+    struct db_page_query    q;
+};
+
+struct sort_index_request {
+    struct _CollectionModel *model;
+    int                     sort_field;
+};
+
+typedef struct _CollectionModel CollectionModel;
+typedef struct _CollectionModelClass CollectionModelClass;
+
+struct _CollectionModel {
+    GObject                 parent;
+
+    struct db_collection    *c;
+    int                     stamp;
+
+    /* rows that are in the database and were not removed */
+    int                     db_rows;
+
+    /* page cache, the most recently used page is the LRU head */
+    GHashTable              *pages;
+    GQueue                  *lru;
+    GArray                  *keys;
+
+    /* pages being read, by their index */
+    GHashTable              *requests;
+    struct db_job           *count_job;
+
+    /* sort options */
+    int                     sort_field;
+    int                     order;
+
+    /* only rows matching it are shown, NULL shows all of them */
+    char                    *search;
+
+    /*
+     * Unsaved modifications. @changes holds every added and updated line,
+     * @added has the indexes (inside @changes) of the added lines in the
+     * order they are shown and @updated maps the database id of an updated
+     * line to its index.
+     */
+    struct row_store        *store;     /* values of the changed lines */
+    GArray                  *changes;
+    GArray                  *added;
+    GHashTable              *updated;
+    GList                   *d_lines;
+    GString                 *exclude;
+};
+
+struct _CollectionModelClass {
+    GObjectClass    parent_class;
+};
+
+enum {
+    SIGNAL_RESET,
+    LAST_SIGNAL
+};
+
+static guint __signals[LAST_SIGNAL] = { 0 };
+
+static void collection_model_tree_model_init(GtkTreeModelIface *iface);
+static void emit_row_signal(CollectionModel *model, int idx, int inserted);
+
+G_DEFINE_TYPE_WITH_CODE(CollectionModel, collection_model, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(GTK_TYPE_TREE_MODEL,
+                                              collection_model_tree_model_init))
+
+static void destroy_row_page(struct row_page *page)
+{
+    g_array_free(page->lines, TRUE);
+    row_store_free(page->store);
+    free(page);
+}
+
+static void clear_page_key(struct page_key *key)
+{
+    if (key->value != NULL)
+        free(key->value);
+
+    key->value = NULL;
+    key->valid = 0;
+}
+
+static gboolean discard_request(gpointer key, gpointer value, gpointer first_page)
+{
+    struct page_request *r = (struct page_request *)value;
+
+    if (GPOINTER_TO_INT(key) < GPOINTER_TO_INT(first_page))
+        return FALSE;
+
+    r->stale = 1;
+    db_job_cancel(r->job);
+
+    return TRUE;
+}
+
+/*
+ * Drops the cached pages starting at @first_page, the keys that depend on
+ * them and the results of their pending reads.
+ */
+static void invalidate_pages(CollectionModel *model, int first_page)
+{
+    struct row_page *page;
+    GList *l, *next;
+    unsigned int i;
+
+    g_hash_table_foreach_remove(model->requests, discard_request,
+                                GINT_TO_POINTER(first_page));
+
+    for (l = model->lru->head; l; l = next) {
+        next = l->next;
+        page = (struct row_page *)l->data;
+
+        if (page->idx < first_page)
+            continue;
+
+        g_queue_delete_link(model->lru, l);
+        g_hash_table_remove(model->pages, GINT_TO_POINTER(page->idx));
+    }
+
+    for (i = first_page; i < model->keys->len; i++)
+        clear_page_key(&g_array_index(model->keys, struct page_key, i));
+
+    if ((unsigned int)first_page < model->keys->len)
+        g_array_set_size(model->keys, first_page);
+}
+
+static void store_page_key(CollectionModel *model, struct row_page *page)
+{
+    struct page_key *key;
+    struct dlg_line *line;
+
+    /* search results are read by offset */
+    if ((page->lines->len < PAGE_SIZE) || (model->search != NULL))
+        return;
+
+    if ((unsigned int)page->idx >= model->keys->len)
+        g_array_set_size(model->keys, page->idx + 1);
+
+    key = &g_array_index(model->keys, struct page_key, page->idx);
+    clear_page_key(key);
+    line = &g_array_index(page->lines, dlg_line, page->lines->len - 1);
+
+    /* keys outlive their page, so they have their own copy */
+    if (model->sort_field >= 0)
+        key->value = strdup(line->cells[model->sort_field]);
+
+    key->id = line->id;
+    key->valid = 1;
+}
+
+static void emit_reset(CollectionModel *model)
+{
+    model->stamp++;
+    g_signal_emit(model, __signals[SIGNAL_RESET], 0);
+}
+
+static void copy_page_query(struct db_page_query *dst, struct db_page_query *src)
+{
+    *dst = *src;
+    dst->exclude = g_strdup(src->exclude);
+    dst->search = g_strdup(src->search);
+    dst->key_value = g_strdup(src->key_value);
+}
+
+static void clear_page_query(struct db_page_query *q)
+{
+    g_free((char *)q->exclude);
+    g_free((char *)q->search);
+    g_free((char *)q->key_value);
+}
+
+static void cache_page(CollectionModel *model, struct row_page *page)
+{
+    GList *tail;
+
+    if (g_queue_get_length(model->lru) >= MAX_CACHED_PAGES) {
+        tail = g_queue_pop_tail_link(model->lru);
+        g_hash_table_remove(model->pages,
+                            GINT_TO_POINTER(((struct row_page *)tail->data)->idx));
+
+        g_list_free_1(tail);
+    }
+
+    g_queue_push_head(model->lru, page);
+    page->lru_link = model->lru->head;
+    g_hash_table_insert(model->pages, GINT_TO_POINTER(page->idx), page);
+}
+
+static int load_page_job(gpointer data)
+{
+    struct page_request *r = (struct page_request *)data;
+
+    return db_load_collection_page(r->model->c, &r->q, r->lines, r->store);
+}
+
+static void load_page_done(int result __attribute__((unused)), int cancelled,
+    gpointer data)
+{
+    struct page_request *r = (struct page_request *)data;
+    CollectionModel *model = r->model;
+    struct row_page *page;
+    unsigned int i;
+    int row;
+
+    if (g_hash_table_lookup(model->requests, GINT_TO_POINTER(r->idx)) == r)
+        g_hash_table_remove(model->requests, GINT_TO_POINTER(r->idx));
+
+    if (cancelled || r->stale)
+        return;
+
+    /* pages that failed are kept too, or they would be read over and over */
+    page = malloc(sizeof(struct row_page));
+
+    if (!page)
+        return;
+
+    page->idx = r->idx;
+    page->lines = r->lines;
+    page->store = r->store;
+    r->lines = NULL;
+    r->store = NULL;
+
+    cache_page(model, page);
+    store_page_key(model, page);
+
+    for (i = 0; i < page->lines->len; i++) {
+        row = page->idx * PAGE_SIZE + i;
+
+        if (row >= model->db_rows)
+            break;
+
+        emit_row_signal(model, row, FALSE);
+    }
+}
+
+static void destroy_page_request(gpointer data)
+{
+    struct page_request *r = (struct page_request *)data;
+
+    if (r->lines != NULL)
+        g_array_free(r->lines, TRUE);
+
+    row_store_free(r->store);
+    clear_page_query(&r->q);
+    g_object_unref(r->model);
+    free(r);
+}
+
+/* Asks the database worker for a page, if it wasn't asked yet */
+static void request_page(CollectionModel *model, int idx)
+{
+    struct page_request *r;
+    struct page_key *key=NULL;
+    struct db_page_query q;
+
+    if (g_hash_table_lookup(model->requests, GINT_TO_POINTER(idx)) != NULL)
+        return;
+
+    r = calloc(1, sizeof(struct page_request));
+
+    if (!r)
+        return;
+
+    /* there are no keys while searching */
+    if ((idx > 0) && ((unsigned int)(idx - 1) < model->keys->len))
+        key = &g_array_index(model->keys, struct page_key, idx - 1);
+
+    q.sort_field = model->sort_field;
+    q.order = model->order;
+    q.exclude = model->exclude->str;
+    q.search = model->search;
+    q.limit = PAGE_SIZE;
+
+    if ((key != NULL) && key->valid) {
+        q.has_key = 1;
+        q.key_value = key->value;
+        q.key_id = key->id;
+        q.offset = 0;
+    } else {
+        /* unknown start, happens when jumping straight to this page */
+        q.has_key = 0;
+        q.key_value = NULL;
+        q.key_id = 0;
+        q.offset = idx * PAGE_SIZE;
+    }
+
+    r->model = g_object_ref(model);
+    r->idx = idx;
+    copy_page_query(&r->q, &q);
+    r->lines = g_array_sized_new(FALSE, FALSE, sizeof(struct dlg_line), PAGE_SIZE);
+    r->store = row_store_new(model->c->active_fields);
+    r->job = db_job_submit_read(load_page_job, load_page_done, r,
+                                destroy_page_request);
+
+    if (r->job != NULL)
+        g_hash_table_insert(model->requests, GINT_TO_POINTER(idx), r);
+}
+
+/* Gives a cached page, or NULL while it is being read */
+static struct row_page *get_page(CollectionModel *model, int idx)
+{
+    struct row_page *page;
+
+    page = g_hash_table_lookup(model->pages, GINT_TO_POINTER(idx));
+
+    if (page == NULL) {
+        request_page(model, idx);
+        return NULL;
+    }
+
+    g_queue_unlink(model->lru, page->lru_link);
+    g_queue_push_head_link(model->lru, page->lru_link);
+
+    return page;
+}
+
+/* Gets the line stored in the database at position @idx */
+static struct dlg_line *get_db_line(CollectionModel *model, int idx)
+{
+    struct row_page *page;
+    unsigned int p;
+
+    page = get_page(model, idx / PAGE_SIZE);
+
+    if (page == NULL)
+        return NULL;
+
+    p = idx % PAGE_SIZE;
+
+    if (p >= page->lines->len)
+        return NULL;
+
+    return &g_array_index(page->lines, dlg_line, p);
+}
+
+static struct dlg_line *get_change(CollectionModel *model, unsigned int idx)
+{
+    return &g_array_index(model->changes, dlg_line, idx);
+}
+
+/*
+ * Gets the line shown at row @idx, which is its unsaved version if it has
+ * been changed.
+ */
+static struct dlg_line *get_line(CollectionModel *model, int idx)
+{
+    struct dlg_line *line;
+    gpointer change;
+
+    if (idx >= model->db_rows) {
+        idx -= model->db_rows;
+
+        if ((unsigned int)idx >= model->added->len)
+            return NULL;
+
+        return get_change(model, g_array_index(model->added, guint, idx));
+    }
+
+    line = get_db_line(model, idx);
+
+    if ((line != NULL) &&
+        g_hash_table_lookup_extended(model->updated, ID_KEY(line->id), NULL, &change))
+    {
+        return get_change(model, GPOINTER_TO_UINT(change));
+    }
+
+    return line;
+}
+
+static const char **line_values(struct dlg_line *line)
+{
+    return (line->status == LINE_UPDATED) ? line->new_cells : line->cells;
+}
+
+static int n_rows(CollectionModel *model)
+{
+    return model->db_rows + model->added->len;
+}
+
+static int iter_index(CollectionModel *model, GtkTreeIter *iter)
+{
+    g_return_val_if_fail(iter->stamp == model->stamp, -1);
+
+    return GPOINTER_TO_INT(iter->user_data);
+}
+
+static void set_iter(CollectionModel *model, GtkTreeIter *iter, int idx)
+{
+    iter->stamp = model->stamp;
+    iter->user_data = GINT_TO_POINTER(idx);
+    iter->user_data2 = NULL;
+    iter->user_data3 = NULL;
+}
+
+static GtkTreeModelFlags collection_model_get_flags(GtkTreeModel *tree_model
+                                                        __attribute__((unused)))
+{
+    return GTK_TREE_MODEL_LIST_ONLY;
+}
+
+static gint collection_model_get_n_columns(GtkTreeModel *tree_model)
+{
+    return COLLECTION_MODEL(tree_model)->c->active_fields;
+}
+
+static GType collection_model_get_column_type(GtkTreeModel *tree_model
+                                                  __attribute__((unused)),
+    gint idx __attribute__((unused)))
+{
+    return G_TYPE_STRING;
+}
+
+static gboolean collection_model_get_iter(GtkTreeModel *tree_model,
+    GtkTreeIter *iter, GtkTreePath *path)
+{
+    CollectionModel *model = COLLECTION_MODEL(tree_model);
+    int idx;
+
+    if (gtk_tree_path_get_depth(path) != 1)
+        return FALSE;
+
+    idx = gtk_tree_path_get_indices(path)[0];
+
+    if ((idx < 0) || (idx >= n_rows(model)))
+        return FALSE;
+
+    set_iter(model, iter, idx);
+
+    return TRUE;
+}
+
+static GtkTreePath *collection_model_get_path(GtkTreeModel *tree_model,
+    GtkTreeIter *iter)
+{
+    GtkTreePath *path;
+
+    path = gtk_tree_path_new();
+    gtk_tree_path_append_index(path, iter_index(COLLECTION_MODEL(tree_model), iter));
+
+    return path;
+}
+
+static void collection_model_get_value(GtkTreeModel *tree_model, GtkTreeIter *iter,
+    gint column, GValue *value)
+{
+    CollectionModel *model = COLLECTION_MODEL(tree_model);
+    struct dlg_line *line;
+
+    g_value_init(value, G_TYPE_STRING);
+    line = get_line(model, iter_index(model, iter));
+
+    if (line == NULL)
+        return;
+
+    g_value_set_string(value, line_values(line)[column]);
+}
+
+static gboolean collection_model_iter_next(GtkTreeModel *tree_model,
+    GtkTreeIter *iter)
+{
+    CollectionModel *model = COLLECTION_MODEL(tree_model);
+    int idx;
+
+    idx = iter_index(model, iter) + 1;
+
+    if (idx >= n_rows(model))
+        return FALSE;
+
+    set_iter(model, iter, idx);
+
+    return TRUE;
+}
+
+static gboolean collection_model_iter_nth_child(GtkTreeModel *tree_model,
+    GtkTreeIter *iter, GtkTreeIter *parent, gint n)
+{
+    CollectionModel *model = COLLECTION_MODEL(tree_model);
+
+    if ((parent != NULL) || (n < 0) || (n >= n_rows(model)))
+        return FALSE;
+
+    set_iter(model, iter, n);
+
+    return TRUE;
+}
+
+static gboolean collection_model_iter_children(GtkTreeModel *tree_model,
+    GtkTreeIter *iter, GtkTreeIter *parent)
+{
+    return collection_model_iter_nth_child(tree_model, iter, parent, 0);
+}
+
+static gboolean collection_model_iter_has_child(GtkTreeModel *tree_model
+                                                    __attribute__((unused)),
+    GtkTreeIter *iter __attribute__((unused)))
+{
+    return FALSE;
+}
+
+static gint collection_model_iter_n_children(GtkTreeModel *tree_model,
+    GtkTreeIter *iter)
+{
+    if (iter != NULL)
+        return 0;
+
+    return n_rows(COLLECTION_MODEL(tree_model));
+}
+
+static gboolean collection_model_iter_parent(GtkTreeModel *tree_model
+                                                 __attribute__((unused)),
+    GtkTreeIter *iter __attribute__((unused)),
+    GtkTreeIter *child __attribute__((unused)))
+{
+    return FALSE;
+}
+
+static void collection_model_tree_model_init(GtkTreeModelIface *iface)
+{
+    iface->get_flags = collection_model_get_flags;
+    iface->get_n_columns = collection_model_get_n_columns;
+    iface->get_column_type = collection_model_get_column_type;
+    iface->get_iter = collection_model_get_iter;
+    iface->get_path = collection_model_get_path;
+    iface->get_value = collection_model_get_value;
+    iface->iter_next = collection_model_iter_next;
+    iface->iter_children = collection_model_iter_children;
+    iface->iter_has_child = collection_model_iter_has_child;
+    iface->iter_n_children = collection_model_iter_n_children;
+    iface->iter_nth_child = collection_model_iter_nth_child;
+    iface->iter_parent = collection_model_iter_parent;
+}
+
+static void clear_changes(CollectionModel *model)
+{
+    g_list_free_full(model->d_lines, free);
+    model->d_lines = NULL;
+
+    row_store_free(model->store);
+    model->store = row_store_new(model->c->active_fields);
+
+    g_array_set_size(model->changes, 0);
+    g_array_set_size(model->added, 0);
+    g_hash_table_remove_all(model->updated);
+    g_string_truncate(model->exclude, 0);
+}
+
+static void collection_model_finalize(GObject *object)
+{
+    CollectionModel *model = COLLECTION_MODEL(object);
+
+    clear_changes(model);
+    invalidate_pages(model, 0);
+
+    row_store_free(model->store);
+    g_hash_table_destroy(model->pages);
+    g_hash_table_destroy(model->requests);
+    g_queue_free(model->lru);
+    g_array_free(model->keys, TRUE);
+    g_array_free(model->changes, TRUE);
+    g_array_free(model->added, TRUE);
+    g_hash_table_destroy(model->updated);
+    g_string_free(model->exclude, TRUE);
+    g_free(model->search);
+
+    G_OBJECT_CLASS(collection_model_parent_class)->finalize(object);
+}
+
+static void collection_model_class_init(CollectionModelClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+
+    object_class->finalize = collection_model_finalize;
+
+    /* every row may have changed, views must set the model again */
+    __signals[SIGNAL_RESET] = g_signal_new("reset",
+                                           G_TYPE_FROM_CLASS(klass),
+                                           G_SIGNAL_RUN_LAST, 0, NULL, NULL,
+                                           g_cclosure_marshal_VOID__VOID,
+                                           G_TYPE_NONE, 0);
+}
+
+static void collection_model_init(CollectionModel *model)
+{
+    model->stamp = g_random_int();
+    model->pages = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                         (GDestroyNotify)destroy_row_page);
+
+    model->requests = g_hash_table_new(g_direct_hash, g_direct_equal);
+    model->count_job = NULL;
+    model->lru = g_queue_new();
+    model->keys = g_array_new(FALSE, TRUE, sizeof(struct page_key));
+    model->sort_field = -1;
+    model->order = CONFIG_SORT_ASC;
+    model->search = NULL;
+
+    model->changes = g_array_new(FALSE, FALSE, sizeof(struct dlg_line));
+    model->added = g_array_new(FALSE, FALSE, sizeof(guint));
+    model->updated = g_hash_table_new(g_direct_hash, g_direct_equal);
+    model->d_lines = NULL;
+    model->exclude = g_string_new(NULL);
+}
+
+GtkTreeModel *collection_model_new(struct db_collection *c)
+{
+    CollectionModel *model;
+
+    model = g_object_new(COLLECTION_TYPE_MODEL, NULL);
+    model->c = c;
+    model->db_rows = c->n_entries;
+    model->store = row_store_new(c->active_fields);
+
+    return GTK_TREE_MODEL(model);
+}
+
+/*
+ * Gives a copy of the line at @iter, with its current values as cells kept
+ * by @store. The caller must free() it.
+ */
+struct dlg_line *collection_model_dup_line(GtkTreeModel *tree_model,
+    GtkTreeIter *iter, struct row_store *store)
+{
+    CollectionModel *model = COLLECTION_MODEL(tree_model);
+    struct dlg_line *line;
+
+    line = get_line(model, iter_index(model, iter));
+
+    if (line == NULL)
+        return NULL;
+
+    return dup_dlg_line(line, line_values(line), store);
+}
+
+/*
+ * Gives a copy of the image file name of @row, or NULL if it isn't loaded.
+ * The caller must g_free() it.
+ */
+char *collection_model_get_image(GtkTreeModel *tree_model, int row)
+{
+    CollectionModel *model = COLLECTION_MODEL(tree_model);
+    struct dlg_line *line;
+
+    if ((row < 0) || (row >= n_rows(model)))
+        return NULL;
+
+    line = get_line(model, row);
+
+    return (line != NULL) ? g_strdup(line->img_filename) : NULL;
+}
+
+static void emit_row_signal(CollectionModel *model, int idx, int inserted)
+{
+    GtkTreePath *path;
+    GtkTreeIter iter;
+
+    path = gtk_tree_path_new_from_indices(idx, -1);
+    set_iter(model, &iter, idx);
+
+    if (inserted)
+        gtk_tree_model_row_inserted(GTK_TREE_MODEL(model), path, &iter);
+    else
+        gtk_tree_model_row_changed(GTK_TREE_MODEL(model), path, &iter);
+
+    gtk_tree_path_free(path);
+}
+
+void collection_model_append(GtkTreeModel *tree_model, const char **values,
+    const char *img_filename)
+{
+    CollectionModel *model = COLLECTION_MODEL(tree_model);
+    struct dlg_line line;
+    guint idx;
+
+    memset(&line, 0, sizeof(struct dlg_line));
+    line.status = LINE_ADDED;
+    line.store = model->store;
+    line.cells = row_store_copy_row(model->store, values);
+    line.img_filename = row_store_add_text(model->store, img_filename);
+
+    idx = model->changes->len;
+    g_array_append_val(model->changes, line);
+    g_array_append_val(model->added, idx);
+
+    emit_row_signal(model, n_rows(model) - 1, TRUE);
+}
+
+/*
+ * Replaces the values of the line at @iter with a copy of @values. The image
+ * is only replaced if @img_filename is not NULL.
+ */
+void collection_model_update(GtkTreeModel *tree_model, GtkTreeIter *iter,
+    const char **values, const char *img_filename)
+{
+    CollectionModel *model = COLLECTION_MODEL(tree_model);
+    struct dlg_line *line, change;
+    guint c_idx;
+    int idx;
+
+    idx = iter_index(model, iter);
+    line = get_line(model, idx);
+
+    if (line == NULL)
+        return;
+
+    if (line->status == LINE_LOADED) {
+        /* first change of a database line */
+        memset(&change, 0, sizeof(struct dlg_line));
+        change.status = LINE_UPDATED;
+        change.id = line->id;
+        change.store = model->store;
+        change.img_filename = row_store_add_text(model->store, line->img_filename);
+
+        c_idx = model->changes->len;
+        g_array_append_val(model->changes, change);
+        line = get_change(model, c_idx);
+        g_hash_table_insert(model->updated, ID_KEY(line->id), GUINT_TO_POINTER(c_idx));
+    }
+
+    /*
+     * Lines that were not saved yet only have their cells changed. Previous
+     * values are left in the store until the changes are cleared.
+     */
+    if (line->status == LINE_ADDED)
+        line->cells = row_store_copy_row(model->store, values);
+    else
+        line->new_cells = row_store_copy_row(model->store, values);
+
+    if (img_filename != NULL) {
+        line->img_filename = row_store_add_text(model->store, img_filename);
+        line->new_image = 1;
+    }
+
+    emit_row_signal(model, idx, FALSE);
+}
+
+void collection_model_remove(GtkTreeModel *tree_model, GtkTreeIter *iter)
+{
+    CollectionModel *model = COLLECTION_MODEL(tree_model);
+    struct dlg_line *line, *d_line;
+    GtkTreePath *path;
+    gpointer change;
+    int idx;
+
+    idx = iter_index(model, iter);
+
+    if (idx >= model->db_rows) {
+        /* never saved, so there's nothing to remove from the database */
+        idx -= model->db_rows;
+        get_change(model, g_array_index(model->added, guint, idx))->status =
+            LINE_DELETED;
+
+        g_array_remove_index(model->added, idx);
+        idx += model->db_rows;
+    } else {
+        line = get_db_line(model, idx);
+
+        if (line == NULL)
+            return;
+
+        if (g_hash_table_lookup_extended(model->updated, ID_KEY(line->id), NULL, &change)) {
+            get_change(model, GPOINTER_TO_UINT(change))->status = LINE_DELETED;
+            g_hash_table_remove(model->updated, ID_KEY(line->id));
+        }
+
+        d_line = create_dlg_line(LINE_DELETED);
+
+        if (!d_line)
+            return;
+
+        d_line->id = line->id;
+        d_line->store = model->store;
+        d_line->img_filename = row_store_add_text(model->store, line->img_filename);
+        model->d_lines = g_list_append(model->d_lines, d_line);
+
+        g_string_append_printf(model->exclude, "%s%llu",
+                               (model->exclude->len > 0) ? ", " : "", line->id);
+
+        /* rows after the removed one have moved */
+        invalidate_pages(model, idx / PAGE_SIZE);
+        model->db_rows--;
+    }
+
+    path = gtk_tree_path_new_from_indices(idx, -1);
+    gtk_tree_model_row_deleted(GTK_TREE_MODEL(model), path);
+    gtk_tree_path_free(path);
+}
+
+static int sort_index_job(gpointer data)
+{
+    struct sort_index_request *r = (struct sort_index_request *)data;
+
+    return db_create_sort_index(r->model->c, r->sort_field);
+}
+
+static void destroy_sort_index_request(gpointer data)
+{
+    struct sort_index_request *r = (struct sort_index_request *)data;
+
+    g_object_unref(r->model);
+    free(r);
+}
+
+/*
+ * Changes the order of the rows. Since every row may have moved, "reset" is
+ * emitted.
+ */
+void collection_model_set_sort(GtkTreeModel *tree_model, int sort_field, int order)
+{
+    CollectionModel *model = COLLECTION_MODEL(tree_model);
+    struct sort_index_request *r;
+
+    if ((model->sort_field == sort_field) && (model->order == order))
+        return;
+
+    /*
+     * Without its index every page would sort the whole table. Pages read
+     * before it is ready are only slower.
+     */
+    if ((sort_field >= 0) && (sort_field != model->sort_field)) {
+        r = malloc(sizeof(struct sort_index_request));
+
+        if (r != NULL) {
+            r->model = g_object_ref(model);
+            r->sort_field = sort_field;
+            db_job_submit(sort_index_job, NULL, r, destroy_sort_index_request);
+        }
+    }
+
+    model->sort_field = sort_field;
+    model->order = order;
+    invalidate_pages(model, 0);
+    emit_reset(model);
+}
+
+static int count_job(gpointer data)
+{
+    struct count_request *r = (struct count_request *)data;
+
+    return db_count_collection_rows(r->model->c, &r->q);
+}
+
+static void count_done(int result, int cancelled, gpointer data)
+{
+    struct count_request *r = (struct count_request *)data;
+    CollectionModel *model = r->model;
+
+    if (model->count_job == r->job)
+        model->count_job = NULL;
+
+    /* the rows may have changed meanwhile */
+    if (cancelled || (r->stamp != model->stamp))
+        return;
+
+    model->db_rows = (result < 0) ? 0 : result;
+    invalidate_pages(model, 0);
+    emit_reset(model);
+}
+
+static void destroy_count_request(gpointer data)
+{
+    struct count_request *r = (struct count_request *)data;
+
+    clear_page_query(&r->q);
+    g_object_unref(r->model);
+    free(r);
+}
+
+/*
+ * Counts the rows in the database that are shown, i.e. not removed and
+ * matching the search, and emits "reset" once they are known. Matching rows
+ * are counted by the worker, until then there are none and "reset" is
+ * emitted again when they are.
+ */
+static void count_db_rows(CollectionModel *model)
+{
+    struct count_request *r;
+    struct db_page_query q;
+
+    if (model->count_job != NULL) {
+        db_job_cancel(model->count_job);
+        model->count_job = NULL;
+    }
+
+    if (model->search == NULL) {
+        model->db_rows = model->c->n_entries - g_list_length(model->d_lines);
+        emit_reset(model);
+        return;
+    }
+
+    model->db_rows = 0;
+    emit_reset(model);
+    r = malloc(sizeof(struct count_request));
+
+    if (!r)
+        return;
+
+    memset(&q, 0, sizeof(struct db_page_query));
+    q.exclude = model->exclude->str;
+    q.search = model->search;
+
+    r->model = g_object_ref(model);
+    r->stamp = model->stamp;
+    copy_page_query(&r->q, &q);
+    r->job = db_job_submit_read(count_job, count_done, r, destroy_count_request);
+    model->count_job = r->job;
+}
+
+/*
+ * Shows only the rows matching every word of @text, best matches first. An
+ * empty @text shows every row again. "reset" is emitted, and again once the
+ * matching rows are known.
+ */
+void collection_model_set_search(GtkTreeModel *tree_model, const char *text)
+{
+    CollectionModel *model = COLLECTION_MODEL(tree_model);
+
+    if ((text != NULL) && (*text == '\0'))
+        text = NULL;
+
+    if (!g_strcmp0(model->search, text))
+        return;
+
+    g_free(model->search);
+    model->search = g_strdup(text);
+    invalidate_pages(model, 0);
+    count_db_rows(model);
+}
+
+/*
+ * Gives the unsaved modifications in the form db_save_collection_data()
+ * expects. They still belong to the model.
+ */
+void collection_model_get_changes(GtkTreeModel *tree_model, GList **d_lines,
+    GArray **entries)
+{
+    CollectionModel *model = COLLECTION_MODEL(tree_model);
+
+    *d_lines = model->d_lines;
+    *entries = model->changes;
+}
+
+/*
+ * Discards the unsaved modifications and every loaded row, to read them again
+ * from the database. "reset" is emitted.
+ */
+void collection_model_reload(GtkTreeModel *tree_model)
+{
+    CollectionModel *model = COLLECTION_MODEL(tree_model);
+
+    clear_changes(model);
+    invalidate_pages(model, 0);
+    count_db_rows(model);
+}
@@ -8,7 +8,6 @@
 #include <libintl.h>
 
 #include "gtkollection.h"
-#include "cover_image.xpm"
 
 #define TITLE_DEFAULT               0
 #define TITLE_UNSAVED               1
@@ -16,21 +15,17 @@
 #define DATA_SAVED                  0
 #define DATA_UNSAVED                1
 
-struct array_sort_model {
-    int         column_idx;
-    GtkSortType s_type;
-};
+/* width of the columns, rows are fetched only when they are displayed */
+#define COLUMN_WIDTH                150
 
-static int compare_lines(struct dlg_line *line_a, struct dlg_line *line_b,
-    struct array_sort_model *s_model)
-{
-    char *a, *b;
+/* room around the cover icons of the list */
+#define ICON_PADDING                8
 
-    a = (char *)g_list_nth_data(line_a->column, s_model->column_idx);
-    b = (char *)g_list_nth_data(line_b->column, s_model->column_idx);
+/* time without typing before searching */
+#define SEARCH_DELAY                250     /* ms */
 
-    return (s_model->s_type == GTK_SORT_ASCENDING) ? strcmp(a, b) : strcmp(b, a);
-}
+/* rows above and below the selected one whose covers are decoded ahead */
+#define COVER_PREFETCH_ROWS         8
 
 static GString *create_tab_title(struct dlg_data *dlg_data, int data_type)
 {
@@ -61,42 +56,97 @@ static void ui_update_data_status(struct dlg_data *dlg_data, int data_status)
 
 static GtkTreeModel *create_model(struct dlg_data *dlg_data)
 {
-    GType *types;
-    GtkListStore *store;
-    GList *l;
-    int i;
-    struct db_field *f;
+    return collection_model_new(dlg_data->c);
+}
 
-    types = g_malloc(sizeof(GType) * dlg_data->c->active_fields);
+/*
+ * Sets the model again into the treeview, when the model is reset after its
+ * rows have been reordered or reloaded.
+ */
+static void refresh_treeview(GtkTreeModel *model __attribute__((unused)),
+    struct dlg_data *dlg_data)
+{
+    GtkTreeView *treeview = GTK_TREE_VIEW(dlg_data->priv.treeview);
 
-    for (l = g_list_first(dlg_data->c->fields), i = 0; l; l = l->next) {
-        f = (struct db_field *)l->data;
+    gtk_tree_view_set_model(treeview, NULL);
+    gtk_tree_view_set_model(treeview, dlg_data->priv.model);
+}
 
-        if (f->status == FIELD_ACTIVE) {
-            types[i] = G_TYPE_STRING;
-            i++;
-        }
+/* Redraws the list once an icon is decoded, if it still exists */
+static void icon_ready(GdkPixbuf *pixbuf __attribute__((unused)),
+    const char *filename __attribute__((unused)), gpointer data)
+{
+    struct dlg_data *dlg_data = (struct dlg_data *)data;
+
+    if (dlg_data->priv.model != NULL)
+        gtk_widget_queue_draw(dlg_data->priv.treeview);
+}
+
+/*
+ * Rows whose icon isn't cached are left empty while it's decoded. Icons that
+ * can't be read are cached as the default one, so they are decoded once.
+ */
+static void icon_cell_data(GtkTreeViewColumn *column __attribute__((unused)),
+    GtkCellRenderer *renderer, GtkTreeModel *model, GtkTreeIter *iter,
+    gpointer data)
+{
+    GtkTreePath *path;
+    GdkPixbuf *pixbuf=NULL;
+    char *filename;
+
+    path = gtk_tree_model_get_path(model, iter);
+    filename = collection_model_get_image(model, gtk_tree_path_get_indices(path)[0]);
+    gtk_tree_path_free(path);
+
+    if (filename != NULL) {
+        pixbuf = image_cache_peek_icon(filename);
+
+        if (pixbuf == NULL)
+            image_cache_load_icon(filename, icon_ready, data);
+
+        g_free(filename);
     }
 
-    store = gtk_list_store_newv(dlg_data->c->active_fields, types);
-    db_load_and_set_collection_data(dlg_data->c, store, dlg_data);
-    g_free(types);
+    g_object_set(renderer, "pixbuf", pixbuf, NULL);
+}
 
-    return GTK_TREE_MODEL(store);
+static void tree_add_icon_column(struct dlg_data *dlg_data)
+{
+    GtkCellRenderer *renderer;
+    GtkTreeViewColumn *column;
+
+    renderer = gtk_cell_renderer_pixbuf_new();
+    gtk_cell_renderer_set_fixed_size(renderer, ICON_SIZE, ICON_SIZE);
+    column = gtk_tree_view_column_new();
+    gtk_tree_view_column_pack_start(column, renderer, FALSE);
+    gtk_tree_view_column_set_cell_data_func(column, renderer, icon_cell_data,
+                                            dlg_data, NULL);
+
+    /* required by the fixed height mode of the treeview */
+    gtk_tree_view_column_set_sizing(column, GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_column_set_fixed_width(column, ICON_SIZE + ICON_PADDING);
+    gtk_tree_view_append_column(GTK_TREE_VIEW(dlg_data->priv.treeview), column);
 }
 
 static void tree_add_column(struct db_field *f, struct dlg_data *dlg_data)
 {
     GtkCellRenderer *renderer;
+    GtkTreeViewColumn *column;
 
     if (f->status == FIELD_HIDDEN)
         return;
 
     renderer = gtk_cell_renderer_text_new();
-    gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(dlg_data->priv.treeview),
-                                                -1, f->screen_name, renderer,
-                                                "text", dlg_data->priv.tab_column_idx,
-                                                NULL);
+    column = gtk_tree_view_column_new_with_attributes(f->screen_name, renderer,
+                                                      "text",
+                                                      dlg_data->priv.tab_column_idx,
+                                                      NULL);
+
+    /* required by the fixed height mode of the treeview */
+    gtk_tree_view_column_set_sizing(column, GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_column_set_fixed_width(column, COLUMN_WIDTH);
+    gtk_tree_view_column_set_resizable(column, TRUE);
+    gtk_tree_view_append_column(GTK_TREE_VIEW(dlg_data->priv.treeview), column);
 
     dlg_data->priv.tab_column_idx++;
 }
@@ -112,86 +162,56 @@ static void dlg_insert_text_entries(struct dlg_data *dlg_data,
 
     for (i = 0; i < dlg_data->c->active_fields; i++) {
         gtk_tree_model_get(dlg_data->priv.model, &iter, i, &s, -1);
-        gtk_entry_set_text(GTK_ENTRY(textbox[i]), s);
+        gtk_entry_set_text(GTK_ENTRY(textbox[i]), (s != NULL) ? s : "");
+        g_free(s);
     }
 }
 
-static int dlg_update_entry(struct dlg_data *dlg_data, GtkWidget **textbox,
-    struct dlg_line *line, GtkTreePath *path)
+/* Gives the texts of @textbox, which still belong to the entries */
+static const char **dlg_entries_values(struct dlg_data *dlg_data,
+    GtkWidget **textbox)
 {
+    const char **values;
     int i;
-    GList *l;
-    const char *s;
-    GtkTreeIter iter;
 
-    gtk_tree_model_get_iter(dlg_data->priv.model, &iter, path);
+    values = g_malloc(sizeof(char *) * dlg_data->c->active_fields);
 
-    /* For new entries only updates its columns and don't updates @line->status */
-    if (line->status == LINE_ADDED) {
-        for (l = g_list_first(line->column), i = 0; l; l = l->next, i++) {
-            free(l->data);
-            s = gtk_entry_get_text(GTK_ENTRY(textbox[i]));
-            l->data = strdup(s);
-        }
-    } else {
-        /* Entries loaded from database have their status updated */
-        line->status = LINE_UPDATED;
+    for (i = 0; i < dlg_data->c->active_fields; i++)
+        values[i] = gtk_entry_get_text(GTK_ENTRY(textbox[i]));
 
-        if (line->new_column != NULL) {
-            g_list_free(line->new_column);
-            line->new_column = NULL;
-        }
+    return values;
+}
 
-        for (i = 0; i < dlg_data->c->active_fields; i++) {
-            s = gtk_entry_get_text(GTK_ENTRY(textbox[i]));
-            line->new_column = g_list_append(line->new_column, strdup(s));
-        }
-    }
+static int dlg_update_entry(struct dlg_data *dlg_data, GtkWidget **textbox,
+    GtkTreePath *path)
+{
+    GtkTreeIter iter;
+    const char **values;
 
-    if (dlg_data->priv.bt_img_filename != NULL) {
-        if (line->img_filename != NULL)
-            free(line->img_filename);
+    if (!gtk_tree_model_get_iter(dlg_data->priv.model, &iter, path))
+        return 0;
 
-        line->img_filename = strdup(dlg_data->priv.bt_img_filename);
-    }
+    /* the image is only replaced if a new one was chosen */
+    values = dlg_entries_values(dlg_data, textbox);
+    collection_model_update(dlg_data->priv.model, &iter, values,
+                            dlg_data->priv.bt_img_filename);
 
-    for (i = 0; i < dlg_data->c->active_fields; i++) {
-        s = gtk_entry_get_text(GTK_ENTRY(textbox[i]));
-        gtk_list_store_set(GTK_LIST_STORE(dlg_data->priv.model), &iter, i, s, -1);
-    }
+    g_free(values);
 
     return 1;
 }
 
 static int dlg_add_entry(struct dlg_data *dlg_data, GtkWidget **textbox)
 {
-    struct dlg_line *line;
-    const char *s;
-    int i;
-    GtkTreeIter iter;
+    const char **values;
 
-    gtk_list_store_append(GTK_LIST_STORE(dlg_data->priv.model), &iter);
-    line = create_dlg_line(LINE_ADDED);
+    values = dlg_entries_values(dlg_data, textbox);
+    collection_model_append(dlg_data->priv.model, values,
+                            (dlg_data->priv.bt_img_filename != NULL)
+                                ? dlg_data->priv.bt_img_filename
+                                : "default_image_xpm");
 
-    if (!line) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"),
-                    gettext("Error creating structure for new line!"));
-
-        return 0;
-    }
-
-    for (i = 0; i < dlg_data->c->active_fields; i++) {
-        s = gtk_entry_get_text(GTK_ENTRY(textbox[i]));
-        gtk_list_store_set(GTK_LIST_STORE(dlg_data->priv.model), &iter, i, s, -1);
-        line->column = g_list_append(line->column, strdup(s));
-    }
-
-    if (dlg_data->priv.bt_img_filename != NULL)
-        line->img_filename = strdup(dlg_data->priv.bt_img_filename);
-    else
-        line->img_filename = strdup("default_image_xpm");
-
-    g_array_append_vals(dlg_data->priv.data, line, 1);
+    g_free(values);
 
     return 1;
 }
@@ -217,31 +237,20 @@ static void s_bt_img_clicked(GtkButton *button __attribute__((unused)),
     GtkWidget *image;
     GdkPixbuf *pixbuf;
     char *filename;
-    struct dlg_line *line;
-    const char *s;
-    int i;
+    struct dlg_line line;
 
-    line = create_dlg_line(LINE_ADDED);
+    /* the texts are only read while searching, no need to copy them */
+    memset(&line, 0, sizeof(struct dlg_line));
+    line.status = LINE_ADDED;
+    line.cells = dlg_entries_values(dlg_data, dlg_data->priv.textbox);
 
-    if (!line) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"),
-                    gettext("Error creating structure for new line!"));
-
-        return;
-    }
-
-    for (i = 0; i < dlg_data->c->active_fields; i++) {
-        s = gtk_entry_get_text(GTK_ENTRY(dlg_data->priv.textbox[i]));
-        line->column = g_list_append(line->column, strdup(s));
-    }
-
-    filename = get_cover_image_file(dlg_data->c, line);
+    filename = get_cover_image_file(dlg_data->c, &line);
+    g_free(line.cells);
 
     if (filename != NULL) {
-        image = gtk_image_new_from_file(filename);
-        pixbuf = gtk_image_get_pixbuf(GTK_IMAGE(image));
-        pixbuf = gdk_pixbuf_scale_simple(pixbuf, 150, 150, GDK_INTERP_BILINEAR);
-        gtk_image_set_from_pixbuf(GTK_IMAGE(image), pixbuf);
+        pixbuf = image_cache_lookup(filename);
+        image = gtk_image_new_from_pixbuf(pixbuf);
+        g_object_unref(pixbuf);
 
         gtk_button_set_label(GTK_BUTTON(dlg_data->priv.bt_img), "");
         gtk_button_set_image(GTK_BUTTON(dlg_data->priv.bt_img), image);
@@ -258,7 +267,6 @@ static void do_entry_dialog(struct dlg_data *dlg_data, int dialog_type,
     GdkPixbuf *pixbuf;
     int result, i, j, ret, loop=1;
     struct db_field *f;
-    GError *error=NULL;
 
     dialog = gtk_dialog_new_with_buttons((dialog_type == DLG_ADD_ENTRY)
                                              ? gettext("Add new entry")
@@ -279,22 +287,9 @@ static void do_entry_dialog(struct dlg_data *dlg_data, int dialog_type,
 
     /* create cover image button */
     if (line != NULL) {
-        image = gtk_image_new();
-
-        if (!strcmp(line->img_filename, "default_image_xpm"))
-            pixbuf = gdk_pixbuf_new_from_xpm_data(__default_cover_image);
-        else {
-            pixbuf = gdk_pixbuf_new_from_file(line->img_filename, &error);
-
-            if (NULL == pixbuf) {
-                g_error_free(error);
-                pixbuf = gdk_pixbuf_new_from_xpm_data(__default_cover_image);
-            }
-
-            pixbuf = gdk_pixbuf_scale_simple(pixbuf, 150, 150, GDK_INTERP_BILINEAR);
-        }
-
-        gtk_image_set_from_pixbuf(GTK_IMAGE(image), pixbuf);
+        pixbuf = image_cache_lookup(line->img_filename);
+        image = gtk_image_new_from_pixbuf(pixbuf);
+        g_object_unref(pixbuf);
         bt_img = gtk_button_new();
         gtk_button_set_image(GTK_BUTTON(bt_img), image);
     } else
@@ -347,7 +342,7 @@ static void do_entry_dialog(struct dlg_data *dlg_data, int dialog_type,
             if (dialog_type == DLG_ADD_ENTRY)
                 ret = dlg_add_entry(dlg_data, textbox);
             else
-                ret = dlg_update_entry(dlg_data, textbox, line, path);
+                ret = dlg_update_entry(dlg_data, textbox, path);
 
             if (ret) {
                 ui_update_data_status(dlg_data, DATA_UNSAVED);
@@ -366,11 +361,20 @@ static void s_tree_edit_row(GtkTreeView *treeview __attribute__((unused)),
     GtkTreePath *path, GtkTreeViewColumn *column __attribute__((unused)),
     struct dlg_data *dlg_data)
 {
-    int model_idx;
+    GtkTreeIter iter;
     struct dlg_line *line;
+    struct row_store *store;
+
+    if (!gtk_tree_model_get_iter(dlg_data->priv.model, &iter, path))
+        return;
+
+    store = row_store_new(dlg_data->c->active_fields);
+    line = collection_model_dup_line(dlg_data->priv.model, &iter, store);
 
-    model_idx = gtk_tree_path_get_indices(path)[0];
-    line = &g_array_index(dlg_data->priv.data, dlg_line, model_idx);
+    if (!line) {
+        row_store_free(store);
+        return;
+    }
 
     if (dlg_data->priv.bt_img_filename != NULL) {
         free(dlg_data->priv.bt_img_filename);
@@ -378,6 +382,8 @@ static void s_tree_edit_row(GtkTreeView *treeview __attribute__((unused)),
     }
 
     do_entry_dialog(dlg_data, DLG_UPDATE_ENTRY, line, path);
+    free(line);
+    row_store_free(store);
 }
 
 static void s_bt_add_clicked(GtkButton *button __attribute__((unused)),
@@ -396,11 +402,6 @@ static void s_bt_del_clicked(GtkButton *button __attribute__((unused)),
 {
     GtkTreeSelection *selection;
     GtkTreeIter iter;
-    GtkTreePath *path;
-    int model_idx;
-    unsigned long long id;
-    char *img_filename;
-    struct dlg_line *line;
 
     selection = gtk_tree_view_get_selection(GTK_TREE_VIEW(dlg_data->priv.treeview));
 
@@ -411,59 +412,118 @@ static void s_bt_del_clicked(GtkButton *button __attribute__((unused)),
             return;
         }
 
-        path = gtk_tree_model_get_path(dlg_data->priv.model, &iter);
-        model_idx = gtk_tree_path_get_indices(path)[0];
-        line = &g_array_index(dlg_data->priv.data, dlg_line, model_idx);
-        img_filename = strdup(line->img_filename);
-        id = line->id;
+        collection_model_remove(dlg_data->priv.model, &iter);
+        ui_update_data_status(dlg_data, DATA_UNSAVED);
+    }
+}
 
-        /* Gets only entries that were loaded from database */
-        if (line->status != LINE_ADDED) {
-            line = create_dlg_line(LINE_DELETED);
+/* A save running on the database worker */
+struct save_request {
+    struct dlg_data *dlg_data;
+    GList           *removed;
+    GArray          *entries;
+    int             added;
+    int             deleted;
+};
 
-            if (!line) {
-                display_msg(GTK_MESSAGE_ERROR, gettext("Error"),
-                            gettext("Error creating structure for removed line!"));
+static int save_job(gpointer data)
+{
+    struct save_request *r = (struct save_request *)data;
 
-                return;
-            }
+    /* remove and update lines all at once, nothing is changed if it fails */
+    return db_save_collection_data(r->dlg_data->c, r->removed, r->entries,
+                                   &r->added, &r->deleted);
+}
+
+static void save_progress(double fraction, gpointer data)
+{
+    struct save_request *r = (struct save_request *)data;
+    struct dlg_data *dlg_data = r->dlg_data;
+    char *label;
 
-            line->img_filename = strdup(img_filename);
-            line->id = id;
+    label = g_strdup_printf(gettext("%s - Saving %d%%"), dlg_data->c->screen_name,
+                            (int)(fraction * 100));
 
-            dlg_data->priv.d_lines = g_list_append(dlg_data->priv.d_lines, line);
-        }
+    gtk_notebook_set_tab_label_text(GTK_NOTEBOOK(dlg_data->notebook),
+                                    dlg_data->page, label);
+
+    g_free(label);
+}
 
-        free(img_filename);
-        gtk_list_store_remove(GTK_LIST_STORE(dlg_data->priv.model), &iter);
-        gtk_tree_path_free(path);
-        g_array_remove_index(dlg_data->priv.data, model_idx);
+static void save_done(int result, int cancelled __attribute__((unused)),
+    gpointer data)
+{
+    struct save_request *r = (struct save_request *)data;
+    struct dlg_data *dlg_data = r->dlg_data;
+
+    gtk_widget_set_sensitive(dlg_data->page, TRUE);
 
+    if (result <= 0) {
         ui_update_data_status(dlg_data, DATA_UNSAVED);
+        return;
     }
+
+    dlg_data->c->n_entries += (r->added - r->deleted);
+
+    /* the saved lines are read back in their sorted position */
+    collection_model_reload(dlg_data->priv.model);
+    ui_update_data_status(dlg_data, DATA_SAVED);
 }
 
 static void s_bt_save_clicked(GtkButton *button __attribute__((unused)),
     struct dlg_data *dlg_data)
 {
-    int d_lines=0, a_lines=0;
+    struct save_request *r;
+    struct db_job *job;
+
+    r = calloc(1, sizeof(struct save_request));
 
-    /* remove lines */
-    if (dlg_data->priv.d_lines != NULL) {
-        d_lines = db_delete_collection_data(dlg_data->c, dlg_data->priv.d_lines);
+    if (!r)
+        return;
+
+    r->dlg_data = dlg_data;
+    collection_model_get_changes(dlg_data->priv.model, &r->removed, &r->entries);
 
-        /* clear the list so we don't try to remove them again */
-        g_list_free_full(dlg_data->priv.d_lines, (GDestroyNotify)destroy_dlg_line);
-        dlg_data->priv.d_lines = NULL;
+    job = db_job_new(save_job, save_done, r, free);
+
+    if (!job) {
+        free(r);
+        return;
     }
 
-    /* update all remaining lines */
-    a_lines = db_update_collection_data(dlg_data->c, dlg_data->priv.data);
+    /* the changes must stay as they are until they are saved */
+    gtk_widget_set_sensitive(dlg_data->page, FALSE);
+    db_job_set_progress_func(job, save_progress);
+    db_job_push(job);
+}
 
-    if (a_lines || d_lines)
-        dlg_data->c->n_entries += (a_lines - d_lines);
+/* Shows a decoded cover, unless the selection has moved since it was asked */
+static void show_cover(GdkPixbuf *pixbuf, const char *filename, gpointer data)
+{
+    struct dlg_data *dlg_data = (struct dlg_data *)data;
 
-    ui_update_data_status(dlg_data, DATA_SAVED);
+    if (g_strcmp0(filename, dlg_data->priv.cover_filename))
+        return;
+
+    gtk_image_set_from_pixbuf(GTK_IMAGE(dlg_data->priv.image), pixbuf);
+    gtk_widget_show_all(dlg_data->priv.image);
+}
+
+/* Decodes the covers around @row, the next ones to be selected with the keyboard */
+static void prefetch_covers(struct dlg_data *dlg_data, int row)
+{
+    char *filenames[COVER_PREFETCH_ROWS * 2];
+    int i, n=0;
+
+    for (i = 1; i <= COVER_PREFETCH_ROWS; i++) {
+        filenames[n++] = collection_model_get_image(dlg_data->priv.model, row + i);
+        filenames[n++] = collection_model_get_image(dlg_data->priv.model, row - i);
+    }
+
+    image_cache_prefetch(filenames, n);
+
+    for (i = 0; i < n; i++)
+        g_free(filenames[i]);
 }
 
 static void s_tree_line_selected(GtkTreeSelection *selection,
@@ -471,64 +531,40 @@ static void s_tree_line_selected(GtkTreeSelection *selection,
 {
     GtkTreeIter iter;
     GtkTreePath *path;
-    GdkPixbuf *pixbuf;
-    int model_idx;
-    struct dlg_line *line;
-    GError *error=0;
+    char *filename;
+    int row;
 
-    if (gtk_tree_selection_get_selected(selection, NULL, &iter)) {
-        path = gtk_tree_model_get_path(dlg_data->priv.model, &iter);
-        model_idx = gtk_tree_path_get_indices(path)[0];
-        line = &g_array_index(dlg_data->priv.data, dlg_line, model_idx);
-
-        if (!strcmp(line->img_filename, "default_image_xpm"))
-            pixbuf = gdk_pixbuf_new_from_xpm_data(__default_cover_image);
-        else {
-            pixbuf = gdk_pixbuf_new_from_file(line->img_filename, &error);
-
-            if (NULL == pixbuf) {
-                g_error_free(error);
-                pixbuf = gdk_pixbuf_new_from_xpm_data(__default_cover_image);
-            }
+    if (!gtk_tree_selection_get_selected(selection, NULL, &iter))
+        return;
 
-            pixbuf = gdk_pixbuf_scale_simple(pixbuf, 150, 150, GDK_INTERP_BILINEAR);
-        }
+    path = gtk_tree_model_get_path(dlg_data->priv.model, &iter);
+    row = gtk_tree_path_get_indices(path)[0];
+    gtk_tree_path_free(path);
 
-        gtk_image_set_from_pixbuf(GTK_IMAGE(dlg_data->priv.image), pixbuf);
-        gtk_widget_show_all(dlg_data->priv.image);
-    }
+    filename = collection_model_get_image(dlg_data->priv.model, row);
+
+    if (filename == NULL)
+        return;
+
+    g_free(dlg_data->priv.cover_filename);
+    dlg_data->priv.cover_filename = filename;
+    image_cache_load(filename, show_cover, dlg_data);
+    prefetch_covers(dlg_data, row);
 }
 
 static void update_treeview_data(struct dlg_data *dlg_data)
 {
-    struct array_sort_model s_model;
-    unsigned int i, j;
-    GList *l;
-    GtkTreeIter iter;
-    struct dlg_line *line;
+    int sort_field, order;
 
-    s_model.column_idx =
-        gtk_combo_box_get_active(GTK_COMBO_BOX(dlg_data->priv.sort_combo));
+    sort_field = gtk_combo_box_get_active(GTK_COMBO_BOX(dlg_data->priv.sort_combo));
 
     if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(dlg_data->priv.rd_asc)))
-        s_model.s_type = GTK_SORT_ASCENDING;
+        order = CONFIG_SORT_ASC;
     else
-        s_model.s_type = GTK_SORT_DESCENDING;
+        order = CONFIG_SORT_DESC;
 
-    g_array_sort_with_data(dlg_data->priv.data, (GCompareDataFunc)compare_lines,
-                           &s_model);
-
-    gtk_list_store_clear(GTK_LIST_STORE(dlg_data->priv.model));
-
-    for (i = 0; i < dlg_data->priv.data->len; i++) {
-        line = &g_array_index(dlg_data->priv.data, dlg_line, i);
-        gtk_list_store_append(GTK_LIST_STORE(dlg_data->priv.model), &iter);
-
-        for (l = g_list_first(line->column), j = 0; l; l = l->next, j++) {
-            gtk_list_store_set(GTK_LIST_STORE(dlg_data->priv.model), &iter, j,
-                               (char *)l->data, -1);
-        }
-    }
+    /* the database sorts the rows, we only need to show them again */
+    collection_model_set_sort(dlg_data->priv.model, sort_field, order);
 }
 
 static void s_enable_sorting(GtkWidget *w, struct dlg_data *dlg_data)
@@ -549,7 +585,7 @@ static void s_enable_sorting(GtkWidget *w, struct dlg_data *dlg_data)
 static void s_sort_combo_changed(GtkWidget *w __attribute__((unused)),
     struct dlg_data *dlg_data)
 {
-    if (dlg_data->priv.data->len > 0)
+    if (dlg_data->priv.model != NULL)
         update_treeview_data(dlg_data);
 }
 
@@ -640,9 +676,123 @@ static GtkWidget *dlg_create_buttons_widgets(struct dlg_data *dlg_data)
     return vbox_bt;
 }
 
+static gboolean run_search(struct dlg_data *dlg_data)
+{
+    dlg_data->priv.search_timeout = 0;
+
+    if (dlg_data->priv.model == NULL)
+        return FALSE;
+
+    collection_model_set_search(dlg_data->priv.model,
+                                gtk_entry_get_text(GTK_ENTRY(dlg_data->priv.search_entry)));
+
+    return FALSE;
+}
+
+static void s_search_changed(GtkEditable *editable __attribute__((unused)),
+    struct dlg_data *dlg_data)
+{
+    if (dlg_data->priv.search_timeout != 0)
+        g_source_remove(dlg_data->priv.search_timeout);
+
+    dlg_data->priv.search_timeout = g_timeout_add(SEARCH_DELAY,
+                                                  (GSourceFunc)run_search, dlg_data);
+}
+
+static void s_search_activate(GtkEntry *entry __attribute__((unused)),
+    struct dlg_data *dlg_data)
+{
+    if (dlg_data->priv.search_timeout != 0) {
+        g_source_remove(dlg_data->priv.search_timeout);
+        run_search(dlg_data);
+    }
+}
+
+static void s_search_icon_press(GtkEntry *entry,
+    GtkEntryIconPosition icon_pos __attribute__((unused)),
+    GdkEvent *event __attribute__((unused)),
+    struct dlg_data *dlg_data __attribute__((unused)))
+{
+    gtk_entry_set_text(entry, "");
+}
+
+static GtkWidget *dlg_create_search_entry(struct dlg_data *dlg_data)
+{
+    GtkWidget *entry;
+
+    entry = gtk_entry_new();
+    gtk_entry_set_icon_from_stock(GTK_ENTRY(entry), GTK_ENTRY_ICON_PRIMARY,
+                                  GTK_STOCK_FIND);
+
+    gtk_entry_set_icon_from_stock(GTK_ENTRY(entry), GTK_ENTRY_ICON_SECONDARY,
+                                  GTK_STOCK_CLEAR);
+
+    g_signal_connect(entry, "changed", G_CALLBACK(s_search_changed), dlg_data);
+    g_signal_connect(entry, "activate", G_CALLBACK(s_search_activate), dlg_data);
+    g_signal_connect(entry, "icon-press", G_CALLBACK(s_search_icon_press),
+                     dlg_data);
+
+    if (!dlg_data->c->search_index) {
+        gtk_widget_set_sensitive(entry, FALSE);
+        gtk_widget_set_tooltip_text(entry, gettext("Search is not available for "
+                                                   "this collection"));
+    } else
+        gtk_widget_set_tooltip_text(entry, gettext("Search entries"));
+
+    dlg_data->priv.search_entry = entry;
+
+    return entry;
+}
+
+/* Switches between the list of entries and the grid of their covers */
+static void s_covers_toggled(GtkToggleButton *button, struct dlg_data *dlg_data)
+{
+    GtkWidget *box;
+
+    if (gtk_toggle_button_get_active(button)) {
+        /* the grid is only created if it's ever shown */
+        if (dlg_data->priv.cover_grid == NULL) {
+            dlg_data->priv.cover_grid = cover_grid_new(dlg_data);
+
+            if (dlg_data->priv.cover_grid == NULL)
+                return;
+
+            box = gtk_widget_get_parent(dlg_data->priv.tree_sw);
+            gtk_box_pack_start(GTK_BOX(box), dlg_data->priv.cover_grid, TRUE,
+                               TRUE, 0);
+        }
+
+        gtk_widget_hide(dlg_data->priv.tree_sw);
+        gtk_widget_show_all(dlg_data->priv.cover_grid);
+    } else {
+        if (dlg_data->priv.cover_grid != NULL)
+            gtk_widget_hide(dlg_data->priv.cover_grid);
+
+        gtk_widget_show(dlg_data->priv.tree_sw);
+    }
+}
+
+static void s_treeview_destroyed(GtkWidget *w __attribute__((unused)),
+    struct dlg_data *dlg_data)
+{
+    if (dlg_data->priv.search_timeout != 0) {
+        g_source_remove(dlg_data->priv.search_timeout);
+        dlg_data->priv.search_timeout = 0;
+    }
+
+    if (dlg_data->priv.model != NULL) {
+        g_object_unref(dlg_data->priv.model);
+        dlg_data->priv.model = NULL;
+    }
+
+    /* covers still being decoded are not shown */
+    g_free(dlg_data->priv.cover_filename);
+    dlg_data->priv.cover_filename = NULL;
+}
+
 static GtkWidget *dlg_create_treeview(struct dlg_data *dlg_data)
 {
-    GtkWidget *sw, *treeview;
+    GtkWidget *vbox, *hbox, *sw, *treeview, *bt_covers;
     GtkTreeModel *model;
     GtkTreeSelection *selection;
 
@@ -658,13 +808,19 @@ static GtkWidget *dlg_create_treeview(struct dlg_data *dlg_data)
 
     dlg_data->priv.treeview = treeview;
     dlg_data->priv.model = model;
+    g_signal_connect(model, "reset", G_CALLBACK(refresh_treeview), dlg_data);
     g_signal_connect(treeview, "row-activated", G_CALLBACK(s_tree_edit_row),
                      dlg_data);
 
-    gtk_tree_view_set_model(GTK_TREE_VIEW(treeview), model);
     dlg_data->priv.tab_column_idx = 0;
+    tree_add_icon_column(dlg_data);
     g_list_foreach(dlg_data->c->fields, (GFunc)tree_add_column, dlg_data);
-    g_object_unref(model);
+    gtk_tree_view_set_fixed_height_mode(GTK_TREE_VIEW(treeview), TRUE);
+    gtk_tree_view_set_model(GTK_TREE_VIEW(treeview), model);
+
+    /* the model is kept while the treeview exists, see refresh_treeview() */
+    g_signal_connect(treeview, "destroy", G_CALLBACK(s_treeview_destroyed),
+                     dlg_data);
 
     selection = gtk_tree_view_get_selection(GTK_TREE_VIEW(treeview));
     gtk_tree_selection_set_mode(selection, GTK_SELECTION_SINGLE);
@@ -672,13 +828,32 @@ static GtkWidget *dlg_create_treeview(struct dlg_data *dlg_data)
                      dlg_data);
 
     gtk_container_add(GTK_CONTAINER(sw), treeview);
+    dlg_data->priv.tree_sw = sw;
+    dlg_data->priv.cover_grid = NULL;
+
+    bt_covers = gtk_toggle_button_new_with_label(gettext("Covers"));
+    gtk_widget_set_tooltip_text(bt_covers, gettext("Show the covers of the entries"));
+    g_signal_connect(bt_covers, "toggled", G_CALLBACK(s_covers_toggled), dlg_data);
+
+    hbox = gtk_hbox_new(FALSE, 3);
+    gtk_box_pack_start(GTK_BOX(hbox), dlg_create_search_entry(dlg_data), TRUE,
+                       TRUE, 0);
 
-    return sw;
+    gtk_box_pack_start(GTK_BOX(hbox), bt_covers, FALSE, FALSE, 0);
+
+    vbox = gtk_vbox_new(FALSE, 3);
+    gtk_box_pack_start(GTK_BOX(vbox), hbox, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), sw, TRUE, TRUE, 0);
+
+    return vbox;
 }
 
+/*
+ * Creates the page of a collection tab, still empty. Its widgets are only
+ * built by collection_widget_build(), when the tab is first shown.
+ */
 struct dlg_data *collection_widget(struct db_collection *c, GtkWidget *notebook)
 {
-    GtkWidget *vbox, *sw, *vbox_bt, *image, *hbox, *vbox_cinfo, *cinfo;
     struct dlg_data *dlg_data;
 
     dlg_data = create_dlg_data();
@@ -688,9 +863,22 @@ struct dlg_data *collection_widget(struct db_collection *c, GtkWidget *notebook)
 
     dlg_data->notebook = notebook;
     dlg_data->c = c;
-    load_collection_info_from_config(c->name, &dlg_data->info);
+    dlg_data->page = gtk_vbox_new(FALSE, 3);
+    dlg_data->built = 0;
 
-    vbox = gtk_vbox_new(FALSE, 3);
+    return dlg_data;
+}
+
+void collection_widget_build(struct dlg_data *dlg_data)
+{
+    GtkWidget *vbox, *sw, *vbox_bt, *image, *hbox, *vbox_cinfo, *cinfo;
+
+    if (dlg_data->built)
+        return;
+
+    load_collection_info_from_config(dlg_data->c->name, &dlg_data->info);
+
+    vbox = dlg_data->page;
     hbox = gtk_hbox_new(FALSE, 3);
     vbox_cinfo = gtk_vbox_new(FALSE, 3);
 
@@ -723,9 +911,24 @@ struct dlg_data *collection_widget(struct db_collection *c, GtkWidget *notebook)
         gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(dlg_data->priv.check_bt_sort),
                                      TRUE);
 
-    dlg_data->page = vbox;
+    dlg_data->built = 1;
     ui_update_data_status(dlg_data, DATA_SAVED);
-
-    return dlg_data;
+    gtk_widget_show_all(vbox);
 }
 
+/*
+ * Reads the entries of a collection again, once they have been changed
+ * outside of its tab. Unsaved changes would be lost, the tab is then left as
+ * it is.
+ */
+void collection_widget_reload(struct dlg_data *dlg_data)
+{
+    if (!dlg_data->built || (dlg_data->priv.model == NULL) ||
+        gtk_widget_get_sensitive(dlg_data->bt_save) ||
+        !gtk_widget_get_sensitive(dlg_data->page))
+    {
+        return;
+    }
+
+    collection_model_reload(dlg_data->priv.model);
+}
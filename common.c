@@ -3,18 +3,31 @@
  * Description: diverse functions.
  */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
 #include <libintl.h>
 #include <locale.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
+#include <linux/fs.h>
 
 #include "gtkollection.h"
 
 #define VALID_CHARS "1234567890qwertyuiopasdfghjklzxcvbnmQWERTYUIOPASDFGHJKLZXCVBNM"
 
+#define COPY_BUFFER_SIZE            (64 * 1024)
+#define COPY_CHUNK_SIZE             (16 * 1024 * 1024)
+
+/* directories open at once while removing a tree */
+#define REMOVE_DIR_FDS              16
+
 static GList *__active_windows = NULL;
 
 GtkWidget *ui_get_mainwindow(void)
@@ -62,6 +75,8 @@ struct db_collection *create_db_collection(const char *screen_name, const char *
     c->fields = NULL;
     c->sql_fields_stmt = g_string_new(NULL);
     c->image_path = NULL;
+    c->search_index = 0;
+    c->image_refs = 0;
 
     return c;
 }
@@ -158,9 +173,10 @@ struct dlg_data *create_dlg_data(void)
     if (!dlg_data)
         return NULL;
 
-    dlg_data->priv.d_lines = NULL;
-    dlg_data->priv.data = g_array_new(FALSE, FALSE, sizeof(struct dlg_line));
+    dlg_data->priv.model = NULL;
     dlg_data->priv.bt_img_filename = NULL;
+    dlg_data->priv.search_timeout = 0;
+    dlg_data->priv.cover_filename = NULL;
 
     return dlg_data;
 }
@@ -174,25 +190,41 @@ struct dlg_line *create_dlg_line(int line_status)
     if (!line)
         return NULL;
 
-    line->column = NULL;
-    line->new_column = NULL;
+    line->store = NULL;
+    line->cells = NULL;
+    line->new_cells = NULL;
     line->img_filename = NULL;
     line->status = line_status;
+    line->new_image = 0;
+    line->id = 0;
 
     return line;
 }
 
-void destroy_dlg_line(struct dlg_line *line)
+/*
+ * Creates a copy of @line inside @store, holding @values (or its own cells
+ * if NULL) as its cells.
+ */
+struct dlg_line *dup_dlg_line(const struct dlg_line *line, const char **values,
+    struct row_store *store)
 {
-    if (line->new_column != NULL) {
-        g_list_free(line->new_column);
-        line->new_column = NULL;
-    }
+    struct dlg_line *dup;
 
-    if (line->column != NULL) {
-        g_list_free(line->column);
-        line->column = NULL;
-    }
+    dup = create_dlg_line(line->status);
+
+    if (!dup)
+        return NULL;
+
+    dup->store = store;
+    dup->cells = row_store_copy_row(store, (values != NULL) ? values : line->cells);
+
+    if (line->img_filename != NULL)
+        dup->img_filename = row_store_add_text(store, line->img_filename);
+
+    dup->new_image = line->new_image;
+    dup->id = line->id;
+
+    return dup;
 }
 
 int choose_msg(const char *title, const char *fmt, ...)
@@ -335,80 +367,169 @@ char *strrand(int size)
     return s;
 }
 
-void rename_file(const char *old, const char *new)
+/* Copies @in into @out, sharing their blocks if the filesystem can */
+static int copy_file_contents(int in, int out)
 {
-    pid_t pid;
-    int c_status;
-    const char *args[] = {
-        "/bin/mv", "mv", "-f", NULL
-    };
-
-    pid = fork();
-
-    if (pid < 0) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"),
-                    gettext("Error renaming image to temporary name."));
-
-        return;
-    } else if (pid == 0) {
-        execl(args[0], args[1], args[2], old, new, (char *)NULL);
-        _exit(0);
-    } else
-        waitpid(pid, &c_status, WUNTRACED);
+    char buffer[COPY_BUFFER_SIZE];
+    ssize_t n, w, done;
+
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0)
+        return 0;
+#endif
+
+    /* copied by the kernel, without going through here */
+    while ((n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK_SIZE, 0)) > 0)
+        ;
+
+    if (n == 0)
+        return 0;
+
+    if ((errno != EXDEV) && (errno != ENOSYS) && (errno != EINVAL) &&
+        (errno != EOPNOTSUPP))
+    {
+        return -1;
+    }
+
+    if ((lseek(in, 0, SEEK_SET) == -1) || (lseek(out, 0, SEEK_SET) == -1) ||
+        (ftruncate(out, 0) == -1))
+    {
+        return -1;
+    }
+
+    while ((n = read(in, buffer, sizeof(buffer))) > 0) {
+        for (done = 0; done < n; done += w) {
+            w = write(out, buffer + done, n - done);
+
+            if (w <= 0)
+                return -1;
+        }
+    }
+
+    return (n == 0) ? 0 : -1;
 }
 
+/*
+ * Moves @old to @new, copying it if they are on different filesystems, as
+ * images from UNSAVED_IMG_TMP_DIR may be. Gives 0, or -1 with errno set.
+ */
+int rename_file(const char *old, const char *new)
+{
+    char *part;
+    int in, out, ret=-1, error;
+
+    if (rename(old, new) == 0)
+        return 0;
+
+    if (errno != EXDEV)
+        return -1;
+
+    /* copied under another name first, so @new is never left half written */
+    part = g_strdup_printf("%s.part", new);
+    in = open(old, O_RDONLY);
+
+    if (in == -1) {
+        g_free(part);
+        return -1;
+    }
+
+    out = open(part, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (out != -1) {
+        if ((copy_file_contents(in, out) == 0) && (fsync(out) == 0))
+            ret = 0;
+
+        error = errno;
+        close(out);
+        errno = error;
+    }
+
+    if ((ret == 0) && (rename(part, new) == -1))
+        ret = -1;
+
+    error = errno;
+    close(in);
+
+    if (ret == 0)
+        unlink(old);
+    else
+        unlink(part);
+
+    g_free(part);
+    errno = error;
+
+    return ret;
+}
+
+static int remove_dir_entry(const char *path,
+    const struct stat *st __attribute__((unused)),
+    int flag __attribute__((unused)), struct FTW *ftw __attribute__((unused)))
+{
+    remove(path);
+
+    return 0;
+}
+
+/* Removes @path and everything in it, without following links */
+static void remove_dir_tree(const char *path)
+{
+    nftw(path, remove_dir_entry, REMOVE_DIR_FDS, FTW_DEPTH | FTW_PHYS);
+}
+
+static gpointer remove_dir_thread(gpointer data)
+{
+    remove_dir_tree((char *)data);
+    g_free(data);
+
+    return NULL;
+}
+
+/*
+ * Removes the directory of a deleted collection on a thread of its own, as
+ * it may hold many images. Collection ids aren't used again, so nothing is
+ * waiting for it.
+ */
 void remove_collection_dir(int collection_id)
 {
-    pid_t pid;
-    int c_status;
-    char path[256]={0};
-    const char *args[] = {
-        "/bin/rm", "rm", "-rf", NULL
-    };
-
-    pid = fork();
-    snprintf(path, sizeof(path), "%s/%s/collections/c%d", getenv("HOME"),
-             APP_CONFIG_PATH, collection_id);
-
-    if (pid < 0) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"),
-                    gettext("Error removing collection directory."));
-
-        return;
-    } else if (pid == 0) {
-        execl(args[0], args[1], args[2], path, (char *)NULL);
-        _exit(0);
+    GThread *thread;
+    char *path;
+
+    path = g_strdup_printf("%s/%s/collections/c%d", getenv("HOME"),
+                           APP_CONFIG_PATH, collection_id);
+
+    thread = g_thread_try_new("remove-dir", remove_dir_thread, path, NULL);
+
+    if (thread == NULL) {
+        remove_dir_tree(path);
+        g_free(path);
     } else
-        waitpid(pid, &c_status, WUNTRACED);
+        g_thread_unref(thread);
 }
 
 void create_unsaved_images_tmp_dir(void)
 {
     mode_t mode;
-    pid_t pid;
-    int c_status;
-    const char *args[] = {
-        "/bin/rm", "rm", "-rf", NULL
-    };
 
     mode = S_IWUSR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
 
-    if (!access(UNSAVED_IMG_TMP_DIR, 0x00)) {
-        pid = fork();
-
-        if (pid < 0) {
-            fprintf(stderr, gettext("Error while removing temporary directory.\n"));
-            return;
-        } else if (pid == 0) {
-            execl(args[0], args[1], args[2], UNSAVED_IMG_TMP_DIR, (char *)NULL);
-            _exit(0);
-        } else
-            waitpid(pid, &c_status, WUNTRACED);
-    }
+    if (!access(UNSAVED_IMG_TMP_DIR, 0x00))
+        remove_dir_tree(UNSAVED_IMG_TMP_DIR);
 
     mkdir(UNSAVED_IMG_TMP_DIR, mode);
 }
 
+/* Gives a new name for an image in UNSAVED_IMG_TMP_DIR */
+char *create_unsaved_image_filename(void)
+{
+    char path[256]={0}, *name;
+
+    name = strrand(13);
+    snprintf(path, sizeof(path), "%s/%s", UNSAVED_IMG_TMP_DIR, name);
+    free(name);
+
+    return strdup(path);
+}
+
 char *load_license_file(void)
 {
     FILE *f;
@@ -53,6 +53,103 @@ static void load_default_values(struct app_settings *settings)
     settings->pos_y = -1;
 }
 
+static const char *__storage_modes[] = { "rollback", "wal" };
+static const char *__storage_sync[] = { "off", "normal", "full" };
+static const char *__storage_images[] = { "files", "pack" };
+
+static int storage_str_to_int(const char *s, const char **names, int n_names,
+    int default_value)
+{
+    int i;
+
+    for (i = 0; i < n_names; i++)
+        if (!strcmp(s, names[i]))
+            return i;
+
+    return default_value;
+}
+
+static void load_storage_settings(GKeyFile *key_file, struct storage_settings *storage)
+{
+    char *s;
+
+    storage->mode = STORAGE_MODE_WAL;
+    storage->synchronous = STORAGE_SYNC_NORMAL;
+    storage->cache_size = 8192;
+    storage->mmap_size = 64;
+    storage->checkpoint_interval = 30;
+    storage->images = STORAGE_IMAGES_FILES;
+
+    if (!g_key_file_has_group(key_file, "storage"))
+        return;
+
+    s = g_key_file_get_string(key_file, "storage", "mode", NULL);
+
+    if (s != NULL) {
+        storage->mode = storage_str_to_int(s, __storage_modes, 2, storage->mode);
+        g_free(s);
+    }
+
+    s = g_key_file_get_string(key_file, "storage", "synchronous", NULL);
+
+    if (s != NULL) {
+        storage->synchronous = storage_str_to_int(s, __storage_sync, 3,
+                                                  storage->synchronous);
+
+        g_free(s);
+    }
+
+    if (g_key_file_has_key(key_file, "storage", "cache_size", NULL))
+        storage->cache_size = g_key_file_get_integer(key_file, "storage",
+                                                     "cache_size", NULL);
+
+    /* it's given to sqlite as a negative number, see db_set_storage_options() */
+    if (storage->cache_size <= 0)
+        storage->cache_size = 8192;
+
+    if (g_key_file_has_key(key_file, "storage", "mmap_size", NULL))
+        storage->mmap_size = g_key_file_get_integer(key_file, "storage",
+                                                    "mmap_size", NULL);
+
+    if (storage->mmap_size < 0)
+        storage->mmap_size = 0;
+
+    if (g_key_file_has_key(key_file, "storage", "checkpoint_interval", NULL))
+        storage->checkpoint_interval = g_key_file_get_integer(key_file, "storage",
+                                                              "checkpoint_interval",
+                                                              NULL);
+
+    if (storage->checkpoint_interval <= 0)
+        storage->checkpoint_interval = 30;
+
+    s = g_key_file_get_string(key_file, "storage", "images", NULL);
+
+    if (s != NULL) {
+        storage->images = storage_str_to_int(s, __storage_images, 2,
+                                             storage->images);
+
+        g_free(s);
+    }
+}
+
+static void save_storage_settings(struct storage_settings *storage,
+    GKeyFile *key_file)
+{
+    g_key_file_set_string(key_file, "storage", "mode",
+                          __storage_modes[storage->mode]);
+
+    g_key_file_set_string(key_file, "storage", "synchronous",
+                          __storage_sync[storage->synchronous]);
+
+    g_key_file_set_integer(key_file, "storage", "cache_size", storage->cache_size);
+    g_key_file_set_integer(key_file, "storage", "mmap_size", storage->mmap_size);
+    g_key_file_set_integer(key_file, "storage", "checkpoint_interval",
+                           storage->checkpoint_interval);
+
+    g_key_file_set_string(key_file, "storage", "images",
+                          __storage_images[storage->images]);
+}
+
 static char *get_config_filename(void)
 {
     char filename[256]={0};
@@ -103,6 +200,7 @@ void load_config_file(struct app_settings *settings)
 
 end_block:
     settings->sort_info = NULL;
+    load_storage_settings(key_file, &settings->storage);
     g_key_file_free(key_file);
     free(filename);
 
@@ -140,12 +238,18 @@ void save_config_file(struct app_settings settings)
     filename = get_config_filename();
     key_file = g_key_file_new();
 
+    /* keeps the groups only edited by hand, like [image_provider] */
+    g_key_file_load_from_file(key_file, filename, G_KEY_FILE_KEEP_COMMENTS, NULL);
+
     g_key_file_set_boolean(key_file, "mainwindow", "maximized", settings.maximized);
     g_key_file_set_integer(key_file, "mainwindow", "width", settings.wnd_width);
     g_key_file_set_integer(key_file, "mainwindow", "height", settings.wnd_height);
     g_key_file_set_integer(key_file, "mainwindow", "pos_x", settings.pos_x);
     g_key_file_set_integer(key_file, "mainwindow", "pos_y", settings.pos_y);
 
+    /* save database storage options */
+    save_storage_settings(&settings.storage, key_file);
+
     /* save collections sort information */
     save_collection_sort_info(settings, key_file);
 
@@ -166,6 +270,26 @@ end_block:
     free(filename);
 }
 
+/* Gives the value of @key in @group, NULL if it's not set */
+char *get_config_setting(const char *group, const char *key)
+{
+    char *filename, *value;
+    GKeyFile *key_file;
+
+    filename = get_config_filename();
+    key_file = g_key_file_new();
+
+    if (g_key_file_load_from_file(key_file, filename, G_KEY_FILE_NONE, NULL))
+        value = g_key_file_get_string(key_file, group, key, NULL);
+    else
+        value = NULL;
+
+    g_key_file_free(key_file);
+    free(filename);
+
+    return value;
+}
+
 static void load_collection_info_default_values(struct collection_sort_info *info)
 {
     info->enable = FALSE;
@@ -0,0 +1,1028 @@
+
+/*
+ * Description: background search of the covers of the entries without one.
+ *
+ * The entries of a collection still using the default image are walked in
+ * the order they were added, each one searched with a web query made of its
+ * values, as in image_dialog.c. The first image found becomes its cover, or
+ * the images found wait in the window of the search until the user picks one.
+ * Images are decoded by the search, only the thumbnail chosen is written here
+ * and the database worker just records it.
+ * Searches are made after the ones asked for, and no more often than every
+ * fetch_interval seconds of [image_provider].
+ *
+ * Where the search is, along with the covers given, is kept in the database
+ * so a stopped search goes on from there the next time. Its database jobs are
+ * background ones, so they never delay the interface.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <libintl.h>
+
+#include "gtkollection.h"
+
+#define DEFAULT_QUERY               "$1 $name"
+
+/* seconds between two searches, unless fetch_interval is set */
+#define FETCH_INTERVAL              2
+
+/* entries read from the database at a time */
+#define FETCH_ENTRIES               32
+
+/* searching waits while this many entries wait to be reviewed */
+#define REVIEW_QUEUE_MAX            16
+
+/* An entry being searched, then waiting for its cover to be chosen */
+struct fetch_entry {
+    unsigned long long  id;
+    char                *title;
+    GdkPixbuf           **pixbufs;      /* images found, as thumbnails */
+};
+
+struct cover_fetch {
+    struct dlg_data             *dlg_data;  /* NULL once the tab is gone */
+    struct db_collection        *c;
+    struct cover_fetch_progress progress;
+    int                         interval;
+    int                         page_size;
+
+    /* entries being walked */
+    GArray                      *lines;
+    struct row_store            *store;
+    guint                       next_line;
+    unsigned long long          walked_id;  /* last entry searched */
+    int                         loading;
+    int                         walked;     /* no entries left */
+
+    struct image_search         *search;
+    struct fetch_entry          *entry;     /* being searched */
+    guint                       timeout;
+    GQueue                      *reviews;
+    GList                       *jobs;
+    int                         changed;    /* covers were given */
+    int                         failed;
+    int                         finished;
+    int                         stopped;
+    char                        *state;     /* shown above its counts */
+
+    /* widgets */
+    GtkWidget                   *dialog;
+    GtkWidget                   *label;
+    GtkWidget                   *bt_stop;
+    GtkWidget                   *review_frame;
+    GtkWidget                   *review_label;
+    GtkWidget                   **bt_img;
+};
+
+/* A database job of a search */
+struct fetch_job {
+    struct cover_fetch          *fetch;
+    struct db_job               *job;
+    struct db_collection        *c;
+    struct cover_fetch_progress progress;
+    unsigned long long          id;
+    char                        *filename;
+    GArray                      *lines;
+    struct row_store            *store;
+};
+
+/* a stopped search waits in __stopped for its jobs */
+static GList *__fetches = NULL;
+static GList *__stopped = NULL;
+static GList *__progress_requests = NULL;
+
+static gboolean fetch_next(gpointer data);
+
+static void free_entry(struct fetch_entry *e, int page_size)
+{
+    int i;
+
+    for (i = 0; i < page_size; i++)
+        if (e->pixbufs[i] != NULL)
+            g_object_unref(e->pixbufs[i]);
+
+    free(e->pixbufs);
+    g_free(e->title);
+    free(e);
+}
+
+static void free_lines(struct cover_fetch *f)
+{
+    if (f->lines == NULL)
+        return;
+
+    g_array_free(f->lines, TRUE);
+    row_store_free(f->store);
+    f->lines = NULL;
+    f->store = NULL;
+}
+
+static void free_fetch(struct cover_fetch *f)
+{
+    free_lines(f);
+    g_queue_free(f->reviews);
+    free(f->progress.query);
+    free(f->bt_img);
+    g_free(f->state);
+    free(f);
+}
+
+static void free_fetch_job(gpointer data)
+{
+    struct fetch_job *j = (struct fetch_job *)data;
+
+    if (j->lines != NULL) {
+        g_array_free(j->lines, TRUE);
+        row_store_free(j->store);
+    }
+
+    free(j->filename);
+    free(j);
+}
+
+/* Shows what the search is doing, @state NULL only updates its counts */
+static void set_status(struct cover_fetch *f, const char *state)
+{
+    char *text;
+
+    if (state != NULL) {
+        g_free(f->state);
+        f->state = g_strdup(state);
+    }
+
+    text = g_strdup_printf(gettext("%s\n\n%d covers assigned, %d entries "
+                                   "skipped, %u waiting for review."),
+                           f->state, f->progress.assigned, f->progress.skipped,
+                           g_queue_get_length(f->reviews));
+
+    gtk_label_set_text(GTK_LABEL(f->label), text);
+    g_free(text);
+}
+
+/* Every entry up to the first one waiting for review is done */
+static unsigned long long resolved_id(struct cover_fetch *f)
+{
+    struct fetch_entry *e = g_queue_peek_head(f->reviews);
+
+    return (e != NULL) ? e->id - 1 : f->walked_id;
+}
+
+static struct fetch_job *new_job(struct cover_fetch *f)
+{
+    struct fetch_job *j;
+
+    j = calloc(1, sizeof(struct fetch_job));
+
+    if (!j)
+        return NULL;
+
+    j->fetch = f;
+    j->c = f->c;
+    j->progress = f->progress;
+    j->progress.last_id = resolved_id(f);
+
+    return j;
+}
+
+/* Queues @j, whose @done must call job_ended() */
+static int submit_job(struct cover_fetch *f, struct fetch_job *j, db_job_func run,
+    db_job_done_func done)
+{
+    j->job = db_job_submit_background(run, done, j, free_fetch_job);
+
+    if (j->job == NULL)
+        return 0;
+
+    f->jobs = g_list_append(f->jobs, j->job);
+
+    return 1;
+}
+
+/* Once a stopped or finished search has no jobs left, the tab shows its covers */
+static void check_jobs(struct cover_fetch *f)
+{
+    if ((f->jobs != NULL) || (!f->stopped && !f->finished))
+        return;
+
+    if (f->changed && (f->dlg_data != NULL)) {
+        collection_widget_reload(f->dlg_data);
+        f->changed = 0;
+    }
+
+    if (f->stopped) {
+        __stopped = g_list_remove(__stopped, f);
+        free_fetch(f);
+    }
+}
+
+static void job_ended(struct fetch_job *j)
+{
+    struct cover_fetch *f = j->fetch;
+
+    f->jobs = g_list_remove(f->jobs, j->job);
+    check_jobs(f);
+}
+
+static int save_job(gpointer data)
+{
+    struct fetch_job *j = (struct fetch_job *)data;
+
+    return db_save_cover_fetch(j->c, &j->progress);
+}
+
+static int delete_job(gpointer data)
+{
+    struct fetch_job *j = (struct fetch_job *)data;
+
+    return db_delete_cover_fetch(j->c);
+}
+
+static void fetch_job_done(int result __attribute__((unused)),
+    int cancelled __attribute__((unused)), gpointer data)
+{
+    job_ended((struct fetch_job *)data);
+}
+
+static void save_progress(struct cover_fetch *f)
+{
+    struct fetch_job *j;
+
+    j = new_job(f);
+
+    if (j != NULL)
+        submit_job(f, j, save_job, fetch_job_done);
+}
+
+static int assign_job(gpointer data)
+{
+    struct fetch_job *j = (struct fetch_job *)data;
+
+    return db_set_entry_cover(j->c, j->id, j->filename, &j->progress);
+}
+
+static void assign_done(int result, int cancelled, gpointer data)
+{
+    struct fetch_job *j = (struct fetch_job *)data;
+    struct cover_fetch *f = j->fetch;
+
+    if (result > 0)
+        f->changed = 1;
+    else if (!cancelled) {
+        /* counted as given when it was asked, it's saved as such next time */
+        f->progress.assigned--;
+        f->progress.skipped++;
+    }
+
+    if (!f->stopped)
+        set_status(f, NULL);
+
+    job_ended(j);
+}
+
+/*
+ * Gives the entry @id the thumbnail @pixbuf, counted as assigned right away
+ * so the progress saved by the jobs queued after this one includes it.
+ */
+static void assign_cover(struct cover_fetch *f, unsigned long long id,
+    GdkPixbuf *pixbuf)
+{
+    struct fetch_job *j;
+
+    f->progress.assigned++;
+    j = new_job(f);
+
+    if (!j)
+        return;
+
+    j->id = id;
+    j->filename = create_unsaved_image_filename();
+
+    if (!image_save_thumbnail(pixbuf, j->filename, NULL)) {
+        free_fetch_job(j);
+        f->progress.assigned--;
+        f->progress.skipped++;
+        save_progress(f);
+
+        return;
+    }
+
+    submit_job(f, j, assign_job, assign_done);
+}
+
+static void finish_fetch(struct cover_fetch *f)
+{
+    struct fetch_job *j;
+
+    f->finished = 1;
+    j = new_job(f);
+
+    if (j != NULL)
+        submit_job(f, j, delete_job, fetch_job_done);
+
+    set_status(f, gettext("Done."));
+    gtk_button_set_label(GTK_BUTTON(f->bt_stop), GTK_STOCK_CLOSE);
+}
+
+/* Searches the next entry, unless the search is already waiting for something */
+static void resume_fetch(struct cover_fetch *f)
+{
+    if ((f->search != NULL) || (f->timeout != 0) || f->loading || f->failed ||
+        f->finished)
+    {
+        return;
+    }
+
+    if (f->walked) {
+        if (g_queue_is_empty(f->reviews))
+            finish_fetch(f);
+        else
+            set_status(f, gettext("Every entry has been searched."));
+
+        return;
+    }
+
+    fetch_next(f);
+}
+
+static void show_review(struct cover_fetch *f)
+{
+    struct fetch_entry *e;
+    GtkWidget *image;
+    char *text;
+    int i;
+
+    e = g_queue_peek_head(f->reviews);
+
+    if (e == NULL) {
+        gtk_widget_hide(f->review_frame);
+        return;
+    }
+
+    text = g_strdup_printf(gettext("Choose the cover of %s"), e->title);
+    gtk_label_set_text(GTK_LABEL(f->review_label), text);
+    g_free(text);
+
+    for (i = 0; i < f->page_size; i++) {
+        if (e->pixbufs[i] == NULL) {
+            gtk_widget_hide(f->bt_img[i]);
+            continue;
+        }
+
+        image = gtk_image_new_from_pixbuf(e->pixbufs[i]);
+        gtk_button_set_image(GTK_BUTTON(f->bt_img[i]), image);
+        gtk_widget_show(f->bt_img[i]);
+    }
+
+    gtk_widget_show(f->review_frame);
+}
+
+/* The entry being reviewed is done, with its image @index or skipped */
+static void review_done(struct cover_fetch *f, int index)
+{
+    struct fetch_entry *e;
+
+    e = g_queue_pop_head(f->reviews);
+
+    if (e == NULL)
+        return;
+
+    if (index >= 0)
+        assign_cover(f, e->id, e->pixbufs[index]);
+    else {
+        f->progress.skipped++;
+        save_progress(f);
+    }
+
+    free_entry(e, f->page_size);
+    show_review(f);
+    set_status(f, NULL);
+    resume_fetch(f);
+}
+
+static void s_bt_img_clicked(GtkButton *bt, struct cover_fetch *f)
+{
+    review_done(f, GPOINTER_TO_INT(g_object_get_data(G_OBJECT(bt), "bt-id")));
+}
+
+static void s_bt_skip_clicked(GtkButton *bt __attribute__((unused)),
+    struct cover_fetch *f)
+{
+    review_done(f, -1);
+}
+
+static void cover_found(int index, GBytes *bytes __attribute__((unused)),
+    GdkPixbuf *pixbuf, gpointer data)
+{
+    struct cover_fetch *f = (struct cover_fetch *)data;
+
+    if ((f->entry != NULL) && (index < f->page_size))
+        f->entry->pixbufs[index] = g_object_ref(pixbuf);
+}
+
+/* Gives the first image found that could be read, NULL if none could */
+static GdkPixbuf *first_image(struct cover_fetch *f, struct fetch_entry *e)
+{
+    int i;
+
+    for (i = 0; i < f->page_size; i++)
+        if (e->pixbufs[i] != NULL)
+            return e->pixbufs[i];
+
+    return NULL;
+}
+
+static void cover_searched(GPtrArray *images,
+    unsigned long long total __attribute__((unused)), const char *error,
+    gpointer data)
+{
+    struct cover_fetch *f = (struct cover_fetch *)data;
+    struct fetch_entry *e = f->entry;
+
+    f->search = NULL;
+    f->entry = NULL;
+
+    /* the entry is searched again the next time */
+    if (error != NULL) {
+        free_entry(e, f->page_size);
+        f->failed = 1;
+        set_status(f, error);
+        return;
+    }
+
+    f->walked_id = e->id;
+
+    /* images that can't be read can't be chosen either */
+    if ((images->len == 0) || (first_image(f, e) == NULL)) {
+        f->progress.skipped++;
+        free_entry(e, f->page_size);
+    } else if (f->progress.review) {
+        g_queue_push_tail(f->reviews, e);
+
+        if (g_queue_get_length(f->reviews) == 1)
+            show_review(f);
+    } else {
+        assign_cover(f, e->id, first_image(f, e));
+        free_entry(e, f->page_size);
+    }
+
+    /* the provider is not asked again too soon */
+    if (f->interval > 0)
+        f->timeout = g_timeout_add_seconds(f->interval, fetch_next, f);
+    else
+        f->timeout = g_idle_add(fetch_next, f);
+}
+
+/* Gives the query of @line, NULL if a value it uses is empty */
+static char *entry_query(struct cover_fetch *f, struct dlg_line *line)
+{
+    char token[16];
+    int i;
+
+    for (i = 0; i < f->c->active_fields; i++) {
+        snprintf(token, sizeof(token), "$%d", i + 1);
+
+        if ((strstr(f->progress.query, token) != NULL) &&
+            ((line->cells[i] == NULL) || (line->cells[i][0] == 0)))
+        {
+            return NULL;
+        }
+    }
+
+    return parse_web_query(f->progress.query, f->c, line->cells);
+}
+
+static struct fetch_entry *new_entry(struct cover_fetch *f, struct dlg_line *line)
+{
+    struct fetch_entry *e;
+    GString *title;
+    int i;
+
+    e = calloc(1, sizeof(struct fetch_entry));
+
+    if (!e)
+        return NULL;
+
+    e->pixbufs = calloc(f->page_size, sizeof(GdkPixbuf *));
+
+    if (!e->pixbufs) {
+        free(e);
+        return NULL;
+    }
+
+    title = g_string_new(NULL);
+
+    for (i = 0; i < f->c->active_fields; i++)
+        g_string_append_printf(title, "%s%s", (i == 0) ? "" : " - ",
+                               (line->cells[i] != NULL) ? line->cells[i] : "");
+
+    e->id = line->id;
+    e->title = g_string_free(title, FALSE);
+
+    return e;
+}
+
+static int load_job(gpointer data)
+{
+    struct fetch_job *j = (struct fetch_job *)data;
+
+    /* entries skipped since the last save are kept as well */
+    if (!db_save_cover_fetch(j->c, &j->progress))
+        return -1;
+
+    return db_load_entries_without_cover(j->c, j->id, FETCH_ENTRIES, j->lines,
+                                         j->store);
+}
+
+static void load_done(int result, int cancelled, gpointer data)
+{
+    struct fetch_job *j = (struct fetch_job *)data;
+    struct cover_fetch *f = j->fetch;
+
+    f->loading = 0;
+
+    if (cancelled || f->stopped) {
+        job_ended(j);
+        return;
+    }
+
+    if (result < 0) {
+        f->failed = 1;
+        set_status(f, gettext("The entries could not be read."));
+    } else if (result == 0)
+        f->walked = 1;
+    else {
+        free_lines(f);
+        f->lines = j->lines;
+        f->store = j->store;
+        f->next_line = 0;
+        j->lines = NULL;
+        j->store = NULL;
+    }
+
+    job_ended(j);
+    resume_fetch(f);
+}
+
+static void load_entries(struct cover_fetch *f)
+{
+    struct fetch_job *j;
+
+    j = new_job(f);
+
+    if (!j)
+        return;
+
+    j->id = f->walked_id;
+    j->lines = g_array_new(FALSE, FALSE, sizeof(struct dlg_line));
+    j->store = row_store_new(f->c->active_fields);
+
+    if (submit_job(f, j, load_job, load_done))
+        f->loading = 1;
+}
+
+static gboolean fetch_next(gpointer data)
+{
+    struct cover_fetch *f = (struct cover_fetch *)data;
+    struct dlg_line *line;
+    char *query, *text;
+
+    f->timeout = 0;
+
+    /* goes on once some of them are reviewed */
+    if (g_queue_get_length(f->reviews) >= REVIEW_QUEUE_MAX) {
+        set_status(f, gettext("Waiting for the covers to be reviewed."));
+        return FALSE;
+    }
+
+    for (; (f->lines != NULL) && (f->next_line < f->lines->len); f->next_line++) {
+        line = &g_array_index(f->lines, struct dlg_line, f->next_line);
+        query = entry_query(f, line);
+
+        if (query == NULL) {
+            f->walked_id = line->id;
+            f->progress.skipped++;
+            continue;
+        }
+
+        f->entry = new_entry(f, line);
+
+        if (f->entry != NULL)
+            f->search = image_search_start_background(query, 0, cover_found,
+                                                      cover_searched, f);
+
+        free(query);
+
+        if (f->search == NULL) {
+            if (f->entry != NULL)
+                free_entry(f->entry, f->page_size);
+
+            f->entry = NULL;
+            f->failed = 1;
+            set_status(f, gettext("The image provider can't be used. Check "
+                                  "your installation!"));
+
+            return FALSE;
+        }
+
+        text = g_strdup_printf(gettext("Searching the cover of %s..."),
+                               f->entry->title);
+
+        set_status(f, text);
+        g_free(text);
+        f->next_line++;
+
+        return FALSE;
+    }
+
+    load_entries(f);
+
+    return FALSE;
+}
+
+/*
+ * Stops @f, it's freed once its jobs are done. They still run, so the covers
+ * already chosen are kept, and the entries not done yet are searched again
+ * the next time.
+ */
+static void stop_fetch(struct cover_fetch *f)
+{
+    __fetches = g_list_remove(__fetches, f);
+
+    if (f->timeout != 0)
+        g_source_remove(f->timeout);
+
+    if (f->search != NULL)
+        image_search_cancel(f->search);
+
+    if (f->entry != NULL)
+        free_entry(f->entry, f->page_size);
+
+    while (!g_queue_is_empty(f->reviews))
+        free_entry(g_queue_pop_head(f->reviews), f->page_size);
+
+    f->stopped = 1;
+    __stopped = g_list_append(__stopped, f);
+
+    if (f->dialog != NULL)
+        gtk_widget_destroy(f->dialog);
+
+    check_jobs(f);
+}
+
+static void s_fetch_response(GtkDialog *dialog __attribute__((unused)),
+    gint response __attribute__((unused)), struct cover_fetch *f)
+{
+    stop_fetch(f);
+}
+
+static void create_fetch_dialog(struct cover_fetch *f)
+{
+    GtkWidget *dlg_box, *vbox, *hbox, *bt_skip;
+    char *title;
+    int i;
+
+    title = g_strdup_printf(gettext("Fetching covers - %s"), f->c->screen_name);
+    f->dialog = gtk_dialog_new_with_buttons(title,
+                                            GTK_WINDOW(ui_get_mainwindow()),
+                                            GTK_DIALOG_DESTROY_WITH_PARENT,
+                                            NULL);
+
+    g_free(title);
+    f->bt_stop = gtk_dialog_add_button(GTK_DIALOG(f->dialog), GTK_STOCK_STOP,
+                                       GTK_RESPONSE_CLOSE);
+
+    g_signal_connect(f->dialog, "response", G_CALLBACK(s_fetch_response), f);
+
+    /* goes away with the main window, when the application ends */
+    g_signal_connect(f->dialog, "destroy", G_CALLBACK(gtk_widget_destroyed),
+                     &f->dialog);
+    dlg_box = gtk_dialog_get_content_area(GTK_DIALOG(f->dialog));
+
+    f->label = gtk_label_new(NULL);
+    gtk_box_pack_start(GTK_BOX(dlg_box), f->label, FALSE, FALSE, 5);
+
+    /* images found for the entry being reviewed */
+    f->review_frame = gtk_frame_new(gettext("Review"));
+    vbox = gtk_vbox_new(FALSE, 3);
+    hbox = gtk_hbox_new(TRUE, 5);
+    f->review_label = gtk_label_new(NULL);
+    f->bt_img = malloc(sizeof(GtkWidget *) * f->page_size);
+
+    for (i = 0; i < f->page_size; i++) {
+        f->bt_img[i] = gtk_button_new();
+        g_object_set_data(G_OBJECT(f->bt_img[i]), "bt-id", GINT_TO_POINTER(i));
+        g_signal_connect(f->bt_img[i], "clicked", G_CALLBACK(s_bt_img_clicked), f);
+        gtk_box_pack_start(GTK_BOX(hbox), f->bt_img[i], FALSE, FALSE, 0);
+    }
+
+    bt_skip = gtk_button_new_with_label(gettext("Skip"));
+    g_signal_connect(bt_skip, "clicked", G_CALLBACK(s_bt_skip_clicked), f);
+
+    gtk_box_pack_start(GTK_BOX(vbox), f->review_label, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), hbox, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), bt_skip, FALSE, FALSE, 0);
+    gtk_container_add(GTK_CONTAINER(f->review_frame), vbox);
+    gtk_box_pack_start(GTK_BOX(dlg_box), f->review_frame, TRUE, TRUE, 0);
+
+    gtk_widget_show_all(f->dialog);
+    gtk_widget_hide(f->review_frame);
+}
+
+static struct cover_fetch *new_fetch(struct dlg_data *dlg_data,
+    struct cover_fetch_progress *progress)
+{
+    struct cover_fetch *f;
+    char *s;
+
+    f = calloc(1, sizeof(struct cover_fetch));
+
+    if (!f)
+        return NULL;
+
+    f->dlg_data = dlg_data;
+    f->c = dlg_data->c;
+    f->progress = *progress;
+    f->walked_id = progress->last_id;
+    f->page_size = image_search_page_size();
+    f->reviews = g_queue_new();
+
+    s = get_config_setting("image_provider", "fetch_interval");
+    f->interval = (s != NULL) ? atoi(s) : FETCH_INTERVAL;
+    f->interval = MAX(f->interval, 0);
+    g_free(s);
+
+    return f;
+}
+
+/* Asks how the covers are searched. Gives 0 if the user gives up. */
+static int fetch_dlg(struct db_collection *c, struct cover_fetch_progress *p,
+    int resume)
+{
+    GtkWidget *dialog, *dlg_box, *vbox, *label, *t_entry, *ck_review,
+        *ck_restart=NULL;
+    GString *text;
+    char *s;
+    int ret=0;
+
+    dialog = gtk_dialog_new_with_buttons(gettext("Fetch missing covers"),
+                                         GTK_WINDOW(ui_get_mainwindow()),
+                                         GTK_DIALOG_DESTROY_WITH_PARENT,
+                                         GTK_STOCK_OK, GTK_RESPONSE_ACCEPT,
+                                         GTK_STOCK_CANCEL, GTK_RESPONSE_REJECT,
+                                         NULL);
+
+    dlg_box = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
+    vbox = gtk_vbox_new(FALSE, 3);
+    text = create_web_query_label(c);
+    label = gtk_label_new(text->str);
+    t_entry = gtk_entry_new();
+    gtk_entry_set_text(GTK_ENTRY(t_entry),
+                       (p->query != NULL) ? p->query : DEFAULT_QUERY);
+
+    ck_review = gtk_check_button_new_with_label(gettext("Let me choose each "
+                                                        "cover"));
+
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(ck_review), p->review);
+    gtk_box_pack_start(GTK_BOX(vbox), label, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), t_entry, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), ck_review, FALSE, FALSE, 0);
+
+    if (resume) {
+        s = g_strdup_printf(gettext("Start again, %d covers have been assigned "
+                                    "and %d entries skipped"),
+                            p->assigned, p->skipped);
+
+        ck_restart = gtk_check_button_new_with_label(s);
+        gtk_box_pack_start(GTK_BOX(vbox), ck_restart, FALSE, FALSE, 0);
+        g_free(s);
+    }
+
+    gtk_container_add(GTK_CONTAINER(dlg_box), vbox);
+    gtk_widget_show_all(dialog);
+    ui_prepend_mainwindow(dialog);
+
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+        free(p->query);
+        p->query = strdup(gtk_entry_get_text(GTK_ENTRY(t_entry)));
+        p->review =
+            gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(ck_review)) ? 1 : 0;
+
+        if ((ck_restart != NULL) &&
+            gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(ck_restart)))
+        {
+            p->last_id = 0;
+            p->assigned = 0;
+            p->skipped = 0;
+        }
+
+        ret = 1;
+    }
+
+    g_string_free(text, TRUE);
+    ui_remove_mainwindow(dialog);
+    gtk_widget_destroy(dialog);
+
+    return ret;
+}
+
+/* Loading the saved progress of a collection, before its search starts */
+struct progress_request {
+    struct dlg_data             *dlg_data;  /* NULL once the tab is gone */
+    struct db_collection        *c;
+    struct db_job               *job;
+    struct cover_fetch_progress progress;
+};
+
+static int load_progress_job(gpointer data)
+{
+    struct progress_request *r = (struct progress_request *)data;
+
+    return db_load_cover_fetch(r->c, &r->progress);
+}
+
+static void free_progress_request(gpointer data)
+{
+    struct progress_request *r = (struct progress_request *)data;
+
+    __progress_requests = g_list_remove(__progress_requests, r);
+    free(r->progress.query);
+    free(r);
+}
+
+static struct progress_request *search_progress_request(struct dlg_data *dlg_data)
+{
+    GList *l;
+    struct progress_request *r;
+
+    for (l = g_list_first(__progress_requests); l; l = l->next) {
+        r = (struct progress_request *)l->data;
+
+        if (r->dlg_data == dlg_data)
+            return r;
+    }
+
+    return NULL;
+}
+
+static void progress_loaded(int result, int cancelled, gpointer data)
+{
+    struct progress_request *r = (struct progress_request *)data;
+    struct cover_fetch *f;
+
+    if (cancelled || (r->dlg_data == NULL))
+        return;
+
+    /* the request is still listed, so it isn't started twice meanwhile */
+    if ((result < 0) || !fetch_dlg(r->c, &r->progress, result > 0) ||
+        (r->dlg_data == NULL))
+    {
+        return;
+    }
+
+    f = new_fetch(r->dlg_data, &r->progress);
+
+    if (!f)
+        return;
+
+    r->progress.query = NULL;
+    create_fetch_dialog(f);
+    __fetches = g_list_append(__fetches, f);
+    set_status(f, gettext("Searching..."));
+    load_entries(f);
+}
+
+static struct cover_fetch *search_fetch(struct dlg_data *dlg_data)
+{
+    GList *l;
+    struct cover_fetch *f;
+
+    for (l = g_list_first(__fetches); l; l = l->next) {
+        f = (struct cover_fetch *)l->data;
+
+        if (f->dlg_data == dlg_data)
+            return f;
+    }
+
+    return NULL;
+}
+
+/*
+ * Starts searching the covers of the entries of a collection still without
+ * one, from where it was left, if it was.
+ */
+void cover_fetch_start(struct dlg_data *dlg_data)
+{
+    struct progress_request *r;
+    struct cover_fetch *f;
+    struct db_job *job;
+
+    f = search_fetch(dlg_data);
+
+    if ((f != NULL) && !f->finished) {
+        gtk_window_present(GTK_WINDOW(f->dialog));
+        return;
+    }
+
+    /* still reading where it was left */
+    if (search_progress_request(dlg_data) != NULL)
+        return;
+
+    if (f != NULL)
+        stop_fetch(f);
+
+    if (!image_plugin_load()) {
+        display_msg(GTK_MESSAGE_ERROR, gettext("Error"),
+                    gettext("Image provider not found. Check your installation!"));
+
+        return;
+    }
+
+    r = calloc(1, sizeof(struct progress_request));
+
+    if (!r)
+        return;
+
+    /* after the jobs of the searches made before, so it's up to date */
+    r->dlg_data = dlg_data;
+    r->c = dlg_data->c;
+    __progress_requests = g_list_append(__progress_requests, r);
+    job = db_job_submit_background(load_progress_job, progress_loaded, r,
+                                   free_progress_request);
+
+    /* @r is already freed otherwise */
+    if (job != NULL)
+        r->job = job;
+}
+
+/* Stops the search of the covers of a collection whose tab is going away */
+void cover_fetch_stop(struct dlg_data *dlg_data)
+{
+    struct progress_request *r;
+    struct cover_fetch *f;
+
+    r = search_progress_request(dlg_data);
+
+    if (r != NULL) {
+        r->dlg_data = NULL;
+        db_job_cancel(r->job);
+    }
+
+    f = search_fetch(dlg_data);
+
+    if (f == NULL)
+        return;
+
+    f->dlg_data = NULL;
+    stop_fetch(f);
+}
+
+/*
+ * Stops the search of the covers of @c, and drops the jobs of its searches
+ * that haven't run yet, before @c is changed or deleted. Those run after the
+ * change otherwise, as it doesn't wait for background jobs. Entries whose
+ * cover was dropped are searched again the next time.
+ */
+void cover_fetch_discard(struct db_collection *c)
+{
+    struct progress_request *r;
+    struct cover_fetch *f;
+    GList *l, *j;
+
+    for (l = g_list_first(__progress_requests); l; l = l->next) {
+        r = (struct progress_request *)l->data;
+
+        if (r->c == c) {
+            r->dlg_data = NULL;
+            db_job_cancel(r->job);
+        }
+    }
+
+    for (l = g_list_first(__fetches); l; l = l->next) {
+        f = (struct cover_fetch *)l->data;
+
+        if (f->c == c) {
+            cover_fetch_stop(f->dlg_data);
+            break;
+        }
+    }
+
+    for (l = g_list_first(__stopped); l; l = l->next) {
+        f = (struct cover_fetch *)l->data;
+
+        if (f->c == c)
+            for (j = g_list_first(f->jobs); j; j = j->next)
+                db_job_cancel((struct db_job *)j->data);
+    }
+}
+
+void cover_fetch_stop_all(void)
+{
+    struct cover_fetch *f;
+
+    while (__fetches != NULL) {
+        f = (struct cover_fetch *)__fetches->data;
+        f->dlg_data = NULL;
+        stop_fetch(f);
+    }
+}
@@ -0,0 +1,279 @@
+
+/*
+ * Description: grid showing the cover of every entry of a collection.
+ *
+ * Only the visible cells are drawn, straight into a drawing area, so there
+ * are no widgets per entry and large collections cost as much as small ones.
+ * Covers that aren't cached are drawn as the default one while they are
+ * decoded in the background.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gtkollection.h"
+
+#define CELL_PADDING                8
+#define CELL_SIZE                   (THUMBNAIL_SIZE + CELL_PADDING)
+
+struct cover_grid {
+    struct dlg_data *dlg_data;
+    GtkTreeModel    *model;
+    GtkWidget       *area;
+    GtkAdjustment   *adj;
+    GdkPixbuf       *placeholder;
+    int             columns;
+
+    /* covers being decoded, the grid is freed after they are done */
+    GHashTable      *loading;
+    int             destroyed;
+};
+
+static void free_grid(struct cover_grid *grid)
+{
+    g_object_unref(grid->model);
+    g_hash_table_destroy(grid->loading);
+    g_object_unref(grid->placeholder);
+    free(grid);
+}
+
+static int n_entries(struct cover_grid *grid)
+{
+    return gtk_tree_model_iter_n_children(grid->model, NULL);
+}
+
+static void update_adjustment(struct cover_grid *grid)
+{
+    GtkAllocation allocation;
+    int rows;
+
+    gtk_widget_get_allocation(grid->area, &allocation);
+    grid->columns = MAX(1, allocation.width / CELL_SIZE);
+    rows = (n_entries(grid) + grid->columns - 1) / grid->columns;
+
+    gtk_adjustment_configure(grid->adj,
+                             MIN(gtk_adjustment_get_value(grid->adj),
+                                 MAX(0, rows * CELL_SIZE - allocation.height)),
+                             0, rows * CELL_SIZE, CELL_SIZE / 4,
+                             allocation.height, allocation.height);
+}
+
+static void cover_ready(GdkPixbuf *pixbuf __attribute__((unused)),
+    const char *filename, gpointer data)
+{
+    struct cover_grid *grid = (struct cover_grid *)data;
+
+    g_hash_table_remove(grid->loading, filename);
+
+    if (!grid->destroyed)
+        gtk_widget_queue_draw(grid->area);
+    else if (g_hash_table_size(grid->loading) == 0)
+        free_grid(grid);
+}
+
+/* Gives the cover of entry @idx if it's ready to be drawn, NULL otherwise */
+static GdkPixbuf *entry_cover(struct cover_grid *grid, int idx)
+{
+    GdkPixbuf *pixbuf;
+    char *filename;
+
+    /* rows being read are drawn once they arrive */
+    filename = collection_model_get_image(grid->model, idx);
+
+    if (filename == NULL)
+        return NULL;
+
+    pixbuf = image_cache_peek(filename);
+
+    if ((pixbuf == NULL) && !g_hash_table_lookup(grid->loading, filename)) {
+        g_hash_table_insert(grid->loading, filename, GINT_TO_POINTER(1));
+        image_cache_load(filename, cover_ready, grid);
+
+        return NULL;
+    }
+
+    g_free(filename);
+
+    return pixbuf;
+}
+
+static void draw_cell(struct cover_grid *grid, cairo_t *cr, int idx, int x, int y)
+{
+    GdkPixbuf *pixbuf;
+
+    pixbuf = entry_cover(grid, idx);
+
+    if (pixbuf == NULL)
+        pixbuf = grid->placeholder;
+
+    x += (CELL_SIZE - gdk_pixbuf_get_width(pixbuf)) / 2;
+    y += (CELL_SIZE - gdk_pixbuf_get_height(pixbuf)) / 2;
+    gdk_cairo_set_source_pixbuf(cr, pixbuf, x, y);
+    cairo_paint(cr);
+}
+
+static gboolean s_expose(GtkWidget *area, GdkEventExpose *event,
+    struct cover_grid *grid)
+{
+    cairo_t *cr;
+    int offset, row, col, idx, n, y;
+
+    cr = gdk_cairo_create(gtk_widget_get_window(area));
+    gdk_cairo_region(cr, event->region);
+    cairo_clip(cr);
+
+    n = n_entries(grid);
+    offset = (int)gtk_adjustment_get_value(grid->adj);
+
+    /* only the rows crossing the exposed area */
+    for (row = (offset + event->area.y) / CELL_SIZE;
+         (y = row * CELL_SIZE - offset) < event->area.y + event->area.height;
+         row++)
+    {
+        for (col = 0; col < grid->columns; col++) {
+            idx = row * grid->columns + col;
+
+            if (idx >= n)
+                break;
+
+            draw_cell(grid, cr, idx, col * CELL_SIZE, y);
+        }
+    }
+
+    cairo_destroy(cr);
+
+    return TRUE;
+}
+
+static void s_size_allocate(GtkWidget *area __attribute__((unused)),
+    GtkAllocation *allocation __attribute__((unused)), struct cover_grid *grid)
+{
+    update_adjustment(grid);
+}
+
+static gboolean s_scroll(GtkWidget *area __attribute__((unused)),
+    GdkEventScroll *event, struct cover_grid *grid)
+{
+    double value, step;
+
+    value = gtk_adjustment_get_value(grid->adj);
+    step = CELL_SIZE / 2;
+
+    if (event->direction == GDK_SCROLL_UP)
+        value -= step;
+    else if (event->direction == GDK_SCROLL_DOWN)
+        value += step;
+    else
+        return FALSE;
+
+    value = CLAMP(value, 0, gtk_adjustment_get_upper(grid->adj) -
+                            gtk_adjustment_get_page_size(grid->adj));
+
+    gtk_adjustment_set_value(grid->adj, MAX(0, value));
+
+    return TRUE;
+}
+
+/* Selects the clicked entry, and edits it on double click as the treeview does */
+static gboolean s_button_press(GtkWidget *area __attribute__((unused)),
+    GdkEventButton *event, struct cover_grid *grid)
+{
+    GtkTreeView *treeview = GTK_TREE_VIEW(grid->dlg_data->priv.treeview);
+    GtkTreePath *path;
+    int row, col, idx;
+
+    if (event->button != 1)
+        return FALSE;
+
+    col = (int)event->x / CELL_SIZE;
+    row = ((int)event->y + (int)gtk_adjustment_get_value(grid->adj)) / CELL_SIZE;
+    idx = row * grid->columns + col;
+
+    if ((col >= grid->columns) || (idx >= n_entries(grid)))
+        return FALSE;
+
+    path = gtk_tree_path_new_from_indices(idx, -1);
+    gtk_tree_selection_select_path(gtk_tree_view_get_selection(treeview), path);
+
+    if (event->type == GDK_2BUTTON_PRESS)
+        gtk_tree_view_row_activated(treeview, path, NULL);
+
+    gtk_tree_path_free(path);
+
+    return TRUE;
+}
+
+static void s_adjustment_changed(GtkAdjustment *adj __attribute__((unused)),
+    struct cover_grid *grid)
+{
+    gtk_widget_queue_draw(grid->area);
+}
+
+static void s_model_changed(struct cover_grid *grid)
+{
+    update_adjustment(grid);
+    gtk_widget_queue_draw(grid->area);
+}
+
+static void s_destroy(GtkWidget *area __attribute__((unused)),
+    struct cover_grid *grid)
+{
+    g_signal_handlers_disconnect_by_func(grid->model, s_model_changed, grid);
+    grid->destroyed = 1;
+
+    if (g_hash_table_size(grid->loading) == 0)
+        free_grid(grid);
+}
+
+/*
+ * Creates the cover grid of a collection tab, showing the rows of its model
+ * in the same order.
+ */
+GtkWidget *cover_grid_new(struct dlg_data *dlg_data)
+{
+    struct cover_grid *grid;
+    GtkWidget *hbox, *scrollbar;
+
+    grid = calloc(1, sizeof(struct cover_grid));
+
+    if (!grid)
+        return NULL;
+
+    grid->dlg_data = dlg_data;
+    grid->model = g_object_ref(dlg_data->priv.model);
+    grid->columns = 1;
+    grid->placeholder = image_cache_lookup("default_image_xpm");
+    grid->loading = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    grid->adj = GTK_ADJUSTMENT(gtk_adjustment_new(0, 0, 0, 0, 0, 0));
+    grid->area = gtk_drawing_area_new();
+
+    gtk_widget_add_events(grid->area, GDK_BUTTON_PRESS_MASK | GDK_SCROLL_MASK);
+    g_signal_connect(grid->area, "expose-event", G_CALLBACK(s_expose), grid);
+    g_signal_connect(grid->area, "size-allocate", G_CALLBACK(s_size_allocate), grid);
+    g_signal_connect(grid->area, "scroll-event", G_CALLBACK(s_scroll), grid);
+    g_signal_connect(grid->area, "button-press-event", G_CALLBACK(s_button_press),
+                     grid);
+
+    g_signal_connect(grid->area, "destroy", G_CALLBACK(s_destroy), grid);
+    g_signal_connect(grid->adj, "value-changed", G_CALLBACK(s_adjustment_changed),
+                     grid);
+
+    /* every change of the rows may move the covers */
+    g_signal_connect_swapped(grid->model, "row-changed", G_CALLBACK(s_model_changed),
+                             grid);
+
+    g_signal_connect_swapped(grid->model, "row-inserted", G_CALLBACK(s_model_changed),
+                             grid);
+
+    g_signal_connect_swapped(grid->model, "row-deleted", G_CALLBACK(s_model_changed),
+                             grid);
+
+    g_signal_connect_swapped(grid->model, "reset", G_CALLBACK(s_model_changed), grid);
+
+    scrollbar = gtk_vscrollbar_new(grid->adj);
+    hbox = gtk_hbox_new(FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(hbox), grid->area, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(hbox), scrollbar, FALSE, FALSE, 0);
+
+    return hbox;
+}
@@ -5,6 +5,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <libintl.h>
 #include <sys/stat.h>
 #include <libgen.h>
@@ -17,7 +18,265 @@
 #define SEARCH_ONLY_NAME                1
 #define SEARCH_STATUS_DIFF              2
 
+/* Statements that are not bound to a specific collection use this id */
+#define STMT_GLOBAL                     0
+
+#define STMT_KEY(collection_id, op)     GINT_TO_POINTER(((collection_id) << 8) | (op))
+#define STMT_KEY_COLLECTION(key)        (GPOINTER_TO_INT(key) >> 8)
+
+enum stmt_op {
+    STMT_COLLECTION_ID = 1,
+    STMT_LOAD_CATALOG,
+    STMT_INSERT_COLLECTION,
+    STMT_DELETE_COLLECTION,
+    STMT_RENAME_COLLECTION,
+    STMT_INSERT_FIELD,
+    STMT_DELETE_FIELDS,
+    STMT_UPDATE_FIELD_STATUS,
+    STMT_LOAD_COUNTER,
+    STMT_DELETE_COUNTER,
+    STMT_UNUSED_IMAGES,
+    STMT_DELETE_UNUSED_IMAGES,
+    STMT_LOAD_PAGE,
+    STMT_SEEK_PAGE,
+    STMT_INSERT_ENTRY,
+    STMT_INSERT_BATCH,
+    STMT_INSERT_TAIL,
+    STMT_UPDATE_ENTRY,
+    STMT_UPDATE_ENTRY_CELLS,
+    STMT_DELETE_BATCH,
+    STMT_SEARCH_PAGE,
+    STMT_COUNT_ROWS,
+    STMT_LOAD_COVER_FETCH,
+    STMT_SAVE_COVER_FETCH,
+    STMT_DELETE_COVER_FETCH,
+    STMT_NO_COVER_PAGE,
+    STMT_SET_COVER
+};
+
+/*
+ * Prepared statements of a database connection, indexed by the collection
+ * they belong to and the operation they execute.
+ */
+struct stmt_cache {
+    sqlite3         *db;
+    GHashTable      *stmts;
+    unsigned long   hits;
+    unsigned long   misses;
+};
+
+/* sqlite versions prior to 3.32 limit a statement to 999 parameters */
+#define DB_MAX_VARIABLES                999
+#define DB_BATCH_ROWS                   128
+
+/*
+ * Collation of the sort columns. It must not depend on the locale, since
+ * indexes built with it are kept in the database.
+ */
+#define DB_SORT_COLLATION               "utf8_nocase"
+
+/* virtual machine instructions between checks for cancelled jobs */
+#define DB_PROGRESS_OPS                 1000
+
+#define DB_BUSY_TIMEOUT                 5000        /* ms */
+#define DB_MAX_READERS                  8
+#define DB_JOURNAL_SIZE_LIMIT           (64 * 1024 * 1024)
+
+/*
+ * Thread running PASSIVE checkpoints of the WAL file through its own
+ * connection, so the main loop never waits for one.
+ */
+struct checkpointer {
+    GThread     *thread;
+    GMutex      lock;
+    GCond       cond;
+    int         stop;
+    int         interval;
+    char        *db_filename;
+};
+
+/*
+ * Read-only connection used by the reader threads to load rows, so several
+ * collections can be read at the same time. Only opened in WAL mode, where
+ * readers and the writer don't block each other.
+ */
+struct db_reader {
+    sqlite3             *db;
+    struct stmt_cache   *stmt_cache;
+};
+
 static sqlite3 *__db;
+static struct stmt_cache *__stmt_cache;
+static struct checkpointer *__checkpointer = NULL;
+
+/* idle readers, and the one being used by the current thread */
+static GAsyncQueue *__readers = NULL;
+static int __n_readers = 0;
+static GPrivate __reader;
+
+static void stmt_finalize(gpointer stmt)
+{
+    sqlite3_finalize((sqlite3_stmt *)stmt);
+}
+
+static struct stmt_cache *create_stmt_cache(sqlite3 *db)
+{
+    struct stmt_cache *cache;
+
+    cache = malloc(sizeof(struct stmt_cache));
+
+    if (!cache)
+        return NULL;
+
+    cache->db = db;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->stmts = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                         stmt_finalize);
+
+    return cache;
+}
+
+static void destroy_stmt_cache(struct stmt_cache *cache)
+{
+    g_hash_table_destroy(cache->stmts);
+    free(cache);
+}
+
+/*
+ * Returns the cached statement of @op, already reset and without bindings,
+ * or NULL if it was not prepared yet.
+ */
+static sqlite3_stmt *stmt_cache_lookup(struct stmt_cache *cache, int collection_id,
+    int op)
+{
+    sqlite3_stmt *stmt;
+
+    stmt = g_hash_table_lookup(cache->stmts, STMT_KEY(collection_id, op));
+
+    if (stmt == NULL) {
+        cache->misses++;
+        return NULL;
+    }
+
+    cache->hits++;
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    return stmt;
+}
+
+static sqlite3_stmt *stmt_cache_prepare(struct stmt_cache *cache,
+    int collection_id, int op, const char *sql)
+{
+    sqlite3_stmt *stmt;
+
+    if (sqlite3_prepare_v2(cache->db, sql, -1, &stmt, NULL) != SQLITE_OK)
+        return NULL;
+
+    g_hash_table_replace(cache->stmts, STMT_KEY(collection_id, op), stmt);
+
+    return stmt;
+}
+
+static gboolean stmt_belongs_to(gpointer key, gpointer value __attribute__((unused)),
+    gpointer collection_id)
+{
+    return STMT_KEY_COLLECTION(key) == GPOINTER_TO_INT(collection_id);
+}
+
+/*
+ * Drops every statement of a collection. Must be called whenever its table
+ * is renamed or has its columns changed.
+ */
+static void stmt_cache_invalidate(struct stmt_cache *cache, int collection_id)
+{
+    g_hash_table_foreach_remove(cache->stmts, stmt_belongs_to,
+                                GINT_TO_POINTER(collection_id));
+}
+
+static sqlite3_stmt *db_vprepare_stmt(int collection_id, int op, const char *fmt,
+    va_list ap)
+{
+    sqlite3_stmt *stmt;
+    char *sql;
+
+    sql = g_strdup_vprintf(fmt, ap);
+    stmt = stmt_cache_prepare(__stmt_cache, collection_id, op, sql);
+    g_free(sql);
+
+    return stmt;
+}
+
+/*
+ * Prepares a statement from the printf-like @fmt and stores it in the main
+ * connection cache. Used when the caller has already missed the lookup.
+ */
+static sqlite3_stmt *db_prepare_stmt(int collection_id, int op, const char *fmt, ...)
+{
+    sqlite3_stmt *stmt;
+    va_list ap;
+
+    va_start(ap, fmt);
+    stmt = db_vprepare_stmt(collection_id, op, fmt, ap);
+    va_end(ap);
+
+    return stmt;
+}
+
+/*
+ * Gets a statement from the main connection cache, preparing it from the
+ * printf-like @fmt if it isn't there yet.
+ */
+static sqlite3_stmt *db_get_stmt(int collection_id, int op, const char *fmt, ...)
+{
+    sqlite3_stmt *stmt;
+    va_list ap;
+
+    stmt = stmt_cache_lookup(__stmt_cache, collection_id, op);
+
+    if (stmt != NULL)
+        return stmt;
+
+    va_start(ap, fmt);
+    stmt = db_vprepare_stmt(collection_id, op, fmt, ap);
+    va_end(ap);
+
+    return stmt;
+}
+
+/*
+ * Like db_get_stmt() but for operations whose SQL changes at runtime, the
+ * cached statement is only reused if it was prepared from the same @sql.
+ * On reader threads the statement belongs to their reader connection.
+ */
+static sqlite3_stmt *db_get_stmt_sql(int collection_id, int op, const char *sql)
+{
+    struct db_reader *reader = g_private_get(&__reader);
+    struct stmt_cache *cache;
+    sqlite3_stmt *stmt;
+
+    cache = (reader != NULL) ? reader->stmt_cache : __stmt_cache;
+    stmt = g_hash_table_lookup(cache->stmts, STMT_KEY(collection_id, op));
+
+    if ((stmt != NULL) && !strcmp(sqlite3_sql(stmt), sql)) {
+        cache->hits++;
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+
+        return stmt;
+    }
+
+    cache->misses++;
+
+    return stmt_cache_prepare(cache, collection_id, op, sql);
+}
+
+void db_get_stmt_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+    *hits = __stmt_cache->hits;
+    *misses = __stmt_cache->misses;
+}
 
 static int search_in_list(GList *list, struct db_field *f, int search_type)
 {
@@ -78,6 +337,78 @@ static GList *fields_compare_by_status(GList *l1, GList *l2)
     return diff;
 }
 
+/*
+ * Number of entries of each collection, kept by triggers on the collection
+ * tables so it never needs to be counted. Also created on databases from
+ * older versions.
+ */
+static int db_create_counters_table(void)
+{
+    char *emsg=NULL;
+
+    if (sqlite3_exec(__db, "CREATE TABLE IF NOT EXISTS collection_counters ("
+                           "cat_id integer primary key, "
+                           "n_entries integer NOT NULL default 0"
+                           ")",
+                           NULL, 0, &emsg) != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: %s\n", emsg);
+        sqlite3_free(emsg);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Number of entries using each cover image, kept by triggers on the collection
+ * tables. Images are shared by entries with the same cover, and removed once
+ * none of them uses it.
+ */
+static int db_create_images_table(void)
+{
+    char *emsg=NULL;
+
+    if (sqlite3_exec(__db, "CREATE TABLE IF NOT EXISTS collection_images ("
+                           "filename varchar(256) primary key, "
+                           "refs integer NOT NULL default 0"
+                           ")",
+                           NULL, 0, &emsg) != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: %s\n", emsg);
+        sqlite3_free(emsg);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Where the search of the missing covers of each collection was left, so it
+ * goes on from there the next time. See cover_fetch.c.
+ */
+static int db_create_cover_fetch_table(void)
+{
+    char *emsg=NULL;
+
+    if (sqlite3_exec(__db, "CREATE TABLE IF NOT EXISTS collection_cover_fetch ("
+                           "cat_id integer primary key, "
+                           "last_id integer NOT NULL default 0, "
+                           "query varchar(256) NOT NULL, "
+                           "review integer NOT NULL default 0, "
+                           "assigned integer NOT NULL default 0, "
+                           "skipped integer NOT NULL default 0"
+                           ")",
+                           NULL, 0, &emsg) != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: %s\n", emsg);
+        sqlite3_free(emsg);
+        return 0;
+    }
+
+    return 1;
+}
+
 static int db_create_main_tables(void)
 {
     char *emsg=NULL;
@@ -108,29 +439,31 @@ static int db_create_main_tables(void)
         return 0;
     }
 
-    return 1;
+    return db_create_counters_table() && db_create_images_table() &&
+           db_create_cover_fetch_table();
 }
 
 static int db_get_collection_id(const char *name)
 {
     int id=0;
-    char str_query[256]={0};
     sqlite3_stmt *stmt;
 
-    snprintf(str_query, 256, "SELECT id FROM tab_collection WHERE name = '%s'",
-             name);
+    stmt = db_get_stmt(STMT_GLOBAL, STMT_COLLECTION_ID,
+                       "SELECT id FROM tab_collection WHERE name = ?");
 
-    if (sqlite3_prepare_v2(__db, str_query, -1, &stmt, NULL) != SQLITE_OK) {
-        display_msg(GTK_MESSAGE_ERROR, gettext(gettext("Error")),
-                    gettext("Error searching the '%s' collection id"), name);
+    if (stmt == NULL) {
+        db_error(GTK_MESSAGE_ERROR, gettext(gettext("Error")),
+                 gettext("Error searching the '%s' collection id"), name);
 
         return -1;
     }
 
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+
     while (sqlite3_step(stmt) == SQLITE_ROW)
-        id = strtol((char *)sqlite3_column_text(stmt, 0), NULL, 10);
+        id = sqlite3_column_int(stmt, 0);
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
 
     return id;
 }
@@ -159,7 +492,7 @@ static int db_create_collection_table(struct db_collection *c)
     g_string_append_printf(s, ")");
 
     if (sqlite3_exec(__db, s->str, NULL, 0, &emsg) != SQLITE_OK) {
-        display_msg(GTK_MESSAGE_ERROR, gettext(gettext("Error")), "%s", emsg);
+        db_error(GTK_MESSAGE_ERROR, gettext(gettext("Error")), "%s", emsg);
         sqlite3_free(emsg);
         return -1;
     }
@@ -168,187 +501,501 @@ static int db_create_collection_table(struct db_collection *c)
     return 0;
 }
 
-static void __insert_field(struct db_field *f, int *collection_id)
+/* Gives the active fields of @c as "@prefix.field, ..." */
+static GString *prefixed_fields(struct db_collection *c, const char *prefix)
 {
-    char str_query[256]={0}, *emsg;
-
-    memset(str_query, 0, sizeof(str_query));
-    snprintf(str_query, 256, "INSERT INTO collection_fields (cat_id, name, "
-                             "field_size, screen_name, status) VALUES "
-                             "(%d, \"%s\", %d, \"%s\", %d)",
-                             *collection_id, f->name, DEFAULT_FIELD_SIZE,
-                             f->screen_name, f->status);
+    GString *s;
+    GList *l;
+    struct db_field *f;
 
-    if (sqlite3_exec(__db, str_query, NULL, 0, &emsg) != SQLITE_OK) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"), "%s", emsg);
-        sqlite3_free(emsg);
-        return;
-    }
-}
+    s = g_string_new(NULL);
 
-static char *get_db_collection_image_path(int collection_id)
-{
-    char path[256]={0};
+    for (l = g_list_first(c->fields); l; l = l->next) {
+        f = (struct db_field *)l->data;
 
-    snprintf(path, sizeof(path), "%s/%s/collections/c%d", getenv("HOME"),
-             APP_CONFIG_PATH, collection_id);
+        if (f->status == FIELD_ACTIVE)
+            g_string_append_printf(s, "%s%s.%s", (s->len > 0) ? ", " : "", prefix,
+                                   f->name);
+    }
 
-    return strdup(path);
+    return s;
 }
 
-static void create_collection_image_dir(int collection_id)
+static void db_drop_search_index(const char *name)
 {
-    char *path;
-    mode_t mode;
+    char *sql, *emsg;
 
-    mode = S_IWUSR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
-    path = get_db_collection_image_path(collection_id);
+    sql = g_strdup_printf("DROP TRIGGER IF EXISTS %s_fts_ai; "
+                          "DROP TRIGGER IF EXISTS %s_fts_ad; "
+                          "DROP TRIGGER IF EXISTS %s_fts_au; "
+                          "DROP TABLE IF EXISTS %s_fts",
+                          name, name, name, name);
 
-    if (access(path, 0x00) == -1)
-        mkdir(path, mode);
+    if (sqlite3_exec(__db, sql, NULL, 0, &emsg) != SQLITE_OK) {
+        fprintf(stderr, "Error: %s\n", emsg);
+        sqlite3_free(emsg);
+    }
 
-    free(path);
+    g_free(sql);
 }
 
-void db_create_collection(struct db_collection *c, int gtk_status)
+/*
+ * Creates the full-text index of a collection, an external content FTS5
+ * table holding its active fields that triggers keep in sync with the
+ * collection table. Returns 1 if the index is available.
+ *
+ * Collections keep working without it, so errors are only reported on
+ * stderr (sqlite may have been built without FTS5).
+ */
+static int db_create_search_index(struct db_collection *c)
 {
-    char str_query[256]={0}, *emsg;
-    int collection_id;
-
-    if (db_create_collection_table(c) < 0)
-        return;
+    GString *s, *new_fields, *old_fields;
+    char *emsg;
+    int ret=1;
 
-    /* Insert the new collection entry */
-    snprintf(str_query, 256, "INSERT INTO tab_collection (name, screen_name) "
-                             "VALUES (\"%s\", \"%s\")", c->name, c->screen_name);
+    if (c->active_fields == 0)
+        return 0;
 
-    if (sqlite3_exec(__db, str_query, NULL, 0, &emsg) != SQLITE_OK) {
-        if (gtk_status == TRUE)
-            display_msg(GTK_MESSAGE_ERROR, gettext("Error"), "%s", emsg);
-        else
-            fprintf(stderr, "Error: %s\n", emsg);
+    new_fields = prefixed_fields(c, "new");
+    old_fields = prefixed_fields(c, "old");
+
+    s = g_string_new("SAVEPOINT search_index; ");
+    g_string_append_printf(s, "CREATE VIRTUAL TABLE %s_fts USING fts5(%s, "
+                              "content='%s', content_rowid='id', "
+                              "tokenize='unicode61 remove_diacritics 2'); ",
+                           c->name, c->sql_fields_stmt->str, c->name);
+
+    g_string_append_printf(s, "CREATE TRIGGER %s_fts_ai AFTER INSERT ON %s BEGIN "
+                              "INSERT INTO %s_fts (rowid, %s) VALUES (new.id, %s); "
+                              "END; ",
+                           c->name, c->name, c->name, c->sql_fields_stmt->str,
+                           new_fields->str);
+
+    g_string_append_printf(s, "CREATE TRIGGER %s_fts_ad AFTER DELETE ON %s BEGIN "
+                              "INSERT INTO %s_fts (%s_fts, rowid, %s) "
+                              "VALUES ('delete', old.id, %s); END; ",
+                           c->name, c->name, c->name, c->name,
+                           c->sql_fields_stmt->str, old_fields->str);
+
+    g_string_append_printf(s, "CREATE TRIGGER %s_fts_au AFTER UPDATE ON %s BEGIN "
+                              "INSERT INTO %s_fts (%s_fts, rowid, %s) "
+                              "VALUES ('delete', old.id, %s); "
+                              "INSERT INTO %s_fts (rowid, %s) VALUES (new.id, %s); "
+                              "END; ",
+                           c->name, c->name, c->name, c->name,
+                           c->sql_fields_stmt->str, old_fields->str, c->name,
+                           c->sql_fields_stmt->str, new_fields->str);
+
+    /* index the rows the collection already has */
+    g_string_append_printf(s, "INSERT INTO %s_fts (%s_fts) VALUES ('rebuild'); "
+                              "RELEASE search_index",
+                           c->name, c->name);
 
+    if (sqlite3_exec(__db, s->str, NULL, 0, &emsg) != SQLITE_OK) {
+        fprintf(stderr, "Error: %s\n", emsg);
         sqlite3_free(emsg);
-        return;
-    }
+        sqlite3_exec(__db, "ROLLBACK TO search_index; RELEASE search_index",
+                     NULL, 0, NULL);
 
-    collection_id = db_get_collection_id(c->name);
+        ret = 0;
+    }
 
-    /* Insert fields from the new collection */
-    g_list_foreach(c->fields, (GFunc)__insert_field, &collection_id);
+    g_string_free(old_fields, TRUE);
+    g_string_free(new_fields, TRUE);
+    g_string_free(s, TRUE);
 
-    create_collection_image_dir(collection_id);
-    c->image_path = get_db_collection_image_path(collection_id);
+    return ret;
 }
 
-int db_delete_collection(const char *name)
+/*
+ * Starts counting the entries of a collection, with the ones it already has.
+ * Triggers are named after the collection id so they survive renames.
+ */
+static int db_create_entry_counter(struct db_collection *c)
 {
-    char str_query[256]={0}, *emsg;
-    int collection_id;
-
-    collection_id = db_get_collection_id(name);
+    GString *s;
+    char *emsg;
+    int ret=1;
+
+    s = g_string_new("SAVEPOINT entry_counter; ");
+    g_string_append_printf(s, "INSERT OR REPLACE INTO collection_counters "
+                              "(cat_id, n_entries) "
+                              "SELECT %d, count(*) FROM %s; ",
+                           c->id, c->name);
+
+    g_string_append_printf(s, "CREATE TRIGGER IF NOT EXISTS c%d_count_ai "
+                              "AFTER INSERT ON %s BEGIN "
+                              "UPDATE collection_counters SET n_entries = "
+                              "n_entries + 1 WHERE cat_id = %d; END; ",
+                           c->id, c->name, c->id);
+
+    g_string_append_printf(s, "CREATE TRIGGER IF NOT EXISTS c%d_count_ad "
+                              "AFTER DELETE ON %s BEGIN "
+                              "UPDATE collection_counters SET n_entries = "
+                              "n_entries - 1 WHERE cat_id = %d; END; "
+                              "RELEASE entry_counter",
+                           c->id, c->name, c->id);
 
-    if (collection_id <= 0) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"),
-                    gettext("Collection '%s' not found!"), name);
+    if (sqlite3_exec(__db, s->str, NULL, 0, &emsg) != SQLITE_OK) {
+        fprintf(stderr, "Error: %s\n", emsg);
+        sqlite3_free(emsg);
+        sqlite3_exec(__db, "ROLLBACK TO entry_counter; RELEASE entry_counter",
+                     NULL, 0, NULL);
 
-        return 0;
+        ret = 0;
     }
 
-    snprintf(str_query, 256, "DELETE FROM tab_collection WHERE id = %d",
-             collection_id);
+    g_string_free(s, TRUE);
 
-    if (sqlite3_exec(__db, str_query, NULL, 0, &emsg) != SQLITE_OK) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"), "%s", emsg);
-        sqlite3_free(emsg);
-        return 0;
-    }
+    return ret;
+}
 
-    snprintf(str_query, 256, "DELETE FROM collection_fields WHERE cat_id = %d",
-             collection_id);
+/*
+ * Starts counting the uses of the images of a collection, with the entries it
+ * already has. The default image isn't counted.
+ */
+static int db_create_image_refs(struct db_collection *c)
+{
+    GString *s;
+    char *emsg;
+    int ret=1;
+
+    s = g_string_new("SAVEPOINT image_refs; ");
+    g_string_append_printf(s, "INSERT OR IGNORE INTO collection_images (filename) "
+                              "SELECT DISTINCT c_image FROM %s "
+                              "WHERE c_image <> 'default_image_xpm'; "
+                              "UPDATE collection_images SET refs = refs + "
+                              "(SELECT count(*) FROM %s WHERE c_image = filename) "
+                              "WHERE filename IN (SELECT c_image FROM %s); ",
+                           c->name, c->name, c->name);
+
+    g_string_append_printf(s, "CREATE TRIGGER IF NOT EXISTS c%d_image_ai "
+                              "AFTER INSERT ON %s "
+                              "WHEN NEW.c_image <> 'default_image_xpm' BEGIN "
+                              "INSERT OR IGNORE INTO collection_images (filename) "
+                              "VALUES (NEW.c_image); "
+                              "UPDATE collection_images SET refs = refs + 1 "
+                              "WHERE filename = NEW.c_image; END; ",
+                           c->id, c->name);
+
+    g_string_append_printf(s, "CREATE TRIGGER IF NOT EXISTS c%d_image_ad "
+                              "AFTER DELETE ON %s BEGIN "
+                              "UPDATE collection_images SET refs = refs - 1 "
+                              "WHERE filename = OLD.c_image; END; ",
+                           c->id, c->name);
+
+    g_string_append_printf(s, "CREATE TRIGGER IF NOT EXISTS c%d_image_au "
+                              "AFTER UPDATE OF c_image ON %s "
+                              "WHEN OLD.c_image <> NEW.c_image BEGIN "
+                              "UPDATE collection_images SET refs = refs - 1 "
+                              "WHERE filename = OLD.c_image; "
+                              "INSERT OR IGNORE INTO collection_images (filename) "
+                              "SELECT NEW.c_image "
+                              "WHERE NEW.c_image <> 'default_image_xpm'; "
+                              "UPDATE collection_images SET refs = refs + 1 "
+                              "WHERE filename = NEW.c_image; END; "
+                              "RELEASE image_refs",
+                           c->id, c->name);
 
-    if (sqlite3_exec(__db, str_query, NULL, 0, &emsg) != SQLITE_OK) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"), "%s", emsg);
+    if (sqlite3_exec(__db, s->str, NULL, 0, &emsg) != SQLITE_OK) {
+        fprintf(stderr, "Error: %s\n", emsg);
         sqlite3_free(emsg);
-        return 0;
-    }
-
-    snprintf(str_query, 256, "DROP TABLE IF EXISTS %s", name);
+        sqlite3_exec(__db, "ROLLBACK TO image_refs; RELEASE image_refs",
+                     NULL, 0, NULL);
 
-    if (sqlite3_exec(__db, str_query, NULL, 0, &emsg) != SQLITE_OK) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"), "%s", emsg);
-        sqlite3_free(emsg);
-        return 0;
+        ret = 0;
     }
 
-    remove_collection_dir(collection_id);
-    return 1;
+    g_string_free(s, TRUE);
+
+    return ret;
 }
 
-static void db_add_field_column(struct db_field *f, struct db_collection *c)
+/*
+ * Removes the images that no entry uses anymore. Their files go before the
+ * rows, so an interrupted removal is finished the next time.
+ */
+static void db_remove_unused_images(void)
 {
-    char str_query[512]={0}, *emsg;
+    sqlite3_stmt *stmt;
 
-    snprintf(str_query, 512, "ALTER TABLE %s ADD COLUMN %s varchar(%d)",
-             c->name, f->name, DEFAULT_FIELD_SIZE);
+    stmt = db_get_stmt(STMT_GLOBAL, STMT_UNUSED_IMAGES,
+                       "SELECT filename FROM collection_images WHERE refs <= 0");
 
-    if (sqlite3_exec(__db, str_query, NULL, 0, &emsg) != SQLITE_OK) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"), "%s", emsg);
-        sqlite3_free(emsg);
+    if (stmt == NULL)
         return;
-    }
 
-    snprintf(str_query, 512, "INSERT INTO collection_fields (cat_id, name, "
-                             "field_size, screen_name, status) VALUES "
-                             "(%d, \"%s\", %d, \"%s\", %d)",
-                             c->id, f->name, DEFAULT_FIELD_SIZE, f->screen_name,
-                             FIELD_ACTIVE);
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+        image_store_remove((char *)sqlite3_column_text(stmt, 0));
+
+    sqlite3_reset(stmt);
+    stmt = db_get_stmt(STMT_GLOBAL, STMT_DELETE_UNUSED_IMAGES,
+                       "DELETE FROM collection_images WHERE refs <= 0");
+
+    if (stmt == NULL)
+        return;
+
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(__db));
+
+    sqlite3_reset(stmt);
+}
+
+static int db_insert_field(int collection_id, struct db_field *f, int field_status)
+{
+    sqlite3_stmt *stmt;
+    int ret;
+
+    stmt = db_get_stmt(STMT_GLOBAL, STMT_INSERT_FIELD,
+                       "INSERT INTO collection_fields (cat_id, name, field_size, "
+                       "screen_name, status) VALUES (?, ?, ?, ?, ?)");
+
+    if (stmt == NULL) {
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s", sqlite3_errmsg(__db));
+        return 0;
+    }
+
+    sqlite3_bind_int(stmt, 1, collection_id);
+    sqlite3_bind_text(stmt, 2, f->name, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 3, DEFAULT_FIELD_SIZE);
+    sqlite3_bind_text(stmt, 4, f->screen_name, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 5, field_status);
+
+    ret = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+
+    if (ret != SQLITE_DONE) {
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s", sqlite3_errmsg(__db));
+        return 0;
+    }
+
+    return 1;
+}
+
+static void __insert_field(struct db_field *f, int *collection_id)
+{
+    db_insert_field(*collection_id, f, f->status);
+}
+
+static char *get_db_collection_image_path(int collection_id)
+{
+    char path[256]={0};
+
+    snprintf(path, sizeof(path), "%s/%s/collections/c%d", getenv("HOME"),
+             APP_CONFIG_PATH, collection_id);
+
+    return strdup(path);
+}
+
+static void create_collection_image_dir(int collection_id)
+{
+    char *path;
+    mode_t mode;
+
+    mode = S_IWUSR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+    path = get_db_collection_image_path(collection_id);
+
+    if (access(path, 0x00) == -1)
+        mkdir(path, mode);
+
+    free(path);
+}
+
+static void __db_create_collection(struct db_collection *c, int gtk_status)
+{
+    sqlite3_stmt *stmt;
+    int collection_id, ret=SQLITE_ERROR;
+
+    if (db_create_collection_table(c) < 0)
+        return;
+
+    /* Insert the new collection entry */
+    stmt = db_get_stmt(STMT_GLOBAL, STMT_INSERT_COLLECTION,
+                       "INSERT INTO tab_collection (name, screen_name) "
+                       "VALUES (?, ?)");
+
+    if (stmt != NULL) {
+        sqlite3_bind_text(stmt, 1, c->name, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, c->screen_name, -1, SQLITE_STATIC);
+        ret = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+
+    if (ret != SQLITE_DONE) {
+        if (gtk_status == TRUE)
+            db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s",
+                     sqlite3_errmsg(__db));
+        else
+            fprintf(stderr, "Error: %s\n", sqlite3_errmsg(__db));
+
+        return;
+    }
+
+    collection_id = db_get_collection_id(c->name);
+    c->id = collection_id;
+
+    /* Insert fields from the new collection */
+    g_list_foreach(c->fields, (GFunc)__insert_field, &collection_id);
+
+    create_collection_image_dir(collection_id);
+    c->image_path = get_db_collection_image_path(collection_id);
+    c->search_index = db_create_search_index(c);
+    db_create_entry_counter(c);
+    c->image_refs = db_create_image_refs(c);
+}
+
+/*
+ * Runs a statement that only needs an id bound as its single parameter.
+ */
+static int db_step_id(sqlite3_stmt *stmt, sqlite3_int64 id)
+{
+    int ret;
+
+    if (stmt == NULL) {
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s", sqlite3_errmsg(__db));
+        return 0;
+    }
+
+    sqlite3_bind_int64(stmt, 1, id);
+    ret = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+
+    if (ret != SQLITE_DONE) {
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s", sqlite3_errmsg(__db));
+        return 0;
+    }
+
+    return 1;
+}
+
+static int __db_delete_collection(const char *name)
+{
+    char str_query[256]={0}, *emsg;
+    int collection_id;
+    sqlite3_stmt *stmt;
+
+    collection_id = db_get_collection_id(name);
+
+    if (collection_id <= 0) {
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"),
+                 gettext("Collection '%s' not found!"), name);
+
+        return 0;
+    }
+
+    stmt = db_get_stmt(STMT_GLOBAL, STMT_DELETE_COLLECTION,
+                       "DELETE FROM tab_collection WHERE id = ?");
+
+    if (!db_step_id(stmt, collection_id))
+        return 0;
+
+    stmt = db_get_stmt(STMT_GLOBAL, STMT_DELETE_FIELDS,
+                       "DELETE FROM collection_fields WHERE cat_id = ?");
+
+    if (!db_step_id(stmt, collection_id))
+        return 0;
+
+    /* its triggers are dropped with the table */
+    stmt = db_get_stmt(STMT_GLOBAL, STMT_DELETE_COUNTER,
+                       "DELETE FROM collection_counters WHERE cat_id = ?");
+
+    if (!db_step_id(stmt, collection_id))
+        return 0;
+
+    stmt = db_get_stmt(STMT_GLOBAL, STMT_DELETE_COVER_FETCH,
+                       "DELETE FROM collection_cover_fetch WHERE cat_id = ?");
+
+    if (!db_step_id(stmt, collection_id))
+        return 0;
+
+    /* the table is gone, so are its statements */
+    stmt_cache_invalidate(__stmt_cache, collection_id);
+    db_drop_search_index(name);
+
+    /* dropping the table doesn't run its triggers */
+    snprintf(str_query, 256, "DELETE FROM %s; DROP TABLE IF EXISTS %s", name,
+             name);
 
     if (sqlite3_exec(__db, str_query, NULL, 0, &emsg) != SQLITE_OK) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"), "%s", emsg);
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s", emsg);
         sqlite3_free(emsg);
-        return;
+        return 0;
     }
+
+    /* images of older versions are still kept by the collection */
+    remove_collection_dir(collection_id);
+    db_remove_unused_images();
+
+    return 1;
 }
 
-static void db_update_field_status(struct db_field *f, struct db_collection *c)
+static void db_add_field_column(struct db_field *f, struct db_collection *c)
 {
     char str_query[512]={0}, *emsg;
 
-    snprintf(str_query, 512, "UPDATE collection_fields SET status = %d WHERE "
-                             "cat_id = %d AND name = \"%s\"", !f->status,
-                             c->id, f->name);
+    snprintf(str_query, 512, "ALTER TABLE %s ADD COLUMN %s varchar(%d)",
+             c->name, f->name, DEFAULT_FIELD_SIZE);
 
     if (sqlite3_exec(__db, str_query, NULL, 0, &emsg) != SQLITE_OK) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"), "%s", emsg);
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s", emsg);
         sqlite3_free(emsg);
         return;
     }
+
+    db_insert_field(c->id, f, FIELD_ACTIVE);
+}
+
+static void db_update_field_status(struct db_field *f, struct db_collection *c)
+{
+    sqlite3_stmt *stmt;
+    int ret=SQLITE_ERROR;
+
+    stmt = db_get_stmt(STMT_GLOBAL, STMT_UPDATE_FIELD_STATUS,
+                       "UPDATE collection_fields SET status = ? WHERE "
+                       "cat_id = ? AND name = ?");
+
+    if (stmt != NULL) {
+        sqlite3_bind_int(stmt, 1, !f->status);
+        sqlite3_bind_int(stmt, 2, c->id);
+        sqlite3_bind_text(stmt, 3, f->name, -1, SQLITE_STATIC);
+        ret = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+
+    if (ret != SQLITE_DONE)
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s", sqlite3_errmsg(__db));
 }
 
 static void db_change_collection_name(struct db_collection *original,
     struct db_collection *new)
 {
     char str_query[512]={0}, *emsg;
+    sqlite3_stmt *stmt;
+    int ret=SQLITE_ERROR;
 
     snprintf(str_query, 512, "ALTER TABLE %s RENAME TO %s",
              original->name, new->name);
 
     if (sqlite3_exec(__db, str_query, NULL, 0, &emsg) != SQLITE_OK) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"), "%s", emsg);
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s", emsg);
         sqlite3_free(emsg);
         return;
     }
 
-    snprintf(str_query, 512, "UPDATE tab_collection SET name = \"%s\", "
-                             "screen_name = \"%s\" WHERE id = %d",
-                             new->name, new->screen_name, original->id);
+    stmt = db_get_stmt(STMT_GLOBAL, STMT_RENAME_COLLECTION,
+                       "UPDATE tab_collection SET name = ?, screen_name = ? "
+                       "WHERE id = ?");
 
-    if (sqlite3_exec(__db, str_query, NULL, 0, &emsg) != SQLITE_OK) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"), "%s", emsg);
-        sqlite3_free(emsg);
-        return;
+    if (stmt != NULL) {
+        sqlite3_bind_text(stmt, 1, new->name, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, new->screen_name, -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 3, original->id);
+        ret = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
     }
+
+    if (ret != SQLITE_DONE)
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s", sqlite3_errmsg(__db));
 }
 
 static void reload_sql_fields_stmt(struct db_collection *c)
@@ -375,7 +1022,8 @@ static void reload_sql_fields_stmt(struct db_collection *c)
     c->active_fields = active_fields;
 }
 
-int db_update_collection(struct db_collection *new_c, struct db_collection *original_c)
+static int __db_update_collection(struct db_collection *new_c,
+    struct db_collection *original_c)
 {
     GList *l_added, *l_status;
     int updated=0;
@@ -383,6 +1031,16 @@ int db_update_collection(struct db_collection *new_c, struct db_collection *orig
     l_added = fields_compare(new_c->fields, original_c->fields);
     l_status = fields_compare_by_status(original_c->fields, new_c->fields);
 
+    /*
+     * The search index holds the active fields and its triggers the table
+     * name, so it is built again whenever any of them changes.
+     */
+    if ((l_added != NULL) || (l_status != NULL) ||
+        strcmp(original_c->name, new_c->name))
+    {
+        db_drop_search_index(original_c->name);
+    }
+
     /* if any field status needs to be updated */
     if (l_status)
         g_list_foreach(l_status, (GFunc)db_update_field_status, original_c);
@@ -406,7 +1064,16 @@ int db_update_collection(struct db_collection *new_c, struct db_collection *orig
     /* also get the number of entries from the original collection */
     new_c->n_entries = original_c->n_entries;
 
-    return ((l_added != NULL) || (l_status != NULL) || updated);
+    if ((l_added != NULL) || (l_status != NULL) || updated) {
+        /* cached statements still point to the old table layout */
+        stmt_cache_invalidate(__stmt_cache, original_c->id);
+        new_c->search_index = db_create_search_index(new_c);
+        return 1;
+    }
+
+    new_c->search_index = original_c->search_index;
+
+    return 0;
 }
 
 static void create_default_collections(void)
@@ -445,315 +1112,1663 @@ static void create_default_collections(void)
     destroy_db_collection(c, NULL);
 }
 
-static void db_load_fields_from_collection(struct db_collection *c)
-{
-    char str_query[256]={0}, name[256]={0}, screen_name[256]={0};
-    int idx=0, status;
-    sqlite3_stmt *stmt;
-    struct db_field *f;
-
-    snprintf(str_query, 256, "SELECT name, screen_name, status "
-                             "FROM collection_fields "
-                             "WHERE cat_id = %d", c->id);
-
-    if (sqlite3_prepare_v2(__db, str_query, -1, &stmt, NULL) != SQLITE_OK) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"),
-                    gettext("Error searching for the '%s' collection fields"),
-                    c->name);
-
-        return;
-    }
-
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        memset(name, 0, sizeof(name));
-        strcpy(name, (char *)sqlite3_column_text(stmt, 0));
+/*
+ * Columns of the catalog query: the collection, whether it has its counter,
+ * search index and image references, and one of its fields. Collections without fields still
+ * give a row, with NULL field columns.
+ */
+enum catalog_column {
+    CATALOG_ID = 0,
+    CATALOG_SCREEN_NAME,
+    CATALOG_NAME,
+    CATALOG_N_ENTRIES,
+    CATALOG_SEARCH_INDEX,
+    CATALOG_IMAGE_REFS,
+    CATALOG_FIELD_NAME,
+    CATALOG_FIELD_SCREEN_NAME,
+    CATALOG_FIELD_STATUS
+};
 
-        memset(screen_name, 0, sizeof(screen_name));
-        strcpy(screen_name, (char *)sqlite3_column_text(stmt, 1));
+static struct db_collection *db_load_collection_info(sqlite3_stmt *stmt)
+{
+    struct db_collection *c;
 
-        status = strtoll((char *)sqlite3_column_text(stmt, 2), NULL, 10);
+    c = create_db_collection((char *)sqlite3_column_text(stmt, CATALOG_SCREEN_NAME),
+                             (char *)sqlite3_column_text(stmt, CATALOG_NAME),
+                             sqlite3_column_int(stmt, CATALOG_ID));
 
-        f = create_db_field(name, screen_name, idx, status);
+    if (!c)
+        return NULL;
 
-        if (f == NULL)
-            return;
+    c->image_path = get_db_collection_image_path(c->id);
+    c->search_index = sqlite3_column_int(stmt, CATALOG_SEARCH_INDEX);
+    c->image_refs = sqlite3_column_int(stmt, CATALOG_IMAGE_REFS);
 
-        add_db_field(c, f);
-        idx++;
-    }
+    /* collections created by older versions have no counter */
+    if (sqlite3_column_type(stmt, CATALOG_N_ENTRIES) == SQLITE_NULL)
+        c->n_entries = -1;
+    else
+        c->n_entries = sqlite3_column_int(stmt, CATALOG_N_ENTRIES);
 
-    end_add_db_field(c);
+    return c;
 }
 
-static struct db_collection *db_load_collection_info(sqlite3_stmt *stmt)
+static int db_load_field_info(sqlite3_stmt *stmt, struct db_collection *c)
 {
-    struct db_collection *c;
-    char name[256]={0}, screen_name[256]={0};
-    int id;
+    struct db_field *f;
 
-    id = strtoll((char *)sqlite3_column_text(stmt, 0), NULL, 10);
-    strcpy(screen_name, (char *)sqlite3_column_text(stmt, 1));
-    strcpy(name, (char *)sqlite3_column_text(stmt, 2));
+    if (sqlite3_column_type(stmt, CATALOG_FIELD_NAME) == SQLITE_NULL)
+        return 1;
 
-    c = create_db_collection(screen_name, name, id);
-    db_load_fields_from_collection(c);
-    c->image_path = get_db_collection_image_path(c->id);
+    f = create_db_field((char *)sqlite3_column_text(stmt, CATALOG_FIELD_NAME),
+                        (char *)sqlite3_column_text(stmt, CATALOG_FIELD_SCREEN_NAME),
+                        c->n_fields, sqlite3_column_int(stmt, CATALOG_FIELD_STATUS));
 
-    return c;
+    if (f == NULL)
+        return 0;
+
+    add_db_field(c, f);
+
+    return 1;
 }
 
-static void db_load_collection_data(struct db_collection *c)
+/*
+ * Counters, search indexes and image references are only built here for
+ * collections that come from older versions.
+ */
+static void db_upgrade_collection(struct db_collection *c,
+    gpointer user_data __attribute__((unused)))
 {
-    char str_query[256]={0};
     sqlite3_stmt *stmt;
 
-    snprintf(str_query, 256, "SELECT count(*) FROM %s", c->name);
+    if (c->n_entries < 0) {
+        c->n_entries = 0;
 
-    if (sqlite3_prepare_v2(__db, str_query, -1, &stmt, NULL) != SQLITE_OK) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"),
-                    gettext("Error searching the '%s' collection data"), c->name);
+        if (db_create_entry_counter(c)) {
+            stmt = db_get_stmt(STMT_GLOBAL, STMT_LOAD_COUNTER,
+                               "SELECT n_entries FROM collection_counters "
+                               "WHERE cat_id = ?");
 
-        return;
+            if (stmt != NULL) {
+                sqlite3_bind_int(stmt, 1, c->id);
+
+                if (sqlite3_step(stmt) == SQLITE_ROW)
+                    c->n_entries = sqlite3_column_int(stmt, 0);
+
+                sqlite3_reset(stmt);
+            }
+        }
     }
 
-    while (sqlite3_step(stmt) == SQLITE_ROW)
-        c->n_entries = strtol((char *)sqlite3_column_text(stmt, 0), NULL, 10);
+    if (!c->search_index)
+        c->search_index = db_create_search_index(c);
 
-    sqlite3_finalize(stmt);
+    if (!c->image_refs)
+        c->image_refs = db_create_image_refs(c);
 }
 
-GList *db_get_all_collection_info(void)
+/*
+ * Loads every collection with its fields and number of entries through a
+ * single query, so it doesn't depend on how many entries they have.
+ */
+static GList *__db_get_all_collection_info(void)
 {
     GList *l_db=NULL;
-    char str_query[256]={0};
     sqlite3_stmt *stmt;
-    struct db_collection *c_db;
-
-    snprintf(str_query, 256, "SELECT id, screen_name, name FROM tab_collection");
-
-    if (sqlite3_prepare_v2(__db, str_query, -1, &stmt, NULL) != SQLITE_OK) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"),
-                    gettext("Error searching for collections info"));
+    struct db_collection *c_db=NULL;
+
+    stmt = db_get_stmt(STMT_GLOBAL, STMT_LOAD_CATALOG,
+                       "SELECT t.id, t.screen_name, t.name, n.n_entries, "
+                       "EXISTS (SELECT 1 FROM sqlite_master WHERE type = 'table' "
+                       "AND name = t.name || '_fts'), "
+                       "EXISTS (SELECT 1 FROM sqlite_master WHERE type = 'trigger' "
+                       "AND name = 'c' || t.id || '_image_ai'), "
+                       "f.name, f.screen_name, f.status "
+                       "FROM tab_collection t "
+                       "LEFT JOIN collection_counters n ON n.cat_id = t.id "
+                       "LEFT JOIN collection_fields f ON f.cat_id = t.id "
+                       "ORDER BY t.id, f.rowid");
+
+    if (stmt == NULL) {
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"),
+                 gettext("Error searching for collections info"));
 
         return NULL;
     }
 
     while (sqlite3_step(stmt) == SQLITE_ROW) {
-        c_db = db_load_collection_info(stmt);
-
-        if (c_db == NULL)
-            return NULL;
+        if ((c_db == NULL) || (c_db->id != sqlite3_column_int(stmt, CATALOG_ID))) {
+            if ((c_db != NULL) && (c_db->n_fields > 0))
+                end_add_db_field(c_db);
 
-        db_load_collection_data(c_db);
-        l_db = g_list_append(l_db, c_db);
-    }
-
-    sqlite3_finalize(stmt);
+            c_db = db_load_collection_info(stmt);
 
-    return l_db;
-}
+            if (c_db == NULL) {
+                sqlite3_reset(stmt);
+                return NULL;
+            }
 
-void db_load_and_set_collection_data(struct db_collection *c, GtkListStore *store,
-    struct dlg_data *dlg_data)
-{
-    GtkTreeIter iter;
-    char str_query[256]={0}, *column, *s;
-    sqlite3_stmt *stmt;
-    struct dlg_line *line;
-    int i;
+            l_db = g_list_append(l_db, c_db);
+        }
 
-    snprintf(str_query, 256, "SELECT c_image, id, %s FROM %s", c->sql_fields_stmt->str,
-             c->name);
+        if (!db_load_field_info(stmt, c_db)) {
+            sqlite3_reset(stmt);
+            return NULL;
+        }
+    }
 
-    if (sqlite3_prepare_v2(__db, str_query, -1, &stmt, NULL) != SQLITE_OK) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"),
-                    gettext("Error searching the '%s' collection data"), c->name);
+    sqlite3_reset(stmt);
 
-        return;
-    }
+    if ((c_db != NULL) && (c_db->n_fields > 0))
+        end_add_db_field(c_db);
 
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        gtk_list_store_append(GTK_LIST_STORE(store), &iter);
-        line = create_dlg_line(LINE_LOADED);
+    /* the catalog query must be done before changing the schema */
+    g_list_foreach(l_db, (GFunc)db_upgrade_collection, NULL);
 
-        if (!line) {
-            display_msg(GTK_MESSAGE_ERROR, gettext("Error"),
-                        gettext("Error creating new entry!"));
+    return l_db;
+}
 
-            return;
-        }
+/*
+ * Operations on collections are run by the database worker, but their
+ * callers need the result right away so they wait for it.
+ */
+struct collection_request {
+    struct db_collection    *c;
+    struct db_collection    *original_c;
+    const char              *name;
+    int                     gtk_status;
+    GList                   *collections;
+};
+
+static int create_collection_job(gpointer data)
+{
+    struct collection_request *r = (struct collection_request *)data;
 
-        line->img_filename = strdup((char *)sqlite3_column_text(stmt, 0));
-        line->id = strtol((char *)sqlite3_column_text(stmt, 1), NULL, 10);
+    __db_create_collection(r->c, r->gtk_status);
 
-        for (i = 0; i < c->active_fields; i++) {
-            s = (char *)sqlite3_column_text(stmt, i + 2);
+    return 0;
+}
 
-            if (s != NULL)
-                column = strdup(s);
-            else
-                column = strdup("");
+void db_create_collection(struct db_collection *c, int gtk_status)
+{
+    struct collection_request r = { .c = c, .gtk_status = gtk_status };
 
-            gtk_list_store_set(GTK_LIST_STORE(store), &iter, i, column, -1);
-            line->column = g_list_append(line->column, column);
-        }
+    db_worker_run_sync(create_collection_job, &r);
+}
 
-        g_array_append_vals(dlg_data->priv.data, line, 1);
-    }
+static int delete_collection_job(gpointer data)
+{
+    struct collection_request *r = (struct collection_request *)data;
 
-    sqlite3_finalize(stmt);
+    return __db_delete_collection(r->name);
 }
 
-int db_delete_collection_data(struct db_collection *c, GList *entries)
+int db_delete_collection(const char *name)
 {
-    GList *l;
-    struct dlg_line *line;
-    GString *query;
-    char *emsg;
-    int deleted=0;
+    struct collection_request r = { .name = name };
 
-    for (l = g_list_first(entries); l; l = l->next) {
-        line = (struct dlg_line *)l->data;
-        query = g_string_new(NULL);
-        g_string_printf(query, "DELETE FROM %s WHERE id = %llu", c->name, line->id);
+    return db_worker_run_sync(delete_collection_job, &r) > 0;
+}
 
-        if (sqlite3_exec(__db, query->str, NULL, 0, &emsg) != SQLITE_OK) {
-            display_msg(GTK_MESSAGE_ERROR, gettext("Error"), "%s", emsg);
-            sqlite3_free(emsg);
-            return 0;
-        }
+static int update_collection_job(gpointer data)
+{
+    struct collection_request *r = (struct collection_request *)data;
 
-        /* also removes the entry image */
-        if (strcmp(line->img_filename, "default_image_xpm"))
-            remove(line->img_filename);
+    return __db_update_collection(r->c, r->original_c);
+}
 
-        g_string_free(query, TRUE);
-        deleted++;
-    }
+int db_update_collection(struct db_collection *new_c, struct db_collection *original_c)
+{
+    struct collection_request r = { .c = new_c, .original_c = original_c };
 
-    return deleted;
+    return db_worker_run_sync(update_collection_job, &r) > 0;
 }
 
-static void dlg_line_replace_data(struct dlg_line *line)
+static int load_catalog_job(gpointer data)
 {
-    GList *l;
-    int p;
+    struct collection_request *r = (struct collection_request *)data;
 
-    for (l = g_list_first(line->column), p = 0; l; l = l->next, p++) {
-        free(l->data);
-        l->data = strdup(g_list_nth_data(line->new_column, p));
-    }
+    r->collections = __db_get_all_collection_info();
+
+    return 0;
 }
 
-static sqlite3_int64 db_get_last_rowid(void)
+GList *db_get_all_collection_info(void)
 {
-    sqlite3_int64 id;
+    struct collection_request r = { .collections = NULL };
 
-    id = sqlite3_last_insert_rowid(__db);
+    db_worker_run_sync(load_catalog_job, &r);
 
-    return id;
+    return r.collections;
 }
 
-static void db_update_image_entry_info(struct db_collection *c, struct dlg_line *line)
+static const char *get_active_field_name(struct db_collection *c, int idx)
 {
-    char *emsg, query[512]={0}, *tmp;
-    GString *new_filename;
+    GList *l;
+    struct db_field *f;
+    int i=0;
 
-    tmp = strdup(line->img_filename);
-    new_filename = g_string_new(NULL);
-    g_string_printf(new_filename, "%s/%s", c->image_path, basename(tmp));
+    for (l = g_list_first(c->fields); l; l = l->next) {
+        f = (struct db_field *)l->data;
 
-    if (strcmp(line->img_filename, new_filename->str))
-        rename_file(line->img_filename, new_filename->str);
+        if (f->status != FIELD_ACTIVE)
+            continue;
 
-    free(tmp);
-    snprintf(query, sizeof(query), "UPDATE %s SET c_image = \"%s\" WHERE id = %llu",
-             c->name, new_filename->str, line->id);
+        if (i == idx)
+            return f->name;
 
-    if (sqlite3_exec(__db, query, NULL, 0, &emsg) != SQLITE_OK) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"), "%s", emsg);
-        sqlite3_free(emsg);
-        return;
+        i++;
     }
 
-    free(line->img_filename);
-    line->img_filename = strdup(new_filename->str);
-    g_string_free(new_filename, TRUE);
+    return NULL;
 }
 
-int db_update_collection_data(struct db_collection *c, GArray *entries)
+/* Restricts a query to the rows of the collection table matching the search */
+static void append_search_join(GString *s, struct db_collection *c)
+{
+    g_string_append_printf(s, " JOIN (SELECT rowid AS fts_id, rank AS fts_rank "
+                              "FROM %s_fts WHERE %s_fts MATCH ?) ON fts_id = id",
+                           c->name, c->name);
+}
+
+static int has_exclude_filter(struct db_page_query *q)
+{
+    return (q->exclude != NULL) && strlen(q->exclude);
+}
+
+/*
+ * Skips the removed rows. Their ids are bound as a single parameter, so the
+ * query stays the same, and cached, however many of them there are.
+ */
+static const char *append_exclude_filter(GString *s, struct db_page_query *q,
+    const char *where)
+{
+    if (has_exclude_filter(q)) {
+        g_string_append_printf(s, "%s id NOT IN (SELECT value FROM "
+                                  "json_each('[' || ? || ']'))", where);
+
+        return " AND";
+    }
+
+    return where;
+}
+
+/* Binds the ids append_exclude_filter() asked for at parameter @p */
+static int bind_exclude_filter(sqlite3_stmt *stmt, int p, struct db_page_query *q)
+{
+    if (has_exclude_filter(q))
+        sqlite3_bind_text(stmt, p++, q->exclude, -1, SQLITE_STATIC);
+
+    return p;
+}
+
+/*
+ * Turns the text typed by the user into a FTS5 query, where every word is
+ * a quoted prefix that must be found. Returns NULL if there is no word.
+ */
+static char *create_match_expression(const char *text)
+{
+    GString *s;
+    char **words, *w;
+    int i;
+
+    s = g_string_new(NULL);
+    words = g_strsplit_set(text, " \t", -1);
+
+    for (i = 0; words[i] != NULL; i++) {
+        if (*words[i] == '\0')
+            continue;
+
+        if (s->len > 0)
+            g_string_append_c(s, ' ');
+
+        g_string_append_c(s, '"');
+
+        /* double quotes are escaped by doubling them */
+        for (w = words[i]; *w != '\0'; w++) {
+            if (*w == '"')
+                g_string_append_c(s, '"');
+
+            g_string_append_c(s, *w);
+        }
+
+        g_string_append(s, "\"*");
+    }
+
+    g_strfreev(words);
+
+    if (s->len == 0) {
+        g_string_free(s, TRUE);
+        return NULL;
+    }
+
+    return g_string_free(s, FALSE);
+}
+
+/*
+ * Builds the query of a window of rows. With a key the window starts right
+ * after it (keyset pagination), otherwise an OFFSET is used. Search results
+ * are always sorted by their rank.
+ */
+static GString *create_page_query(struct db_collection *c, struct db_page_query *q)
+{
+    GString *s;
+    const char *field, *dir, *cmp, *where=" WHERE";
+
+    field = (q->sort_field >= 0) ? get_active_field_name(c, q->sort_field) : NULL;
+    dir = (q->order == CONFIG_SORT_ASC) ? "ASC" : "DESC";
+    cmp = (q->order == CONFIG_SORT_ASC) ? ">" : "<";
+
+    s = g_string_new(NULL);
+    g_string_printf(s, "SELECT c_image, id, %s FROM %s", c->sql_fields_stmt->str,
+                    c->name);
+
+    if (q->search != NULL) {
+        append_search_join(s, c);
+        append_exclude_filter(s, q, where);
+
+        /* best matches first, ranks have no key to seek from */
+        g_string_append(s, " ORDER BY fts_rank, id LIMIT ? OFFSET ?");
+
+        return s;
+    }
+
+    where = append_exclude_filter(s, q, where);
+
+    if (q->has_key) {
+        if (field != NULL)
+            g_string_append_printf(s, "%s (IFNULL(%s, '') COLLATE %s, id) %s (?, ?)",
+                                   where, field, DB_SORT_COLLATION, cmp);
+        else
+            g_string_append_printf(s, "%s id %s ?", where, cmp);
+    }
+
+    if (field != NULL)
+        g_string_append_printf(s, " ORDER BY IFNULL(%s, '') COLLATE %s %s, id %s",
+                               field, DB_SORT_COLLATION, dir, dir);
+    else
+        g_string_append_printf(s, " ORDER BY id %s", dir);
+
+    g_string_append(s, (q->has_key) ? " LIMIT ?" : " LIMIT ? OFFSET ?");
+
+    return s;
+}
+
+/*
+ * Creates, if it doesn't exist yet, the index the page queries sorted by the
+ * active field @sort_field walk through. Indexes are named after the
+ * collection id so they survive renames, and go away with the table.
+ */
+int db_create_sort_index(struct db_collection *c, int sort_field)
+{
+    const char *field;
+    char *sql, *emsg;
+    int ret=1;
+
+    field = get_active_field_name(c, sort_field);
+
+    if (field == NULL)
+        return 0;
+
+    sql = g_strdup_printf("CREATE INDEX IF NOT EXISTS c%d_sort_%s ON %s "
+                          "(IFNULL(%s, '') COLLATE %s, id)",
+                          c->id, field, c->name, field, DB_SORT_COLLATION);
+
+    if (sqlite3_exec(__db, sql, NULL, 0, &emsg) != SQLITE_OK) {
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s", emsg);
+        sqlite3_free(emsg);
+        ret = 0;
+    }
+
+    g_free(sql);
+
+    return ret;
+}
+
+/*
+ * Loads a window of rows from a collection into @lines (an array of dlg_line
+ * structures). Returns the number of loaded rows or -1 on error.
+ */
+int db_load_collection_page(struct db_collection *c, struct db_page_query *q,
+    GArray *lines, struct row_store *store)
+{
+    GString *query;
+    sqlite3_stmt *stmt;
+    struct dlg_line line;
+    char *match=NULL;
+    int i, op, p=1, rows=0;
+
+    if (q->search != NULL) {
+        match = create_match_expression(q->search);
+
+        if (match == NULL)
+            return 0;
+
+        op = STMT_SEARCH_PAGE;
+    } else
+        op = (q->has_key) ? STMT_LOAD_PAGE : STMT_SEEK_PAGE;
+
+    query = create_page_query(c, q);
+    stmt = db_get_stmt_sql(c->id, op, query->str);
+    g_string_free(query, TRUE);
+
+    if (stmt == NULL) {
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"),
+                 gettext("Error searching the '%s' collection data"), c->name);
+
+        g_free(match);
+
+        return -1;
+    }
+
+    /* sqlite releases the expression */
+    if (match != NULL)
+        sqlite3_bind_text(stmt, p++, match, -1, g_free);
+
+    p = bind_exclude_filter(stmt, p, q);
+
+    if ((match == NULL) && q->has_key) {
+        if (q->sort_field >= 0)
+            sqlite3_bind_text(stmt, p++, q->key_value, -1, SQLITE_STATIC);
+
+        sqlite3_bind_int64(stmt, p++, q->key_id);
+    }
+
+    sqlite3_bind_int(stmt, p++, q->limit);
+
+    if ((match != NULL) || !q->has_key)
+        sqlite3_bind_int(stmt, p++, q->offset);
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        memset(&line, 0, sizeof(struct dlg_line));
+        line.status = LINE_LOADED;
+        line.store = store;
+        line.cells = row_store_new_row(store);
+
+        if (!line.cells)
+            break;
+
+        line.img_filename = row_store_add_text(store,
+                                               (char *)sqlite3_column_text(stmt, 0));
+
+        line.id = sqlite3_column_int64(stmt, 1);
+
+        for (i = 0; i < c->active_fields; i++) {
+            line.cells[i] = row_store_add_text(store,
+                                               (char *)sqlite3_column_text(stmt, i + 2));
+        }
+
+        g_array_append_val(lines, line);
+        rows++;
+    }
+
+    sqlite3_reset(stmt);
+
+    return rows;
+}
+
+/*
+ * Gives the number of rows a page query walks through, which only differs
+ * from the collection entries while searching. Returns -1 on error.
+ */
+int db_count_collection_rows(struct db_collection *c, struct db_page_query *q)
 {
-    unsigned int i;
-    struct dlg_line *line;
-    struct db_field *f;
     GString *query;
+    sqlite3_stmt *stmt;
+    char *match=NULL;
+    int p=1, rows=-1;
+
+    query = g_string_new(NULL);
+    g_string_printf(query, "SELECT count(*) FROM %s", c->name);
+
+    if (q->search != NULL) {
+        match = create_match_expression(q->search);
+
+        if (match == NULL) {
+            g_string_free(query, TRUE);
+            return 0;
+        }
+
+        append_search_join(query, c);
+    }
+
+    append_exclude_filter(query, q, " WHERE");
+    stmt = db_get_stmt_sql(c->id, STMT_COUNT_ROWS, query->str);
+    g_string_free(query, TRUE);
+
+    if (stmt == NULL) {
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"),
+                 gettext("Error searching the '%s' collection data"), c->name);
+
+        g_free(match);
+
+        return -1;
+    }
+
+    if (match != NULL)
+        sqlite3_bind_text(stmt, p++, match, -1, g_free);
+
+    bind_exclude_filter(stmt, p, q);
+
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        rows = sqlite3_column_int(stmt, 0);
+
+    sqlite3_reset(stmt);
+
+    return rows;
+}
+
+/*
+ * An added or updated entry being saved. Its image is only moved into the
+ * image store once the whole save has been committed.
+ */
+struct save_entry {
+    struct dlg_line     *line;
+    char                *img_filename;
+};
+
+/* Rows written by a save, reported to the job running it */
+struct save_progress {
+    unsigned int    done;
+    unsigned int    total;
+};
+
+static void save_progress_add(struct save_progress *progress, unsigned int rows)
+{
+    progress->done += rows;
+
+    if (progress->total > 0)
+        db_worker_progress((double)progress->done / progress->total);
+}
+
+static int db_exec(const char *sql)
+{
     char *emsg;
+
+    if (sqlite3_exec(__db, sql, NULL, 0, &emsg) != SQLITE_OK) {
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s", emsg);
+        sqlite3_free(emsg);
+        return 0;
+    }
+
+    return 1;
+}
+
+static GString *create_params_list(int rows, int columns)
+{
+    GString *s;
+    int i, j;
+
+    s = g_string_new(NULL);
+
+    for (i = 0; i < rows; i++) {
+        g_string_append_printf(s, "%s(?", (i == 0) ? "" : ", ");
+
+        for (j = 1; j < columns; j++)
+            g_string_append(s, ", ?");
+
+        g_string_append_c(s, ')');
+    }
+
+    return s;
+}
+
+/*
+ * Removes all @entries with set-based DELETE statements of DB_BATCH_ROWS ids.
+ * The last batch is padded repeating its last id.
+ */
+static int db_delete_collection_data(struct db_collection *c, GList *entries)
+{
+    GList *l;
+    GString *params;
+    struct dlg_line *line=NULL;
+    sqlite3_stmt *stmt;
+    int i, ret, deleted=0;
+
+    stmt = stmt_cache_lookup(__stmt_cache, c->id, STMT_DELETE_BATCH);
+
+    if (stmt == NULL) {
+        params = create_params_list(1, DB_BATCH_ROWS);
+        stmt = db_prepare_stmt(c->id, STMT_DELETE_BATCH,
+                               "DELETE FROM %s WHERE id IN %s", c->name,
+                               params->str);
+
+        g_string_free(params, TRUE);
+    }
+
+    if (stmt == NULL) {
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s", sqlite3_errmsg(__db));
+        return -1;
+    }
+
+    l = g_list_first(entries);
+
+    while (l != NULL) {
+        for (i = 1; i <= DB_BATCH_ROWS; i++) {
+            if (l != NULL) {
+                line = (struct dlg_line *)l->data;
+                l = l->next;
+                deleted++;
+            }
+
+            sqlite3_bind_int64(stmt, i, line->id);
+        }
+
+        ret = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+
+        if (ret != SQLITE_DONE) {
+            db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s",
+                     sqlite3_errmsg(__db));
+
+            return -1;
+        }
+    }
+
+    return deleted;
+}
+
+/*
+ * Gives the path that an entry image will have once saved. New images go to
+ * the image store, where a copy of the same cover may already be.
+ */
+static char *get_entry_image_filename(struct db_collection *c, struct dlg_line *line)
+{
+    char *tmp, filename[512]={0};
+
+    if (!g_str_has_prefix(line->img_filename, UNSAVED_IMG_TMP_DIR))
+        return strdup(line->img_filename);
+
+    tmp = image_store_filename(line->img_filename);
+
+    if (tmp != NULL)
+        return tmp;
+
+    /* can't be read now, kept as before */
+    tmp = strdup(line->img_filename);
+    snprintf(filename, sizeof(filename), "%s/%s", c->image_path, basename(tmp));
+    free(tmp);
+
+    return strdup(filename);
+}
+
+static int entries_per_insert(struct db_collection *c)
+{
+    int rows;
+
+    rows = DB_MAX_VARIABLES / (c->active_fields + 1);
+
+    return (rows > DB_BATCH_ROWS) ? DB_BATCH_ROWS : rows;
+}
+
+/*
+ * Gives the INSERT of @rows entries. Full batches and single entries have
+ * their own statements; the rows left after the last full batch share one,
+ * prepared again whenever their number changes.
+ */
+static sqlite3_stmt *db_get_insert_entry_stmt(struct db_collection *c, int rows)
+{
+    GString *params;
+    sqlite3_stmt *stmt;
+    char *sql;
+    int op;
+
+    if (rows == 1)
+        op = STMT_INSERT_ENTRY;
+    else if (rows == entries_per_insert(c))
+        op = STMT_INSERT_BATCH;
+    else
+        op = STMT_INSERT_TAIL;
+
+    if (op != STMT_INSERT_TAIL) {
+        stmt = stmt_cache_lookup(__stmt_cache, c->id, op);
+
+        if (stmt != NULL)
+            return stmt;
+    }
+
+    params = create_params_list(rows, c->active_fields + 1);
+    sql = g_strdup_printf("INSERT INTO %s (c_image, %s) VALUES %s", c->name,
+                          c->sql_fields_stmt->str, params->str);
+
+    g_string_free(params, TRUE);
+
+    if (op == STMT_INSERT_TAIL)
+        stmt = db_get_stmt_sql(c->id, op, sql);
+    else
+        stmt = db_prepare_stmt(c->id, op, "%s", sql);
+
+    g_free(sql);
+
+    return stmt;
+}
+
+/*
+ * The image is only written if @image is set, so a cover given meanwhile in
+ * the background isn't replaced by the one the entry was loaded with.
+ */
+static sqlite3_stmt *db_get_update_entry_stmt(struct db_collection *c, int image)
+{
+    GString *columns;
+    sqlite3_stmt *stmt;
+    struct db_field *f;
+    GList *l;
+    int op;
+
+    op = image ? STMT_UPDATE_ENTRY : STMT_UPDATE_ENTRY_CELLS;
+    stmt = stmt_cache_lookup(__stmt_cache, c->id, op);
+
+    if (stmt != NULL)
+        return stmt;
+
+    columns = g_string_new(image ? "c_image = ?" : "");
+
+    for (l = g_list_first(c->fields); l; l = l->next) {
+        f = (struct db_field *)l->data;
+
+        if (f->status == FIELD_ACTIVE)
+            g_string_append_printf(columns, "%s%s = ?",
+                                   (columns->len > 0) ? ", " : "", f->name);
+    }
+
+    stmt = db_prepare_stmt(c->id, op, "UPDATE %s SET %s WHERE id = ?", c->name,
+                           columns->str);
+
+    g_string_free(columns, TRUE);
+
+    return stmt;
+}
+
+/* Binds @values starting at parameter @p */
+static int bind_values(sqlite3_stmt *stmt, int p, const char **values,
+    int n_values)
+{
+    int i;
+
+    for (i = 0; i < n_values; i++)
+        sqlite3_bind_text(stmt, p++, values[i], -1, SQLITE_STATIC);
+
+    return p;
+}
+
+/* Binds the image and the values of an entry starting at parameter @p */
+static int bind_entry_values(sqlite3_stmt *stmt, int p, struct save_entry *e,
+    const char **values, int n_values)
+{
+    sqlite3_bind_text(stmt, p++, e->img_filename, -1, SQLITE_STATIC);
+
+    return bind_values(stmt, p, values, n_values);
+}
+
+/* Inserts @added entries using multi-row INSERT statements */
+static int db_insert_collection_data(struct db_collection *c, GArray *added,
+    struct save_progress *progress)
+{
+    struct save_entry *e;
+    sqlite3_stmt *stmt;
+    unsigned int i, j, rows;
+    int p, ret, batch;
+
+    batch = entries_per_insert(c);
+
+    for (i = 0; i < added->len; i += rows) {
+        rows = MIN(added->len - i, (unsigned int)batch);
+        stmt = db_get_insert_entry_stmt(c, rows);
+
+        if (stmt == NULL) {
+            db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s",
+                     sqlite3_errmsg(__db));
+
+            return 0;
+        }
+
+        for (j = 0, p = 1; j < rows; j++) {
+            e = &g_array_index(added, struct save_entry, i + j);
+            p = bind_entry_values(stmt, p, e, e->line->cells, c->active_fields);
+        }
+
+        ret = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+
+        if (ret != SQLITE_DONE) {
+            db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s",
+                     sqlite3_errmsg(__db));
+
+            return 0;
+        }
+
+        save_progress_add(progress, rows);
+    }
+
+    return 1;
+}
+
+static int db_update_collection_data(struct db_collection *c, GArray *updated,
+    struct save_progress *progress)
+{
+    struct save_entry *e;
+    sqlite3_stmt *stmt;
+    unsigned int i;
+    int p, ret;
+
+    for (i = 0; i < updated->len; i++) {
+        e = &g_array_index(updated, struct save_entry, i);
+        stmt = db_get_update_entry_stmt(c, e->line->new_image);
+
+        if (stmt == NULL) {
+            db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s",
+                     sqlite3_errmsg(__db));
+
+            return 0;
+        }
+
+        if (e->line->new_image)
+            p = bind_entry_values(stmt, 1, e, e->line->new_cells, c->active_fields);
+        else
+            p = bind_values(stmt, 1, e->line->new_cells, c->active_fields);
+        sqlite3_bind_int64(stmt, p, e->line->id);
+
+        ret = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+
+        if (ret != SQLITE_DONE) {
+            db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s",
+                     sqlite3_errmsg(__db));
+
+            return 0;
+        }
+
+        save_progress_add(progress, 1);
+    }
+
+    return 1;
+}
+
+/*
+ * Moves the image of a committed entry into place. The line itself is left
+ * untouched, it may still be shown while saving and is read back from the
+ * database afterwards.
+ */
+static int save_entry_commit(struct save_entry *e)
+{
+    if (!strcmp(e->line->img_filename, e->img_filename))
+        return 1;
+
+    return image_store_add(e->line->img_filename, e->img_filename);
+}
+
+static void save_entry_clear(struct save_entry *e)
+{
+    if (e->img_filename != NULL)
+        free(e->img_filename);
+}
+
+/*
+ * Saves all modifications made to a collection, removing @d_lines and
+ * inserting or updating the changed lines from @entries, as a single
+ * transaction. If anything fails the whole save is rolled back and neither
+ * the entries nor their images are touched.
+ */
+int db_save_collection_data(struct db_collection *c, GList *d_lines, GArray *entries,
+    int *added, int *deleted)
+{
+    GArray *a_entries, *u_entries;
+    struct dlg_line *line;
+    struct save_entry e;
+    struct save_progress progress;
     GList *l;
-    int p, added=0;
+    unsigned int i, failed=0;
+    int ret=0;
+
+    *added = 0;
+    *deleted = 0;
+
+    a_entries = g_array_new(FALSE, FALSE, sizeof(struct save_entry));
+    u_entries = g_array_new(FALSE, FALSE, sizeof(struct save_entry));
+    g_array_set_clear_func(a_entries, (GDestroyNotify)save_entry_clear);
+    g_array_set_clear_func(u_entries, (GDestroyNotify)save_entry_clear);
+
+    for (i = 0; i < entries->len; i++) {
+        line = &g_array_index(entries, dlg_line, i);
+
+        if ((line->status != LINE_ADDED) && (line->status != LINE_UPDATED))
+            continue;
+
+        e.line = line;
+        e.img_filename = get_entry_image_filename(c, line);
+
+        if (line->status == LINE_ADDED)
+            g_array_append_val(a_entries, e);
+        else
+            g_array_append_val(u_entries, e);
+    }
+
+    progress.done = 0;
+    progress.total = g_list_length(d_lines) + a_entries->len + u_entries->len;
+
+    if (!db_exec("BEGIN IMMEDIATE"))
+        goto end_block;
+
+    if (d_lines != NULL) {
+        *deleted = db_delete_collection_data(c, d_lines);
+
+        if (*deleted < 0)
+            goto rollback_block;
+
+        save_progress_add(&progress, *deleted);
+    }
+
+    if (!db_insert_collection_data(c, a_entries, &progress) ||
+        !db_update_collection_data(c, u_entries, &progress))
+    {
+        goto rollback_block;
+    }
+
+    if (!db_exec("COMMIT"))
+        goto rollback_block;
+
+    /*
+     * Everything is on disk, now the images can be changed. Saved images of
+     * deleted lines go once no other entry uses them.
+     */
+    for (l = g_list_first(d_lines); l; l = l->next) {
+        line = (struct dlg_line *)l->data;
+
+        if (g_str_has_prefix(line->img_filename, UNSAVED_IMG_TMP_DIR))
+            remove(line->img_filename);
+    }
+
+    for (i = 0; i < a_entries->len; i++) {
+        if (!save_entry_commit(&g_array_index(a_entries, struct save_entry, i)))
+            failed++;
+    }
+
+    for (i = 0; i < u_entries->len; i++) {
+        if (!save_entry_commit(&g_array_index(u_entries, struct save_entry, i)))
+            failed++;
+    }
+
+    /* reported once for the whole save */
+    if (failed > 0)
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"),
+                 gettext("%u images could not be saved."), failed);
+
+    db_remove_unused_images();
+
+    *added = a_entries->len;
+    ret = 1;
+    goto end_block;
+
+rollback_block:
+    sqlite3_exec(__db, "ROLLBACK", NULL, 0, NULL);
+    *deleted = 0;
+
+end_block:
+    g_array_free(a_entries, TRUE);
+    g_array_free(u_entries, TRUE);
+
+    return ret;
+}
+
+/*
+ * Moves the images of collection @name into the pack. Each image is added
+ * once and its entries renamed after it, the files are only removed when no
+ * entry uses them anymore.
+ */
+static int db_pack_collection_images(const char *name)
+{
+    GPtrArray *filenames;
+    sqlite3_stmt *stmt;
+    char *sql, *packed;
+    unsigned int i;
+    int n=0;
+
+    filenames = g_ptr_array_new_with_free_func(g_free);
+    sql = g_strdup_printf("SELECT DISTINCT c_image FROM %s "
+                          "WHERE c_image <> 'default_image_xpm' "
+                          "AND c_image NOT LIKE '" IMAGE_PACK_PREFIX "%%'", name);
+
+    if (sqlite3_prepare_v2(__db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+            g_ptr_array_add(filenames, g_strdup((char *)sqlite3_column_text(stmt, 0)));
+
+        sqlite3_finalize(stmt);
+    }
+
+    g_free(sql);
+    sql = g_strdup_printf("UPDATE %s SET c_image = ? WHERE c_image = ?", name);
+
+    /* runs without the UI, errors only go to stderr */
+    if ((sqlite3_prepare_v2(__db, sql, -1, &stmt, NULL) != SQLITE_OK) ||
+        (sqlite3_exec(__db, "BEGIN IMMEDIATE", NULL, 0, NULL) != SQLITE_OK))
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(__db));
+        n = -1;
+        goto end_block;
+    }
+
+    for (i = 0; i < filenames->len; i++) {
+        packed = image_store_pack(g_ptr_array_index(filenames, i));
+
+        if (packed == NULL) {
+            fprintf(stderr, gettext("Image '%s' can't be packed.\n"),
+                    (char *)g_ptr_array_index(filenames, i));
+
+            continue;
+        }
+
+        sqlite3_bind_text(stmt, 1, packed, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, g_ptr_array_index(filenames, i), -1,
+                          SQLITE_STATIC);
+
+        if (sqlite3_step(stmt) == SQLITE_DONE)
+            n++;
+
+        sqlite3_reset(stmt);
+        free(packed);
+    }
+
+    if (sqlite3_exec(__db, "COMMIT", NULL, 0, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(__db));
+        sqlite3_exec(__db, "ROLLBACK", NULL, 0, NULL);
+        n = -1;
+    }
+
+end_block:
+    sqlite3_finalize(stmt);
+    g_free(sql);
+    g_ptr_array_free(filenames, TRUE);
+
+    return n;
+}
+
+static int pack_images_job(gpointer data __attribute__((unused)))
+{
+    sqlite3_stmt *stmt;
+    GPtrArray *names;
+    unsigned int i;
+    int n, total=0;
 
-    for (i = 0; i < entries->len; i++) {
-        query = g_string_new(NULL);
-        line = &g_array_index(entries, dlg_line, i);
+    names = g_ptr_array_new_with_free_func(g_free);
 
-        if (line->status == LINE_LOADED)
-            continue;
+    if (sqlite3_prepare_v2(__db, "SELECT name FROM tab_collection", -1, &stmt,
+                           NULL) == SQLITE_OK)
+    {
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+            g_ptr_array_add(names, g_strdup((char *)sqlite3_column_text(stmt, 0)));
 
-        if (line->status == LINE_ADDED) {
-            g_string_printf(query, "INSERT INTO %s (c_image, %s) VALUES (\"%s\",",
-                            c->name,
-                            c->sql_fields_stmt->str,
-                            line->img_filename);
+        sqlite3_finalize(stmt);
+    }
 
-            for (l = g_list_first(line->column); l; l = l->next)
-                g_string_append_printf(query, "\"%s\",", (char *)l->data);
+    for (i = 0; i < names->len; i++) {
+        n = db_pack_collection_images(g_ptr_array_index(names, i));
 
-            g_string_erase(query, query->len - 1, -1);
-            g_string_append_printf(query, ")");
+        if (n < 0) {
+            total = -1;
+            break;
+        }
 
-            /* count added lines to update the tab label */
-            added++;
-        } else if (line->status == LINE_UPDATED) {
-            g_string_printf(query, "UPDATE %s SET c_image = \"%s\",", c->name,
-                            line->img_filename);
+        total += n;
+    }
 
-            for (l = g_list_first(c->fields), p = 0; l; l = l->next, p++) {
-                f = (struct db_field *)l->data;
-                g_string_append_printf(query, " %s = \"%s\",", f->name,
-                                       (char *)g_list_nth_data(line->new_column, p));
-            }
+    g_ptr_array_free(names, TRUE);
+    db_remove_unused_images();
 
-            g_string_erase(query, query->len - 1, -1);
-            g_string_append_printf(query, " WHERE");
-            g_string_append_printf(query, " id = %llu", line->id);
-        }
+    return total;
+}
 
-        if (sqlite3_exec(__db, query->str, NULL, 0, &emsg) != SQLITE_OK) {
-            display_msg(GTK_MESSAGE_ERROR, gettext("Error"), "%s", emsg);
-            sqlite3_free(emsg);
-            return 0;
+/*
+ * Moves the images kept as files, by older versions or while images weren't
+ * packed, into the pack. Gives how many were moved, -1 on errors.
+ */
+int db_pack_images(void)
+{
+    return db_worker_run_sync(pack_images_job, NULL);
+}
+
+/*
+ * Loads where the search of the missing covers of @c was left. Gives 1 if it
+ * was, 0 if it wasn't started or has ended and -1 on errors.
+ */
+int db_load_cover_fetch(struct db_collection *c, struct cover_fetch_progress *p)
+{
+    sqlite3_stmt *stmt;
+    int ret=0;
+
+    stmt = db_get_stmt(STMT_GLOBAL, STMT_LOAD_COVER_FETCH,
+                       "SELECT last_id, query, review, assigned, skipped "
+                       "FROM collection_cover_fetch WHERE cat_id = ?");
+
+    if (stmt == NULL) {
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s", sqlite3_errmsg(__db));
+        return -1;
+    }
+
+    sqlite3_bind_int(stmt, 1, c->id);
+
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        p->last_id = sqlite3_column_int64(stmt, 0);
+        p->query = strdup((char *)sqlite3_column_text(stmt, 1));
+        p->review = sqlite3_column_int(stmt, 2);
+        p->assigned = sqlite3_column_int(stmt, 3);
+        p->skipped = sqlite3_column_int(stmt, 4);
+        ret = 1;
+    }
+
+    sqlite3_reset(stmt);
+
+    return ret;
+}
+
+/* Keeps where the search of the missing covers of @c is */
+int db_save_cover_fetch(struct db_collection *c, struct cover_fetch_progress *p)
+{
+    sqlite3_stmt *stmt;
+    int ret;
+
+    stmt = db_get_stmt(STMT_GLOBAL, STMT_SAVE_COVER_FETCH,
+                       "INSERT OR REPLACE INTO collection_cover_fetch "
+                       "(cat_id, last_id, query, review, assigned, skipped) "
+                       "VALUES (?, ?, ?, ?, ?, ?)");
+
+    if (stmt == NULL) {
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s", sqlite3_errmsg(__db));
+        return 0;
+    }
+
+    sqlite3_bind_int(stmt, 1, c->id);
+    sqlite3_bind_int64(stmt, 2, p->last_id);
+    sqlite3_bind_text(stmt, 3, p->query, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 4, p->review);
+    sqlite3_bind_int(stmt, 5, p->assigned);
+    sqlite3_bind_int(stmt, 6, p->skipped);
+
+    ret = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+
+    if (ret != SQLITE_DONE) {
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s", sqlite3_errmsg(__db));
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Forgets the search of the missing covers of @c, once it has ended */
+int db_delete_cover_fetch(struct db_collection *c)
+{
+    return db_step_id(db_get_stmt(STMT_GLOBAL, STMT_DELETE_COVER_FETCH,
+                                  "DELETE FROM collection_cover_fetch "
+                                  "WHERE cat_id = ?"),
+                      c->id);
+}
+
+/*
+ * Loads up to @limit entries of @c still without a cover, after the entry
+ * @after_id, in the order they were added. Returns -1 on error.
+ */
+int db_load_entries_without_cover(struct db_collection *c,
+    unsigned long long after_id, int limit, GArray *lines, struct row_store *store)
+{
+    sqlite3_stmt *stmt;
+    struct dlg_line line;
+    char *sql;
+    int i, rows=0;
+
+    sql = g_strdup_printf("SELECT c_image, id, %s FROM %s "
+                          "WHERE id > ? AND c_image = 'default_image_xpm' "
+                          "ORDER BY id LIMIT ?",
+                          c->sql_fields_stmt->str, c->name);
+
+    stmt = db_get_stmt_sql(c->id, STMT_NO_COVER_PAGE, sql);
+    g_free(sql);
+
+    if (stmt == NULL) {
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"),
+                 gettext("Error searching the '%s' collection data"), c->name);
+
+        return -1;
+    }
+
+    sqlite3_bind_int64(stmt, 1, after_id);
+    sqlite3_bind_int(stmt, 2, limit);
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        memset(&line, 0, sizeof(struct dlg_line));
+        line.status = LINE_LOADED;
+        line.store = store;
+        line.cells = row_store_new_row(store);
+
+        if (!line.cells)
+            break;
+
+        line.img_filename = row_store_add_text(store,
+                                               (char *)sqlite3_column_text(stmt, 0));
+
+        line.id = sqlite3_column_int64(stmt, 1);
+
+        for (i = 0; i < c->active_fields; i++) {
+            line.cells[i] = row_store_add_text(store,
+                                               (char *)sqlite3_column_text(stmt, i + 2));
         }
 
-        if (line->status == LINE_UPDATED)
-            dlg_line_replace_data(line);
-        else
-            /* get the entry database id for future changes */
-            line->id = db_get_last_rowid();
+        g_array_append_val(lines, line);
+        rows++;
+    }
+
+    sqlite3_reset(stmt);
+
+    return rows;
+}
+
+/*
+ * Gives the entry @id of @c the cover @filename, an image still in
+ * UNSAVED_IMG_TMP_DIR, and keeps @p in the same transaction. Entries that got
+ * a cover meanwhile are left as they are. Gives 1 if the cover was set, 0 if
+ * it wasn't and -1 on errors.
+ */
+int db_set_entry_cover(struct db_collection *c, unsigned long long id,
+    const char *filename, struct cover_fetch_progress *p)
+{
+    sqlite3_stmt *stmt;
+    char *sql, *store_filename;
+    int ret, changed;
+
+    store_filename = image_store_filename(filename);
+
+    if (store_filename == NULL) {
+        remove(filename);
+        return 0;
+    }
+
+    sql = g_strdup_printf("UPDATE %s SET c_image = ? "
+                          "WHERE id = ? AND c_image = 'default_image_xpm'",
+                          c->name);
+
+    stmt = db_get_stmt_sql(c->id, STMT_SET_COVER, sql);
+    g_free(sql);
+
+    if ((stmt == NULL) || !db_exec("BEGIN IMMEDIATE")) {
+        if (stmt == NULL)
+            db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s",
+                     sqlite3_errmsg(__db));
+
+        free(store_filename);
+        return -1;
+    }
+
+    sqlite3_bind_text(stmt, 1, store_filename, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, id);
+    ret = sqlite3_step(stmt);
+    changed = sqlite3_changes(__db);
+    sqlite3_reset(stmt);
+
+    if (ret != SQLITE_DONE) {
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"), "%s", sqlite3_errmsg(__db));
+        goto rollback_block;
+    }
+
+    if (!db_save_cover_fetch(c, p) || !db_exec("COMMIT"))
+        goto rollback_block;
+
+    /* like a save, the image is only moved once it's committed */
+    if (!changed)
+        remove(filename);
+    else if (!image_store_add(filename, store_filename)) {
+        db_error(GTK_MESSAGE_ERROR, gettext("Error"),
+                 gettext("The cover of an entry could not be saved."));
+
+        changed = 0;
+    }
+
+    free(store_filename);
+
+    return changed;
+
+rollback_block:
+    sqlite3_exec(__db, "ROLLBACK", NULL, 0, NULL);
+    free(store_filename);
+    remove(filename);
+
+    return -1;
+}
+
+static void db_checkpoint(sqlite3 *db, const char *db_filename)
+{
+    char wal_filename[256]={0};
+    struct stat st;
+    gint64 t;
+    int log_frames=0, ckpt_frames=0, ret;
+
+    t = g_get_monotonic_time();
+    ret = sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_PASSIVE, &log_frames,
+                                    &ckpt_frames);
+
+    t = g_get_monotonic_time() - t;
+
+    if (ret != SQLITE_OK) {
+        g_warning("wal checkpoint failed: %s", sqlite3_errmsg(db));
+        return;
+    }
+
+    if (log_frames <= 0)
+        return;
+
+    snprintf(wal_filename, sizeof(wal_filename), "%s-wal", db_filename);
+
+    if (stat(wal_filename, &st) < 0)
+        st.st_size = 0;
+
+    g_debug("wal checkpoint: %d of %d frames in %.2f ms, wal size %lld bytes",
+            ckpt_frames, log_frames, t / 1000.0, (long long)st.st_size);
+}
+
+static gpointer checkpoint_thread(gpointer data)
+{
+    struct checkpointer *cp = (struct checkpointer *)data;
+    sqlite3 *db;
+    gint64 end_time;
+
+    if (sqlite3_open_v2(cp->db_filename, &db, SQLITE_OPEN_READWRITE, NULL)) {
+        g_warning("wal checkpoint: %s", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+
+    sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT);
+    g_mutex_lock(&cp->lock);
+
+    while (!cp->stop) {
+        end_time = g_get_monotonic_time() + cp->interval * G_TIME_SPAN_SECOND;
+
+        while (!cp->stop && g_cond_wait_until(&cp->cond, &cp->lock, end_time))
+            ;
+
+        if (cp->stop)
+            break;
+
+        g_mutex_unlock(&cp->lock);
+        db_checkpoint(db, cp->db_filename);
+        g_mutex_lock(&cp->lock);
+    }
+
+    g_mutex_unlock(&cp->lock);
+    sqlite3_close(db);
+
+    return NULL;
+}
+
+static void start_checkpointer(const char *db_filename, int interval)
+{
+    struct checkpointer *cp;
 
-        /* update image path */
-        if (strcmp(line->img_filename, "default_image_xpm"))
-            db_update_image_entry_info(c, line);
+    cp = malloc(sizeof(struct checkpointer));
 
-        line->status = LINE_LOADED;
-        g_string_free(query, TRUE);
+    if (!cp)
+        return;
+
+    g_mutex_init(&cp->lock);
+    g_cond_init(&cp->cond);
+    cp->stop = 0;
+    cp->interval = interval;
+    cp->db_filename = strdup(db_filename);
+
+    /* from now on checkpoints only happen in the background */
+    sqlite3_wal_autocheckpoint(__db, 0);
+    cp->thread = g_thread_new("db-checkpoint", checkpoint_thread, cp);
+    __checkpointer = cp;
+}
+
+static void stop_checkpointer(void)
+{
+    struct checkpointer *cp = __checkpointer;
+
+    if (cp == NULL)
+        return;
+
+    g_mutex_lock(&cp->lock);
+    cp->stop = 1;
+    g_cond_signal(&cp->cond);
+    g_mutex_unlock(&cp->lock);
+
+    g_thread_join(cp->thread);
+    g_mutex_clear(&cp->lock);
+    g_cond_clear(&cp->cond);
+    free(cp->db_filename);
+    free(cp);
+    __checkpointer = NULL;
+}
+
+/*
+ * Compares UTF-8 strings ignoring their case. ASCII text, the common case,
+ * is compared in place and only the rest is case folded. Strings that only
+ * differ in case are ordered by their bytes so the order is total.
+ */
+static int utf8_nocase_collate(void *arg __attribute__((unused)), int len_a,
+    const void *a, int len_b, const void *b)
+{
+    const unsigned char *sa = a, *sb = b;
+    char *fa, *fb;
+    int i, n, ret;
+
+    n = MIN(len_a, len_b);
+
+    for (i = 0; i < n; i++) {
+        if ((sa[i] | sb[i]) & 0x80)
+            break;
+
+        ret = g_ascii_tolower(sa[i]) - g_ascii_tolower(sb[i]);
+
+        if (ret != 0)
+            return ret;
+    }
+
+    if (i < n) {
+        fa = g_utf8_casefold((const char *)sa + i, len_a - i);
+        fb = g_utf8_casefold((const char *)sb + i, len_b - i);
+        ret = strcmp(fa, fb);
+        g_free(fa);
+        g_free(fb);
+    } else
+        ret = len_a - len_b;
+
+    if (ret != 0)
+        return ret;
+
+    ret = memcmp(a, b, n);
+
+    return (ret != 0) ? ret : (len_a - len_b);
+}
+
+/*
+ * Every connection that reads or writes collection tables must register
+ * it, since their sort indexes use it. Other programs can't use those tables
+ * while the indexes exist, see FILES in the man page.
+ */
+static int db_register_collations(sqlite3 *db)
+{
+    return sqlite3_create_collation_v2(db, DB_SORT_COLLATION, SQLITE_UTF8, NULL,
+                                       utf8_nocase_collate, NULL);
+}
+
+/* Interrupts the queries of cancelled jobs */
+static int db_progress_handler(void *arg __attribute__((unused)))
+{
+    return db_worker_cancelled();
+}
+
+/* Used before the UI exists, so errors can only go to stderr */
+static int db_pragma(const char *sql)
+{
+    char *emsg;
+
+    if (sqlite3_exec(__db, sql, NULL, 0, &emsg) != SQLITE_OK) {
+        fprintf(stderr, "Error: %s\n", emsg);
+        sqlite3_free(emsg);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int db_set_storage_options(struct storage_settings *storage)
+{
+    char str_query[128]={0};
+    int wal=0;
+    sqlite3_stmt *stmt;
+
+    sqlite3_busy_timeout(__db, DB_BUSY_TIMEOUT);
+
+    snprintf(str_query, sizeof(str_query), "PRAGMA journal_mode = %s",
+             (storage->mode == STORAGE_MODE_WAL) ? "WAL" : "DELETE");
+
+    /* journal_mode answers with the mode that is really being used */
+    if (sqlite3_prepare_v2(__db, str_query, -1, &stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+            wal = !strcmp((char *)sqlite3_column_text(stmt, 0), "wal");
+
+        sqlite3_finalize(stmt);
+    }
+
+    snprintf(str_query, sizeof(str_query), "PRAGMA synchronous = %d",
+             storage->synchronous);
+
+    if (!db_pragma(str_query))
+        return -1;
+
+    /* negative values are KiB instead of pages */
+    snprintf(str_query, sizeof(str_query), "PRAGMA cache_size = -%d",
+             storage->cache_size);
+
+    if (!db_pragma(str_query))
+        return -1;
+
+    snprintf(str_query, sizeof(str_query), "PRAGMA mmap_size = %lld",
+             (long long)storage->mmap_size * 1024 * 1024);
+
+    if (!db_pragma(str_query))
+        return -1;
+
+    snprintf(str_query, sizeof(str_query), "PRAGMA journal_size_limit = %d",
+             DB_JOURNAL_SIZE_LIMIT);
+
+    if (!db_pragma(str_query))
+        return -1;
+
+    return wal;
+}
+
+static void db_close_reader(struct db_reader *reader)
+{
+    /* statements must be finalized before closing the connection */
+    destroy_stmt_cache(reader->stmt_cache);
+    sqlite3_close(reader->db);
+    free(reader);
+}
+
+static struct db_reader *db_open_reader(const char *db_filename,
+    struct storage_settings *storage)
+{
+    struct db_reader *reader;
+    char str_query[128]={0};
+
+    reader = malloc(sizeof(struct db_reader));
+
+    if (!reader)
+        return NULL;
+
+    /* each reader is only used by one thread at a time */
+    if (sqlite3_open_v2(db_filename, &reader->db,
+                        SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) ||
+        (db_register_collations(reader->db) != SQLITE_OK))
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(reader->db));
+        sqlite3_close(reader->db);
+        free(reader);
+
+        return NULL;
+    }
+
+    sqlite3_busy_timeout(reader->db, DB_BUSY_TIMEOUT);
+    snprintf(str_query, sizeof(str_query), "PRAGMA mmap_size = %lld",
+             (long long)storage->mmap_size * 1024 * 1024);
+
+    sqlite3_exec(reader->db, str_query, NULL, 0, NULL);
+    sqlite3_progress_handler(reader->db, DB_PROGRESS_OPS, db_progress_handler,
+                             NULL);
+
+    reader->stmt_cache = create_stmt_cache(reader->db);
+
+    if (!reader->stmt_cache) {
+        sqlite3_close(reader->db);
+        free(reader);
+
+        return NULL;
+    }
+
+    return reader;
+}
+
+/* One reader per processor, the connections are cheap until used */
+static void db_open_readers(const char *db_filename, struct storage_settings *storage)
+{
+    struct db_reader *reader;
+    int i, n;
+
+    n = MIN(g_get_num_processors(), DB_MAX_READERS);
+    __readers = g_async_queue_new();
+
+    for (i = 0; i < n; i++) {
+        reader = db_open_reader(db_filename, storage);
+
+        if (!reader)
+            break;
+
+        g_async_queue_push(__readers, reader);
+        __n_readers++;
+    }
+}
+
+static void db_close_readers(void)
+{
+    if (__readers == NULL)
+        return;
+
+    /* the reader threads have finished, so every reader is idle */
+    while (__n_readers > 0) {
+        db_close_reader(g_async_queue_pop(__readers));
+        __n_readers--;
     }
 
-    return added;
+    g_async_queue_unref(__readers);
+    __readers = NULL;
+}
+
+/* Number of reader connections, 0 if rows are read by the worker */
+int db_readers(void)
+{
+    return __n_readers;
+}
+
+/*
+ * Takes an idle reader for the calling thread, which db_load_collection_page()
+ * and db_count_collection_rows() will use until it is released.
+ */
+void db_reader_acquire(void)
+{
+    g_private_set(&__reader, g_async_queue_pop(__readers));
+}
+
+void db_reader_release(void)
+{
+    g_async_queue_push(__readers, g_private_get(&__reader));
+    g_private_set(&__reader, NULL);
 }
 
-int db_init(void)
+int db_init(struct storage_settings *storage)
 {
     char db_filename[256]={0};
-    int create_db=0;
+    int create_db=0, wal;
 
     snprintf(db_filename, 256, "%s/%s/database/%s", getenv("HOME"), APP_CONFIG_PATH,
              DB_FILENAME);
@@ -766,18 +2781,57 @@ int db_init(void)
         return 0;
     }
 
+    if (db_register_collations(__db) != SQLITE_OK) {
+        sqlite3_close(__db);
+        return 0;
+    }
+
+    __stmt_cache = create_stmt_cache(__db);
+
+    if (!__stmt_cache) {
+        sqlite3_close(__db);
+        return 0;
+    }
+
+    wal = db_set_storage_options(storage);
+
+    if (wal < 0)
+        return 0;
+
+    if (wal)
+        start_checkpointer(db_filename, storage->checkpoint_interval);
+
     if (create_db) {
         if (!db_create_main_tables())
             return 0;
 
         create_default_collections();
+    } else if (!db_create_counters_table() || !db_create_images_table() ||
+               !db_create_cover_fetch_table())
+    {
+        return 0;
     }
 
-    return 1;
+    /* the tables exist now, so readers can be opened */
+    if (wal)
+        db_open_readers(db_filename, storage);
+
+    /* from now on the connection only belongs to the worker */
+    sqlite3_progress_handler(__db, DB_PROGRESS_OPS, db_progress_handler, NULL);
+
+    return db_worker_start();
 }
 
 void db_uninit(void)
 {
+    db_worker_stop();
+    db_close_readers();
+    stop_checkpointer();
+    g_debug("statement cache: %lu hits, %lu misses", __stmt_cache->hits,
+            __stmt_cache->misses);
+
+    /* statements must be finalized before closing the connection */
+    destroy_stmt_cache(__stmt_cache);
     sqlite3_close(__db);
     sqlite3_shutdown();
 }
@@ -0,0 +1,435 @@
+
+/*
+ * Description: thread running every database request, so the interface
+ *              never waits for the disk.
+ *
+ * Requests (jobs) are queued and run one at a time, in order, by a single
+ * thread which is the only one using the database connection. Background
+ * jobs, which nobody waits for, only run once no other job is queued. Jobs
+ * that only read rows may instead run on a pool of reader threads, each one
+ * with its own read-only connection. The function a job is done with, its
+ * progress reports and its error messages are all delivered to the main loop.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <libintl.h>
+
+#include "gtkollection.h"
+
+struct db_job {
+    db_job_func             run;
+    db_job_done_func        done;
+    db_job_progress_func    progress;
+    gpointer                data;
+    GDestroyNotify          destroy;
+
+    int                     result;
+    gint                    cancelled;
+    gint                    ref_count;
+
+    /* messages of the errors found while running */
+    GString                 *errors;
+
+    /* progress waiting to be delivered */
+    GMutex                  lock;
+    double                  fraction;
+    int                     progress_pending;
+
+    /* order in the queue, background jobs go after the others */
+    int                     background;
+    guint                   serial;
+
+    /* set for jobs someone is waiting for */
+    int                     sync;
+    int                     finished;
+    GCond                   cond;
+};
+
+static GThread *__worker = NULL;
+static GAsyncQueue *__jobs = NULL;
+static GThreadPool *__read_pool = NULL;
+
+/* tells the worker to stop, after every job queued before it */
+static struct db_job __stop_job;
+static gint __serial = 0;
+
+/* job being run by the calling thread */
+static GPrivate __current_job;
+
+static struct db_job *db_job_ref(struct db_job *job)
+{
+    g_atomic_int_inc(&job->ref_count);
+
+    return job;
+}
+
+static void db_job_unref(struct db_job *job)
+{
+    if (!g_atomic_int_dec_and_test(&job->ref_count))
+        return;
+
+    if (job->destroy != NULL)
+        job->destroy(job->data);
+
+    if (job->errors != NULL)
+        g_string_free(job->errors, TRUE);
+
+    g_mutex_clear(&job->lock);
+    g_cond_clear(&job->cond);
+    free(job);
+}
+
+static void show_job_errors(struct db_job *job)
+{
+    if ((job->errors == NULL) || (job->errors->len == 0))
+        return;
+
+    display_msg(GTK_MESSAGE_ERROR, gettext("Error"), "%s", job->errors->str);
+}
+
+/* main loop side of a finished job */
+static gboolean job_finished(gpointer data)
+{
+    struct db_job *job = (struct db_job *)data;
+
+    show_job_errors(job);
+
+    if (job->done != NULL)
+        job->done(job->result, g_atomic_int_get(&job->cancelled), job->data);
+
+    db_job_unref(job);
+
+    return FALSE;
+}
+
+static gboolean job_progress(gpointer data)
+{
+    struct db_job *job = (struct db_job *)data;
+    double fraction;
+
+    g_mutex_lock(&job->lock);
+    fraction = job->fraction;
+    job->progress_pending = 0;
+    g_mutex_unlock(&job->lock);
+
+    if (!g_atomic_int_get(&job->cancelled))
+        job->progress(fraction, job->data);
+
+    db_job_unref(job);
+
+    return FALSE;
+}
+
+static void run_job(struct db_job *job)
+{
+    g_private_set(&__current_job, job);
+
+    if (g_atomic_int_get(&job->cancelled))
+        job->result = -1;
+    else
+        job->result = job->run(job->data);
+
+    g_private_set(&__current_job, NULL);
+
+    if (job->sync) {
+        g_mutex_lock(&job->lock);
+        job->finished = 1;
+        g_cond_signal(&job->cond);
+        g_mutex_unlock(&job->lock);
+    } else
+        g_idle_add(job_finished, job);
+}
+
+static gint compare_jobs(gconstpointer a, gconstpointer b,
+    gpointer data __attribute__((unused)))
+{
+    const struct db_job *ja = a, *jb = b;
+
+    if (ja->background != jb->background)
+        return ja->background - jb->background;
+
+    return (gint)(ja->serial - jb->serial);
+}
+
+static void queue_job(struct db_job *job)
+{
+    job->serial = g_atomic_int_add(&__serial, 1);
+    g_async_queue_push_sorted(__jobs, job, compare_jobs, NULL);
+}
+
+static gpointer worker_thread(gpointer data __attribute__((unused)))
+{
+    struct db_job *job;
+
+    while ((job = g_async_queue_pop(__jobs)) != &__stop_job)
+        run_job(job);
+
+    return NULL;
+}
+
+static void reader_thread(gpointer data, gpointer user_data __attribute__((unused)))
+{
+    db_reader_acquire();
+    run_job((struct db_job *)data);
+    db_reader_release();
+}
+
+int db_worker_start(void)
+{
+    GError *error=NULL;
+
+    __jobs = g_async_queue_new();
+    __worker = g_thread_try_new("db-worker", worker_thread, NULL, &error);
+
+    if (__worker == NULL) {
+        fprintf(stderr, "Error: %s\n", error->message);
+        g_error_free(error);
+        g_async_queue_unref(__jobs);
+        __jobs = NULL;
+
+        return 0;
+    }
+
+    if (db_readers() == 0)
+        return 1;
+
+    /* no more threads than readers, so none waits for a connection */
+    __read_pool = g_thread_pool_new(reader_thread, NULL, db_readers(), FALSE,
+                                    &error);
+
+    if (__read_pool == NULL) {
+        /* rows are read by the worker then */
+        g_warning("%s", error->message);
+        g_error_free(error);
+    }
+
+    return 1;
+}
+
+/* Waits for the queued jobs to run, their results are not delivered */
+void db_worker_stop(void)
+{
+    if (__read_pool != NULL) {
+        g_thread_pool_free(__read_pool, FALSE, TRUE);
+        __read_pool = NULL;
+    }
+
+    if (__worker == NULL)
+        return;
+
+    __stop_job.background = 2;
+    queue_job(&__stop_job);
+    g_thread_join(__worker);
+    g_async_queue_unref(__jobs);
+
+    __worker = NULL;
+    __jobs = NULL;
+}
+
+/*
+ * Creates a job that will call @run on the worker thread, and then @done
+ * with its result on the main loop. @destroy releases @data after that.
+ */
+struct db_job *db_job_new(db_job_func run, db_job_done_func done, gpointer data,
+    GDestroyNotify destroy)
+{
+    struct db_job *job;
+
+    job = calloc(1, sizeof(struct db_job));
+
+    if (!job)
+        return NULL;
+
+    job->run = run;
+    job->done = done;
+    job->data = data;
+    job->destroy = destroy;
+    job->ref_count = 1;
+    g_mutex_init(&job->lock);
+    g_cond_init(&job->cond);
+
+    return job;
+}
+
+void db_job_set_progress_func(struct db_job *job, db_job_progress_func progress)
+{
+    job->progress = progress;
+}
+
+/*
+ * Queues @job. It may be cancelled until its done function is called,
+ * after that it no longer exists.
+ */
+void db_job_push(struct db_job *job)
+{
+    queue_job(job);
+}
+
+static struct db_job *submit_job(db_job_func run, db_job_done_func done,
+    gpointer data, GDestroyNotify destroy, int background)
+{
+    struct db_job *job;
+
+    job = db_job_new(run, done, data, destroy);
+
+    if (!job) {
+        if (destroy != NULL)
+            destroy(data);
+
+        return NULL;
+    }
+
+    job->background = background;
+    db_job_push(job);
+
+    return job;
+}
+
+struct db_job *db_job_submit(db_job_func run, db_job_done_func done, gpointer data,
+    GDestroyNotify destroy)
+{
+    return submit_job(run, done, data, destroy, 0);
+}
+
+/*
+ * Like db_job_submit(), for work nobody waits for. It runs after every other
+ * job queued, even the ones queued after it, but in order with the other
+ * background jobs.
+ */
+struct db_job *db_job_submit_background(db_job_func run, db_job_done_func done,
+    gpointer data, GDestroyNotify destroy)
+{
+    return submit_job(run, done, data, destroy, 1);
+}
+
+/*
+ * Like db_job_submit(), for jobs that only read collection rows. They may run
+ * in parallel with each other and with the worker, so they are not ordered.
+ */
+struct db_job *db_job_submit_read(db_job_func run, db_job_done_func done,
+    gpointer data, GDestroyNotify destroy)
+{
+    struct db_job *job;
+
+    if (__read_pool == NULL)
+        return db_job_submit(run, done, data, destroy);
+
+    job = db_job_new(run, done, data, destroy);
+
+    if (!job) {
+        if (destroy != NULL)
+            destroy(data);
+
+        return NULL;
+    }
+
+    g_thread_pool_push(__read_pool, job, NULL);
+
+    return job;
+}
+
+/*
+ * Jobs not started yet are skipped and running queries are interrupted. The
+ * done function is still called, with @cancelled set.
+ */
+void db_job_cancel(struct db_job *job)
+{
+    g_atomic_int_set(&job->cancelled, 1);
+}
+
+/*
+ * Runs @run on the worker thread and waits for it. Used by the operations
+ * whose result is needed right away, which block the main loop until the job
+ * running and the ones queued before it are done, background jobs aside.
+ * Before the worker starts, or when called from a job, @run is called
+ * directly.
+ */
+int db_worker_run_sync(db_job_func run, gpointer data)
+{
+    struct db_job *job;
+    int result;
+
+    if ((__worker == NULL) || (g_thread_self() == __worker))
+        return run(data);
+
+    job = db_job_new(run, NULL, data, NULL);
+
+    if (!job)
+        return -1;
+
+    job->sync = 1;
+    db_job_push(job);
+
+    g_mutex_lock(&job->lock);
+
+    while (!job->finished)
+        g_cond_wait(&job->cond, &job->lock);
+
+    g_mutex_unlock(&job->lock);
+
+    show_job_errors(job);
+    result = job->result;
+    db_job_unref(job);
+
+    return result;
+}
+
+/* Reports the progress of the running job, from 0 to 1 */
+void db_worker_progress(double fraction)
+{
+    struct db_job *job = g_private_get(&__current_job);
+    int pending;
+
+    if ((job == NULL) || (job->progress == NULL))
+        return;
+
+    g_mutex_lock(&job->lock);
+    job->fraction = fraction;
+    pending = job->progress_pending;
+    job->progress_pending = 1;
+    g_mutex_unlock(&job->lock);
+
+    /* the main loop only needs to hear about the latest one */
+    if (!pending)
+        g_idle_add(job_progress, db_job_ref(job));
+}
+
+/* Tells if the running job has been cancelled, used to interrupt queries */
+int db_worker_cancelled(void)
+{
+    struct db_job *job = g_private_get(&__current_job);
+
+    return (job != NULL) ? g_atomic_int_get(&job->cancelled) : 0;
+}
+
+/*
+ * Like display_msg(), but messages from jobs are shown when they finish.
+ */
+void db_error(GtkMessageType msg_type, const char *title, const char *fmt, ...)
+{
+    struct db_job *job;
+    va_list ap;
+    char *msg;
+
+    va_start(ap, fmt);
+    msg = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+
+    job = g_private_get(&__current_job);
+
+    if (job != NULL) {
+        if (job->errors == NULL)
+            job->errors = g_string_new(NULL);
+        else
+            g_string_append_c(job->errors, '\n');
+
+        g_string_append(job->errors, msg);
+    } else if ((__worker == NULL) || (g_thread_self() != __worker))
+        display_msg(msg_type, title, "%s", msg);
+    else
+        g_warning("%s", msg);
+
+    g_free(msg);
+}
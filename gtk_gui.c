@@ -21,12 +21,14 @@ static GtkWidget *__hpane;
 static GList *__db_collection = NULL;
 static GList *__dlg_data = NULL;
 static struct app_settings *__settings;
+static guint __prefetch_id = 0;
 
 static void quit(GtkWidget *w, gpointer data);
 static void about(GtkWidget *w, gpointer data);
 static void add_collection(GtkWidget *w, gpointer data);
 static void change_collection(GtkWidget *w, gpointer data);
 static void del_collection(GtkWidget *w, gpointer data);
+static void fetch_covers(GtkWidget *w, gpointer data);
 
 static GtkActionEntry __menu_items[] = {
     { "MainMenuAction",       GTK_STOCK_FILE,   gettext_noop("_Main"),       NULL, NULL, NULL },
@@ -36,6 +38,7 @@ static GtkActionEntry __menu_items[] = {
     { "AddCollection",        GTK_STOCK_ADD,    gettext_noop("_Add"),        NULL, NULL, G_CALLBACK(add_collection) },
     { "ChangeCollection",     GTK_STOCK_EDIT,   gettext_noop("_Change"),     NULL, NULL, G_CALLBACK(change_collection) },
     { "DeleteCollection",     GTK_STOCK_DELETE, gettext_noop("_Delete"),     NULL, NULL, G_CALLBACK(del_collection) },
+    { "FetchCovers",          GTK_STOCK_FIND,   gettext_noop("_Fetch missing covers"), NULL, NULL, G_CALLBACK(fetch_covers) },
     { "About",                GTK_STOCK_ABOUT,  gettext_noop("_About"),      NULL, NULL, G_CALLBACK(about) },
 };
 
@@ -51,6 +54,8 @@ static const char *__ui_string = "\
                 <menuitem name=\"Add\" action=\"AddCollection\" /> \
                 <menuitem name=\"Change\" action=\"ChangeCollection\" /> \
                 <menuitem name=\"Delete\" action=\"DeleteCollection\" /> \
+                <separator /> \
+                <menuitem name=\"FetchCovers\" action=\"FetchCovers\" /> \
             </menu> \
             <menu name=\"Help\" action=\"HelpMenuAction\" > \
                 <menuitem name=\"About\" action=\"About\" /> \
@@ -61,6 +66,12 @@ static const char *__ui_string = "\
 
 static void get_collection_sort_info(struct dlg_data *dlg_data)
 {
+    /* never shown, so it's still as the config file has it */
+    if (!dlg_data->built) {
+        load_collection_info_from_config(dlg_data->c->name, &dlg_data->info);
+        return;
+    }
+
     if (GTK_TOGGLE_BUTTON(dlg_data->priv.check_bt_sort)->active)
         dlg_data->info.enable = 1;
     else
@@ -101,7 +112,7 @@ static char *ui_has_unsaved_data(GList *dlg_data_list)
     for (l = g_list_first(dlg_data_list); l; l = l->next) {
         dlg_data = (struct dlg_data *)l->data;
 
-        if (gtk_widget_get_sensitive(dlg_data->bt_save))
+        if (dlg_data->built && gtk_widget_get_sensitive(dlg_data->bt_save))
             return dlg_data->c->screen_name;
     }
 
@@ -171,6 +182,58 @@ static struct dlg_data *search_dlg_data_list(struct db_collection *c)
     return NULL;
 }
 
+static struct dlg_data *search_dlg_data_page(GtkWidget *page)
+{
+    GList *l;
+    struct dlg_data *dlg;
+
+    for (l = g_list_first(__dlg_data); l; l = l->next) {
+        dlg = (struct dlg_data *)l->data;
+
+        if (dlg->page == page)
+            return dlg;
+    }
+
+    return NULL;
+}
+
+/* Builds the tab after the current one while there's nothing else to do */
+static gboolean prefetch_next_tab(gpointer data __attribute__((unused)))
+{
+    GtkWidget *page;
+    struct dlg_data *dlg;
+    int n;
+
+    __prefetch_id = 0;
+    n = gtk_notebook_get_current_page(GTK_NOTEBOOK(__notebook));
+    page = gtk_notebook_get_nth_page(GTK_NOTEBOOK(__notebook), n + 1);
+
+    if (page == NULL)
+        return FALSE;
+
+    dlg = search_dlg_data_page(page);
+
+    if (dlg != NULL)
+        collection_widget_build(dlg);
+
+    return FALSE;
+}
+
+static void s_switch_page(GtkNotebook *notebook,
+    gpointer page __attribute__((unused)), guint page_num,
+    gpointer data __attribute__((unused)))
+{
+    struct dlg_data *dlg;
+
+    dlg = search_dlg_data_page(gtk_notebook_get_nth_page(notebook, page_num));
+
+    if (dlg != NULL)
+        collection_widget_build(dlg);
+
+    if (__prefetch_id == 0)
+        __prefetch_id = g_idle_add(prefetch_next_tab, NULL);
+}
+
 static void ui_remove_notebook(const char *db_name, GtkWidget *notebook,
     int remove_database)
 {
@@ -183,13 +246,15 @@ static void ui_remove_notebook(const char *db_name, GtkWidget *notebook,
     if (c == NULL)
         return;
 
+    /* covers can't be searched for the entries anymore */
+    dlg = search_dlg_data_list(c);
+    cover_fetch_discard(c);
+
     /* remove from database */
     if (remove_database == TRUE)
         db_delete_collection(db_name);
 
     /* remove from internal dlg_data list */
-    dlg = search_dlg_data_list(c);
-
     if (dlg != NULL)
         __dlg_data = g_list_remove(__dlg_data, dlg);
 
@@ -214,6 +279,12 @@ static void ui_create_notebook(struct db_collection *c, gpointer user_data)
     dlg = collection_widget(c, __notebook);
     sprintf(label, gettext("%s - %d Items"), c->screen_name, c->n_entries);
 
+    /* must be known before the page is added, it may be switched to */
+    if (user_data != NULL)
+        __dlg_data = g_list_insert(__dlg_data, dlg, *index);
+    else
+        __dlg_data = g_list_append(__dlg_data, dlg);
+
     if (user_data != NULL) {
         gtk_notebook_insert_page(GTK_NOTEBOOK(__notebook), dlg->page,
                                  gtk_label_new(label), *index);
@@ -222,11 +293,6 @@ static void ui_create_notebook(struct db_collection *c, gpointer user_data)
                                  gtk_label_new(label));
 
     gtk_widget_show_all(__notebook);
-
-    if (user_data != NULL)
-        __dlg_data = g_list_insert(__dlg_data, dlg, *index);
-    else
-        __dlg_data = g_list_append(__dlg_data, dlg);
 }
 
 static void quit(GtkWidget *w __attribute__((unused)),
@@ -337,6 +403,11 @@ static void change_collection(GtkWidget *w __attribute__((unused)),
     if (db_screen_name != NULL) {
         db_name = screen_name_to_name(db_screen_name);
         c = search_db_collection_list(db_name, &index);
+
+        /* its entries may not be written while the collection changes */
+        if (c != NULL)
+            cover_fetch_discard(c);
+
         new_c = do_add_dialog(__main_window, c);
 
         if (new_c != NULL) {
@@ -374,6 +445,35 @@ static void del_collection(GtkWidget *w __attribute__((unused)),
     }
 }
 
+static void fetch_covers(GtkWidget *w __attribute__((unused)),
+    gpointer data __attribute__((unused)))
+{
+    char *db_screen_name, *db_name;
+    struct db_collection *c;
+    struct dlg_data *dlg;
+    int index=0;
+
+    /* a save would put the default covers back */
+    if (!check_unsaved_data(MSG_BLOCK_APP))
+        return;
+
+    db_screen_name = choose_collection(gettext("Select collection to fetch "
+                                               "covers for"));
+
+    if (db_screen_name == NULL)
+        return;
+
+    db_name = screen_name_to_name(db_screen_name);
+    c = search_db_collection_list(db_name, &index);
+    dlg = (c != NULL) ? search_dlg_data_list(c) : NULL;
+
+    if (dlg != NULL)
+        cover_fetch_start(dlg);
+
+    free(db_name);
+    free(db_screen_name);
+}
+
 static GtkWidget *ui_create_menu(GtkWidget *window, GtkUIManager *ui_manager)
 {
     GtkActionGroup *action_group;
@@ -461,9 +561,10 @@ void init_ui(int *argcp, char ***argvp, struct app_settings *settings)
     gtk_notebook_set_tab_pos(GTK_NOTEBOOK(notebook), GTK_POS_TOP);
     gtk_paned_add1(GTK_PANED(__hpane), notebook);
 
-    /* Create a tab for every collection that has been found */
+    /* Create a tab for every collection, built only when it is shown */
     __db_collection = db_get_all_collection_info();
     __notebook = notebook;
+    g_signal_connect(notebook, "switch-page", G_CALLBACK(s_switch_page), NULL);
     g_list_foreach(__db_collection, (GFunc)ui_create_notebook, NULL);
 
     gtk_widget_show_all(window);
@@ -508,6 +609,9 @@ void exit_ui(struct app_settings *settings)
 
     ui_remove_mainwindow(__main_window);
     g_list_free(__dlg_data);
+    cover_fetch_stop_all();
+    image_plugin_stop();
+    image_cache_destroy();
     g_list_foreach(__db_collection, (GFunc)destroy_db_collection, NULL);
 }
 
@@ -9,11 +9,22 @@
 #define APP_NAME                        "gtkollection"
 #define APP_CONFIG_PATH                 ".gtkollection"
 #define DB_FILENAME                     "collections.db"
-#define WEB_IMG_TMP_DIR                 "/tmp/gtkollection_web"
 #define UNSAVED_IMG_TMP_DIR             "/tmp/gtkollection_unsaved"
-#define IMAGE_PLUGIN                    "/opt/gtkollection/plugins/pl_images"
+#define IMAGE_STORE_DIR                 "images"
+#define IMAGE_PACK_PREFIX               "pack:"
+#define WEB_CACHE_DIR                   "web_cache"
+
+/* length of the SHA-1 naming a stored image, as text */
+#define IMAGE_DIGEST_LENGTH             40
+#define IMAGE_PROVIDER_DIR              "/opt/gtkollection/plugins"
 #define LICENSE_FILE                    "/opt/gtkollection/gpl-2.0.txt"
 
+/* cover images are kept at most this large */
+#define THUMBNAIL_SIZE                  150
+
+/* icons of the covers shown in the list, made when they are stored */
+#define ICON_SIZE                       32
+
 #define DLG_ADD_ENTRY                   1
 #define DLG_UPDATE_ENTRY                2
 
@@ -23,6 +34,16 @@
 #define CONFIG_SORT_ASC                 0
 #define CONFIG_SORT_DESC                1
 
+#define STORAGE_MODE_ROLLBACK           0
+#define STORAGE_MODE_WAL                1
+
+#define STORAGE_SYNC_OFF                0
+#define STORAGE_SYNC_NORMAL             1
+#define STORAGE_SYNC_FULL               2
+
+#define STORAGE_IMAGES_FILES            0
+#define STORAGE_IMAGES_PACK             1
+
 enum line_status {
     LINE_LOADED = 0,
     LINE_ADDED,
@@ -37,13 +58,23 @@ struct collection_sort_info {
     char        *name;
 };
 
+struct storage_settings {
+    int         mode;
+    int         synchronous;
+    int         cache_size;             /* KiB */
+    int         mmap_size;              /* MiB */
+    int         checkpoint_interval;    /* seconds */
+    int         images;                 /* where cover images are kept */
+};
+
 struct app_settings {
-    gboolean    maximized;
-    int         wnd_width;
-    int         wnd_height;
-    int         pos_x;
-    int         pos_y;
-    GList       *sort_info;
+    gboolean                maximized;
+    int                     wnd_width;
+    int                     wnd_height;
+    int                     pos_x;
+    int                     pos_y;
+    GList                   *sort_info;
+    struct storage_settings storage;
 };
 
 struct db_field {
@@ -63,18 +94,55 @@ struct db_collection {
     GString *sql_fields_stmt;
     GList   *fields;
     char    *image_path;
+    int     search_index;   /* has a full-text index */
+    int     image_refs;     /* counts the uses of its images */
 };
 
+struct row_store;
+
+/* A line of a collection, its values are kept by @store */
 struct dlg_line {
     int                 status;
-    GList               *column;
-    GList               *new_column;
-    char                *img_filename;
+    int                 new_image;      /* an updated line got another image */
+    struct row_store    *store;
+    const char          **cells;
+    const char          **new_cells;    /* values of an updated line */
+    const char          *img_filename;
     unsigned long long  id;
 };
 
 typedef struct dlg_line dlg_line;
 
+/* A window of rows to be loaded from a collection table */
+struct db_page_query {
+    int                 sort_field;     /* active field index, -1 sorts by id */
+    int                 order;
+    const char          *exclude;       /* comma separated ids to skip */
+    const char          *search;        /* words to search for, sorted by rank */
+    int                 has_key;
+    const char          *key_value;     /* sort value of the row before the page */
+    unsigned long long  key_id;         /* id of the row before the page */
+    int                 offset;         /* used when there is no key */
+    int                 limit;
+};
+
+/* Where the search of the missing covers of a collection was left */
+struct cover_fetch_progress {
+    unsigned long long  last_id;        /* entries up to it are done */
+    char                *query;         /* as given to parse_web_query() */
+    int                 review;         /* covers are chosen by the user */
+    int                 assigned;
+    int                 skipped;
+};
+
+struct image_cache_stats {
+    unsigned long       hits;
+    unsigned long       misses;
+    unsigned long       evictions;
+    size_t              bytes;
+    unsigned int        entries;
+};
+
 struct private_dlg_data {
     /* widgets */
     GtkWidget   *treeview;
@@ -85,17 +153,16 @@ struct private_dlg_data {
     GtkWidget   *sort_combo;
     GtkWidget   *rd_asc;
     GtkWidget   *rd_desc;
+    GtkWidget   *search_entry;
+    GtkWidget   *tree_sw;
+    GtkWidget   *cover_grid;
 
     /* data */
     GtkTreeModel    *model;
     int             tab_column_idx;
     char            *bt_img_filename;
-
-    /* model data (array of dlg_line structures) */
-    GArray          *data;
-
-    /* deleted lines */
-    GList           *d_lines;
+    guint           search_timeout;
+    char            *cover_filename;    /* of the selected row */
 };
 
 struct dlg_data {
@@ -107,6 +174,9 @@ struct dlg_data {
     GtkWidget               *bt_save;
     struct db_collection    *c;
 
+    /* the page widgets are only built when the tab is first shown */
+    int                     built;
+
     /* collection sort configuration */
     struct collection_sort_info info;
 };
@@ -116,6 +186,7 @@ int access_app_config_dir(void);
 void create_app_config_dir(void);
 void load_config_file(struct app_settings *settings);
 void save_config_file(struct app_settings settings);
+char *get_config_setting(const char *group, const char *key);
 void load_collection_info_from_config(const char *name,
                                       struct collection_sort_info *info);
 
@@ -138,7 +209,8 @@ int choose_msg(const char *title, const char *fmt, ...);
 char *screen_name_to_name(const char *sn);
 struct dlg_data *create_dlg_data(void);
 struct dlg_line *create_dlg_line(int line_status);
-void destroy_dlg_line(struct dlg_line *line);
+struct dlg_line *dup_dlg_line(const struct dlg_line *line, const char **values,
+                              struct row_store *store);
 
 GtkWidget *ui_get_mainwindow(void);
 void ui_prepend_mainwindow(GtkWidget *w);
@@ -147,8 +219,9 @@ void ui_remove_mainwindow(GtkWidget *w);
 int init_gettext(char *pPackage, char *pDirectory);
 GString* g_string_replace(GString *string, const gchar *sub, const gchar *repl);
 char *strrand(int size);
-void rename_file(const char *old, const char *new);
+int rename_file(const char *old, const char *new);
 void create_unsaved_images_tmp_dir(void);
+char *create_unsaved_image_filename(void);
 void remove_collection_dir(int collection_id);
 char *load_license_file(void);
 
@@ -158,7 +231,7 @@ void exit_ui(struct app_settings *settings);
 void run_ui(struct app_settings *settings);
 
 /* database.c */
-int db_init(void);
+int db_init(struct storage_settings *storage);
 void db_uninit(void);
 
 void db_create_collection(struct db_collection *c, int gtk_status);
@@ -167,19 +240,197 @@ int db_update_collection(struct db_collection *new_c, struct db_collection *orig
 
 GList *db_get_all_collection_info(void);
 
-int db_delete_collection_data(struct db_collection *c, GList *entries);
-int db_update_collection_data(struct db_collection *c, GArray *entries);
-void db_load_and_set_collection_data(struct db_collection *c, GtkListStore *store,
-                                     struct dlg_data *dlg_data);
+int db_save_collection_data(struct db_collection *c, GList *d_lines, GArray *entries,
+                            int *added, int *deleted);
+void db_get_stmt_cache_stats(unsigned long *hits, unsigned long *misses);
+int db_load_collection_page(struct db_collection *c, struct db_page_query *q,
+                            GArray *lines, struct row_store *store);
+int db_count_collection_rows(struct db_collection *c, struct db_page_query *q);
+int db_create_sort_index(struct db_collection *c, int sort_field);
+int db_pack_images(void);
+int db_load_cover_fetch(struct db_collection *c, struct cover_fetch_progress *p);
+int db_save_cover_fetch(struct db_collection *c, struct cover_fetch_progress *p);
+int db_delete_cover_fetch(struct db_collection *c);
+int db_load_entries_without_cover(struct db_collection *c,
+                                  unsigned long long after_id, int limit,
+                                  GArray *lines, struct row_store *store);
+
+int db_set_entry_cover(struct db_collection *c, unsigned long long id,
+                       const char *filename, struct cover_fetch_progress *p);
+
+int db_readers(void);
+void db_reader_acquire(void);
+void db_reader_release(void);
+
+/* db_worker.c */
+struct db_job;
+
+typedef int (*db_job_func)(gpointer data);
+typedef void (*db_job_done_func)(int result, int cancelled, gpointer data);
+typedef void (*db_job_progress_func)(double fraction, gpointer data);
+
+int db_worker_start(void);
+void db_worker_stop(void);
+struct db_job *db_job_new(db_job_func run, db_job_done_func done, gpointer data,
+                          GDestroyNotify destroy);
+
+void db_job_set_progress_func(struct db_job *job, db_job_progress_func progress);
+void db_job_push(struct db_job *job);
+struct db_job *db_job_submit(db_job_func run, db_job_done_func done, gpointer data,
+                             GDestroyNotify destroy);
+
+struct db_job *db_job_submit_background(db_job_func run, db_job_done_func done,
+                                        gpointer data, GDestroyNotify destroy);
+
+struct db_job *db_job_submit_read(db_job_func run, db_job_done_func done,
+                                  gpointer data, GDestroyNotify destroy);
+
+void db_job_cancel(struct db_job *job);
+int db_worker_run_sync(db_job_func run, gpointer data);
+void db_worker_progress(double fraction);
+int db_worker_cancelled(void);
+void db_error(GtkMessageType msg_type, const char *title, const char *fmt, ...);
+
+/* collection_model.c */
+GtkTreeModel *collection_model_new(struct db_collection *c);
+struct dlg_line *collection_model_dup_line(GtkTreeModel *model, GtkTreeIter *iter,
+                                          struct row_store *store);
+
+char *collection_model_get_image(GtkTreeModel *model, int row);
+
+void collection_model_append(GtkTreeModel *model, const char **values,
+                             const char *img_filename);
+
+void collection_model_update(GtkTreeModel *model, GtkTreeIter *iter,
+                             const char **values, const char *img_filename);
+
+void collection_model_remove(GtkTreeModel *model, GtkTreeIter *iter);
+void collection_model_set_sort(GtkTreeModel *model, int sort_field, int order);
+void collection_model_set_search(GtkTreeModel *model, const char *text);
+void collection_model_get_changes(GtkTreeModel *model, GList **d_lines,
+                                  GArray **entries);
+
+void collection_model_reload(GtkTreeModel *model);
+
+/* row_store.c */
+struct row_store *row_store_new(int n_cells);
+void row_store_free(struct row_store *store);
+const char **row_store_new_row(struct row_store *store);
+const char *row_store_add_text(struct row_store *store, const char *text);
+const char **row_store_copy_row(struct row_store *store, const char **values);
 
 /* collection_notebook.c */
 struct dlg_data *collection_widget(struct db_collection *c, GtkWidget *notebook);
+void collection_widget_build(struct dlg_data *dlg_data);
+void collection_widget_reload(struct dlg_data *dlg_data);
 
 /* collection_dialog.c */
 struct db_collection *do_add_dialog(GtkWidget *main_window, struct db_collection *db);
 
 /* image_dialog.c */
 char *get_cover_image_file(struct db_collection *c, struct dlg_line *line);
+GString *create_web_query_label(struct db_collection *c);
+char *parse_web_query(const char *text, struct db_collection *c,
+                      const char **cells);
+
+
+/* image.c */
+GdkPixbuf *image_decode(const void *data, size_t length, int size,
+                        int keep_aspect, GError **error);
+
+GdkPixbuf *image_load(const char *filename, int size, int keep_aspect,
+                      GError **error);
+
+int image_create_thumbnail(const char *filename, const char *thumb_filename,
+                           GError **error);
+
+GdkPixbuf *image_new_from_data(const void *data, size_t size, GError **error);
+GdkPixbuf *image_scale_to_fit(GdkPixbuf *pixbuf, int size);
+int image_create_icon(const char *filename, const char *icon_filename);
+int image_create_thumbnail_from_data(const void *data, size_t size,
+                                     const char *thumb_filename, GError **error);
+int image_save_thumbnail(GdkPixbuf *pixbuf, const char *thumb_filename,
+                         GError **error);
+
+/* image_scale.c */
+const char *image_scale_kernel(void);
+GdkPixbuf *image_scale(GdkPixbuf *src, int width, int height);
+
+/* image_plugin.c */
+struct image_search;
+
+typedef void (*image_found_func)(int index, GBytes *bytes, GdkPixbuf *pixbuf,
+                                 gpointer data);
+
+typedef void (*image_search_func)(GPtrArray *images, unsigned long long total,
+                                  const char *error, gpointer data);
+
+struct image_search *image_search_start(const char *query, int start,
+                                        image_found_func found,
+                                        image_search_func func, gpointer data);
+
+struct image_search *image_search_start_background(const char *query,
+                                                   int start,
+                                                   image_found_func found,
+                                                   image_search_func func,
+                                                   gpointer data);
+
+void image_search_prefetch(const char *query, int start);
+void image_search_cancel(struct image_search *search);
+int image_search_page_size(void);
+int image_plugin_load(void);
+void image_plugin_stop(void);
+
+/* web_cache.c */
+void web_cache_init(void);
+int web_cache_load(const char *provider, const char *query, int start,
+                   int count, GPtrArray *images, unsigned long long *total);
+
+void web_cache_store(const char *provider, const char *query, int start,
+                     int count, GPtrArray *images, unsigned long long total);
+
+int web_cache_has(const char *provider, const char *query, int start, int count);
+
+/* image_store.c */
+void image_store_init(struct storage_settings *storage);
+void image_store_uninit(void);
+int image_store_is_packed(const char *filename);
+char *image_store_filename(const char *filename);
+int image_store_add(const char *filename, const char *store_filename);
+void image_store_remove(const char *filename);
+char *image_store_pack(const char *filename);
+GdkPixbuf *image_store_load(const char *filename);
+GdkPixbuf *image_store_load_icon(const char *filename);
+
+/* image_pack.c */
+int image_pack_open(void);
+void image_pack_close(void);
+int image_pack_add(const char *digest, const char *filename);
+void image_pack_remove(const char *digest);
+GdkPixbuf *image_pack_load(const char *digest, int size);
+
+/* image_cache.c */
+typedef void (*image_cache_func)(GdkPixbuf *pixbuf, const char *filename,
+                                 gpointer data);
+
+GdkPixbuf *image_cache_peek(const char *filename);
+GdkPixbuf *image_cache_lookup(const char *filename);
+void image_cache_load(const char *filename, image_cache_func func, gpointer data);
+GdkPixbuf *image_cache_peek_icon(const char *filename);
+void image_cache_load_icon(const char *filename, image_cache_func func,
+                           gpointer data);
+void image_cache_prefetch(char **filenames, int n);
+void image_cache_get_stats(struct image_cache_stats *stats);
+void image_cache_destroy(void);
+
+/* cover_grid.c */
+GtkWidget *cover_grid_new(struct dlg_data *dlg_data);
+
+/* cover_fetch.c */
+void cover_fetch_start(struct dlg_data *dlg_data);
+void cover_fetch_stop(struct dlg_data *dlg_data);
+void cover_fetch_discard(struct db_collection *c);
+void cover_fetch_stop_all(void);
 
 #endif
 
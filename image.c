@@ -0,0 +1,248 @@
+
+/*
+ * Description: cover image handling.
+ *
+ * Images are decoded with gdk-pixbuf and scaled with image_scale(). Its JPEG
+ * loader is asked for the smallest size it decodes to directly, 1/2, 1/4 or
+ * 1/8 of the image, that is still larger than the one wanted, so large
+ * photos are never fully decoded and the rest is left to image_scale().
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gtkollection.h"
+
+#define THUMBNAIL_JPEG_QUALITY      "90"
+
+/* Size an image is being decoded to */
+struct decode_size {
+    int     size;
+    int     keep_aspect;
+};
+
+static int save_thumbnail(GdkPixbuf *pixbuf, const char *thumb_filename,
+    GError **error)
+{
+    int ret;
+
+    ret = gdk_pixbuf_save(pixbuf, thumb_filename, "jpeg", error, "quality",
+                          THUMBNAIL_JPEG_QUALITY, NULL);
+
+    g_object_unref(pixbuf);
+
+    return ret ? 1 : 0;
+}
+
+/*
+ * Size that a @width x @height image gets scaled to. Keeping its aspect
+ * ratio it's only shrunk to fit in @size x @size, otherwise it's stretched
+ * to that.
+ */
+static void target_size(int width, int height, struct decode_size *s,
+    int *t_width, int *t_height)
+{
+    *t_width = s->size;
+    *t_height = s->size;
+
+    if (!s->keep_aspect)
+        return;
+
+    if ((width <= s->size) && (height <= s->size)) {
+        *t_width = width;
+        *t_height = height;
+    } else if (width > height)
+        *t_height = MAX(height * s->size / width, 1);
+    else
+        *t_width = MAX(width * s->size / height, 1);
+}
+
+static int is_jpeg(GdkPixbufLoader *loader)
+{
+    GdkPixbufFormat *format;
+    gchar *name;
+    int ret;
+
+    format = gdk_pixbuf_loader_get_format(loader);
+
+    if (format == NULL)
+        return 0;
+
+    name = gdk_pixbuf_format_get_name(format);
+    ret = !g_strcmp0(name, "jpeg");
+    g_free(name);
+
+    return ret;
+}
+
+/*
+ * Asks the JPEG loader for the size it decodes to by itself, so it doesn't
+ * scale the image with gdk-pixbuf afterwards. Other formats are decoded as
+ * they are.
+ */
+static void s_size_prepared(GdkPixbufLoader *loader, gint width, gint height,
+    gpointer data)
+{
+    struct decode_size *s = (struct decode_size *)data;
+    int t_width, t_height, denom;
+
+    if (!is_jpeg(loader))
+        return;
+
+    target_size(width, height, s, &t_width, &t_height);
+
+    for (denom = 8; denom > 1; denom /= 2)
+        if (((width + denom - 1) / denom >= t_width) &&
+            ((height + denom - 1) / denom >= t_height))
+        {
+            break;
+        }
+
+    if (denom > 1)
+        gdk_pixbuf_loader_set_size(loader, (width + denom - 1) / denom,
+                                   (height + denom - 1) / denom);
+}
+
+/*
+ * Decodes an image of @length bytes kept in memory, scaled to @size like
+ * target_size() says. If @size is 0 it's left as it is.
+ */
+GdkPixbuf *image_decode(const void *data, size_t length, int size,
+    int keep_aspect, GError **error)
+{
+    struct decode_size s;
+    GdkPixbufLoader *loader;
+    GdkPixbuf *pixbuf=NULL, *scaled;
+    int ret, width, height;
+
+    s.size = size;
+    s.keep_aspect = keep_aspect;
+    loader = gdk_pixbuf_loader_new();
+
+    if (size > 0)
+        g_signal_connect(loader, "size-prepared", G_CALLBACK(s_size_prepared), &s);
+
+    ret = gdk_pixbuf_loader_write(loader, data, length, error);
+
+    /* an error is only kept once */
+    if (gdk_pixbuf_loader_close(loader, ret ? error : NULL) && ret) {
+        pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+
+        if (pixbuf != NULL)
+            g_object_ref(pixbuf);
+    }
+
+    g_object_unref(loader);
+
+    if ((pixbuf == NULL) || (size == 0))
+        return pixbuf;
+
+    target_size(gdk_pixbuf_get_width(pixbuf), gdk_pixbuf_get_height(pixbuf),
+                &s, &width, &height);
+
+    scaled = image_scale(pixbuf, width, height);
+    g_object_unref(pixbuf);
+
+    return scaled;
+}
+
+/* Like image_decode(), for the image @filename */
+GdkPixbuf *image_load(const char *filename, int size, int keep_aspect,
+    GError **error)
+{
+    GdkPixbuf *pixbuf;
+    gchar *data;
+    gsize length;
+
+    if (!g_file_get_contents(filename, &data, &length, error))
+        return NULL;
+
+    pixbuf = image_decode(data, length, size, keep_aspect, error);
+    g_free(data);
+
+    return pixbuf;
+}
+
+/*
+ * Writes @filename scaled to fit in THUMBNAIL_SIZE x THUMBNAIL_SIZE, keeping
+ * its aspect ratio, as a JPEG file named @thumb_filename.
+ */
+int image_create_thumbnail(const char *filename, const char *thumb_filename,
+    GError **error)
+{
+    GdkPixbuf *pixbuf;
+
+    pixbuf = image_load(filename, THUMBNAIL_SIZE, TRUE, error);
+
+    if (pixbuf == NULL)
+        return 0;
+
+    return save_thumbnail(pixbuf, thumb_filename, error);
+}
+
+/* Writes @pixbuf, already made to fit THUMBNAIL_SIZE, like thumbnails are */
+int image_save_thumbnail(GdkPixbuf *pixbuf, const char *thumb_filename,
+    GError **error)
+{
+    return save_thumbnail(g_object_ref(pixbuf), thumb_filename, error);
+}
+
+/*
+ * Gives an image of @size bytes kept in memory scaled down to fit in
+ * THUMBNAIL_SIZE x THUMBNAIL_SIZE, keeping its aspect ratio.
+ */
+GdkPixbuf *image_new_from_data(const void *data, size_t size, GError **error)
+{
+    return image_decode(data, size, THUMBNAIL_SIZE, TRUE, error);
+}
+
+/*
+ * Gives @pixbuf scaled down to fit in @size x @size, keeping its aspect
+ * ratio, or a new reference to it if it's already small enough.
+ */
+GdkPixbuf *image_scale_to_fit(GdkPixbuf *pixbuf, int size)
+{
+    struct decode_size s;
+    int width, height;
+
+    s.size = size;
+    s.keep_aspect = TRUE;
+    target_size(gdk_pixbuf_get_width(pixbuf), gdk_pixbuf_get_height(pixbuf), &s,
+                &width, &height);
+
+    return image_scale(pixbuf, width, height);
+}
+
+/*
+ * Writes the cover @filename scaled to fit in ICON_SIZE x ICON_SIZE as a PNG
+ * file named @icon_filename, so the list never scales covers itself.
+ */
+int image_create_icon(const char *filename, const char *icon_filename)
+{
+    GdkPixbuf *pixbuf;
+    int ret;
+
+    pixbuf = image_load(filename, ICON_SIZE, TRUE, NULL);
+
+    if (pixbuf == NULL)
+        return 0;
+
+    ret = gdk_pixbuf_save(pixbuf, icon_filename, "png", NULL, NULL);
+    g_object_unref(pixbuf);
+
+    return ret ? 1 : 0;
+}
+
+/* Like image_create_thumbnail(), for an image kept in memory */
+int image_create_thumbnail_from_data(const void *data, size_t size,
+    const char *thumb_filename, GError **error)
+{
+    GdkPixbuf *pixbuf;
+
+    pixbuf = image_new_from_data(data, size, error);
+
+    if (pixbuf == NULL)
+        return 0;
+
+    return save_thumbnail(pixbuf, thumb_filename, error);
+}
@@ -0,0 +1,558 @@
+
+/*
+ * Description: cache of the cover images shown, already scaled.
+ *
+ * Images are kept by their file name and checked against its modification
+ * time, so a replaced file is read again. The least recently used ones are
+ * dropped once the cache holds more than IMAGE_CACHE_BUDGET bytes of pixels.
+ *
+ * Images may also be decoded by a pool of threads. The cache itself is only
+ * used from the main loop, decoded images are added to it there.
+ *
+ * The icons shown in the list are kept alongside, under the name of their
+ * image with ICON_KEY_PREFIX added.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "gtkollection.h"
+#include "cover_image.xpm"
+
+#define IMAGE_CACHE_BUDGET          (16 * 1024 * 1024)
+#define IMAGE_DECODERS_MAX          4
+
+/* name of the image used by entries without a cover of their own */
+#define DEFAULT_IMAGE               "default_image_xpm"
+
+#define ICON_KEY_PREFIX             "icon:"
+
+struct image_cache_entry {
+    char        *filename;
+    time_t      mtime;
+    GdkPixbuf   *pixbuf;
+    size_t      bytes;
+    GList       *lru_link;
+};
+
+struct image_waiter {
+    image_cache_func    func;
+    gpointer            data;
+};
+
+/* An image being decoded, with whoever is waiting for it */
+struct image_load {
+    char        *filename;
+    time_t      mtime;
+    GdkPixbuf   *pixbuf;
+    GList       *waiters;
+    gint        started;
+    gint        queued;         /* tasks not run yet */
+    gint        ref_count;
+};
+
+/* Queued decoding of a load, there are two if a prefetched one was needed */
+struct image_task {
+    struct image_load   *load;
+    int                 urgent;
+    guint               prefetch_serial;
+};
+
+static GHashTable *__entries = NULL;
+static GQueue *__lru = NULL;
+static GdkPixbuf *__default_image = NULL;
+static GdkPixbuf *__default_icon = NULL;
+static struct image_cache_stats __stats;
+
+static GThreadPool *__decoders = NULL;
+static GHashTable *__loads = NULL;
+
+/* prefetches queued before the last image_cache_prefetch() are skipped */
+static guint __prefetch_serial = 0;
+
+static void destroy_entry(struct image_cache_entry *e)
+{
+    g_object_unref(e->pixbuf);
+    free(e->filename);
+    free(e);
+}
+
+static void remove_entry(struct image_cache_entry *e)
+{
+    g_queue_delete_link(__lru, e->lru_link);
+    __stats.bytes -= e->bytes;
+    __stats.entries--;
+
+    /* the table owns the entry */
+    g_hash_table_remove(__entries, e->filename);
+}
+
+static void evict_entries(void)
+{
+    struct image_cache_entry *e;
+
+    while ((__stats.bytes > IMAGE_CACHE_BUDGET) && (__lru->tail != NULL)) {
+        e = (struct image_cache_entry *)__lru->tail->data;
+        remove_entry(e);
+        __stats.evictions++;
+    }
+}
+
+static void insert_entry(const char *filename, time_t mtime, GdkPixbuf *pixbuf)
+{
+    struct image_cache_entry *e;
+
+    /* it may have been read meanwhile by image_cache_lookup() */
+    e = g_hash_table_lookup(__entries, filename);
+
+    if (e != NULL)
+        remove_entry(e);
+
+    e = malloc(sizeof(struct image_cache_entry));
+
+    if (!e)
+        return;
+
+    e->filename = strdup(filename);
+    e->mtime = mtime;
+    e->pixbuf = g_object_ref(pixbuf);
+
+    /* failed images share the default one, which is always kept */
+    if ((pixbuf == __default_image) || (pixbuf == __default_icon))
+        e->bytes = 0;
+    else
+        e->bytes = gdk_pixbuf_get_rowstride(pixbuf) * gdk_pixbuf_get_height(pixbuf);
+
+    g_queue_push_head(__lru, e);
+    e->lru_link = __lru->head;
+    g_hash_table_insert(__entries, e->filename, e);
+
+    __stats.bytes += e->bytes;
+    __stats.entries++;
+    evict_entries();
+}
+
+static int is_icon_key(const char *key)
+{
+    return g_str_has_prefix(key, ICON_KEY_PREFIX);
+}
+
+/* Gives the name of the image cached as @key */
+static const char *key_filename(const char *key)
+{
+    return is_icon_key(key) ? key + strlen(ICON_KEY_PREFIX) : key;
+}
+
+static GdkPixbuf *default_image(const char *key)
+{
+    return is_icon_key(key) ? __default_icon : __default_image;
+}
+
+static GdkPixbuf *decode_image(const char *key)
+{
+    if (is_icon_key(key))
+        return image_store_load_icon(key_filename(key));
+
+    return image_store_load(key);
+}
+
+static void image_load_unref(struct image_load *load)
+{
+    if (!g_atomic_int_dec_and_test(&load->ref_count))
+        return;
+
+    if (load->pixbuf != NULL)
+        g_object_unref(load->pixbuf);
+
+    g_list_free_full(load->waiters, free);
+    free(load->filename);
+    free(load);
+}
+
+/*
+ * Main loop side of a decoded image. Releases the reference of the task that
+ * decoded it and the one of the loads table.
+ */
+static gboolean image_decoded(gpointer data)
+{
+    struct image_load *load = (struct image_load *)data;
+    struct image_waiter *w;
+    GdkPixbuf *pixbuf;
+    GList *l;
+
+    g_hash_table_remove(__loads, load->filename);
+
+    /*
+     * Images that can't be read are cached as the default one, or they would
+     * be decoded again each time they are shown. A replaced file is retried.
+     */
+    if (load->pixbuf != NULL)
+        pixbuf = load->pixbuf;
+    else
+        pixbuf = default_image(load->filename);
+
+    insert_entry(load->filename, load->mtime, pixbuf);
+
+    for (l = load->waiters; l; l = l->next) {
+        w = (struct image_waiter *)l->data;
+        w->func(pixbuf, key_filename(load->filename), w->data);
+    }
+
+    image_load_unref(load);
+    image_load_unref(load);
+
+    return FALSE;
+}
+
+/* Forgets a prefetch whose tasks were all skipped, unless it was asked again */
+static gboolean image_dropped(gpointer data)
+{
+    struct image_load *load = (struct image_load *)data;
+
+    if (!g_atomic_int_get(&load->queued) && !g_atomic_int_get(&load->started) &&
+        (g_hash_table_lookup(__loads, load->filename) == load))
+    {
+        g_hash_table_remove(__loads, load->filename);
+        image_load_unref(load);
+    }
+
+    image_load_unref(load);
+
+    return FALSE;
+}
+
+static void decoder_thread(gpointer data, gpointer user_data __attribute__((unused)))
+{
+    struct image_task *task = (struct image_task *)data;
+    struct image_load *load = task->load;
+    int skip, last;
+
+    skip = !task->urgent &&
+           (task->prefetch_serial != (guint)g_atomic_int_get(&__prefetch_serial));
+
+    free(task);
+    last = g_atomic_int_dec_and_test(&load->queued);
+
+    /* another task of the load may have started it already */
+    if (skip || !g_atomic_int_compare_and_exchange(&load->started, 0, 1)) {
+        if (last && !g_atomic_int_get(&load->started))
+            g_idle_add(image_dropped, load);
+        else
+            image_load_unref(load);
+
+        return;
+    }
+
+    load->pixbuf = decode_image(load->filename);
+    g_idle_add(image_decoded, load);
+}
+
+/* Urgent tasks are decoded first, then the most recent prefetches */
+static gint compare_tasks(gconstpointer a, gconstpointer b,
+    gpointer data __attribute__((unused)))
+{
+    const struct image_task *ta = a, *tb = b;
+
+    if (ta->urgent != tb->urgent)
+        return tb->urgent - ta->urgent;
+
+    return (gint)(tb->prefetch_serial - ta->prefetch_serial);
+}
+
+static void image_cache_init(void)
+{
+    __entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                      (GDestroyNotify)destroy_entry);
+
+    __lru = g_queue_new();
+    __default_image = gdk_pixbuf_new_from_xpm_data(__default_cover_image);
+    __default_icon = image_scale_to_fit(__default_image, ICON_SIZE);
+    memset(&__stats, 0, sizeof(struct image_cache_stats));
+
+    /* images are then decoded in the main loop */
+    __decoders = g_thread_pool_new(decoder_thread, NULL,
+                                   MIN(g_get_num_processors(), IMAGE_DECODERS_MAX),
+                                   FALSE, NULL);
+
+    if (__decoders != NULL)
+        g_thread_pool_set_sort_function(__decoders, compare_tasks, NULL);
+
+    __loads = g_hash_table_new(g_str_hash, g_str_equal);
+}
+
+/*
+ * Gives the cached image of @key, NULL if it must be decoded first. The
+ * default cover is used for images that can't be read.
+ */
+static GdkPixbuf *cached_image(const char *key, struct stat *st)
+{
+    struct image_cache_entry *e;
+    const char *filename;
+
+    if (__entries == NULL)
+        image_cache_init();
+
+    filename = key_filename(key);
+
+    if (!strcmp(filename, DEFAULT_IMAGE))
+        return default_image(key);
+
+    /* packed images never change, their name is their contents */
+    if (image_store_is_packed(filename))
+        st->st_mtime = 0;
+    else if (stat(filename, st) == -1)
+        return default_image(key);
+
+    e = g_hash_table_lookup(__entries, key);
+
+    if (e == NULL)
+        return NULL;
+
+    if (e->mtime != st->st_mtime) {
+        /* the file has been replaced */
+        remove_entry(e);
+        return NULL;
+    }
+
+    __stats.hits++;
+    g_queue_unlink(__lru, e->lru_link);
+    g_queue_push_head_link(__lru, e->lru_link);
+
+    return e->pixbuf;
+}
+
+static void queue_task(struct image_load *load, int urgent)
+{
+    struct image_task *task;
+
+    task = malloc(sizeof(struct image_task));
+
+    if (!task)
+        return;
+
+    g_atomic_int_inc(&load->ref_count);
+    g_atomic_int_inc(&load->queued);
+    task->load = load;
+    task->urgent = urgent;
+    task->prefetch_serial = g_atomic_int_get(&__prefetch_serial);
+    g_thread_pool_push(__decoders, task, NULL);
+}
+
+static struct image_load *start_load(const char *filename, time_t mtime,
+    int urgent)
+{
+    struct image_load *load;
+
+    load = g_hash_table_lookup(__loads, filename);
+
+    if (load != NULL) {
+        /* a prefetch may be queued behind others, or about to be skipped */
+        if (!g_atomic_int_get(&load->started))
+            queue_task(load, urgent);
+
+        return load;
+    }
+
+    load = calloc(1, sizeof(struct image_load));
+
+    if (!load)
+        return NULL;
+
+    load->filename = strdup(filename);
+    load->mtime = mtime;
+    load->ref_count = 1;
+    g_hash_table_insert(__loads, load->filename, load);
+    __stats.misses++;
+    queue_task(load, urgent);
+
+    return load;
+}
+
+/*
+ * Gives the image of @filename if it's cached, without decoding it. It still
+ * belongs to the cache.
+ */
+GdkPixbuf *image_cache_peek(const char *filename)
+{
+    struct stat st;
+
+    return cached_image(filename, &st);
+}
+
+static GdkPixbuf *lookup_image(const char *key)
+{
+    struct stat st;
+    GdkPixbuf *pixbuf;
+
+    pixbuf = cached_image(key, &st);
+
+    if (pixbuf != NULL)
+        return g_object_ref(pixbuf);
+
+    __stats.misses++;
+    pixbuf = decode_image(key);
+
+    if (pixbuf == NULL)
+        pixbuf = g_object_ref(default_image(key));
+
+    insert_entry(key, st.st_mtime, pixbuf);
+
+    return pixbuf;
+}
+
+/*
+ * Gives the image of @filename scaled to THUMBNAIL_SIZE, or the default
+ * cover if it can't be read. The caller owns a reference to it and must
+ * g_object_unref() it.
+ */
+GdkPixbuf *image_cache_lookup(const char *filename)
+{
+    return lookup_image(filename);
+}
+
+static void load_image(const char *key, image_cache_func func, gpointer data)
+{
+    struct image_load *load;
+    struct image_waiter *w;
+    struct stat st;
+    GdkPixbuf *pixbuf;
+    GList *l;
+
+    pixbuf = cached_image(key, &st);
+
+    if (pixbuf != NULL) {
+        func(pixbuf, key_filename(key), data);
+        return;
+    }
+
+    if (__decoders == NULL) {
+        pixbuf = lookup_image(key);
+        func(pixbuf, key_filename(key), data);
+        g_object_unref(pixbuf);
+
+        return;
+    }
+
+    w = malloc(sizeof(struct image_waiter));
+
+    if (!w)
+        return;
+
+    load = start_load(key, st.st_mtime, TRUE);
+
+    if (!load) {
+        free(w);
+        return;
+    }
+
+    /* views asking again while it's decoded are only told once */
+    for (l = load->waiters; l; l = l->next) {
+        if ((((struct image_waiter *)l->data)->func == func) &&
+            (((struct image_waiter *)l->data)->data == data))
+        {
+            free(w);
+            return;
+        }
+    }
+
+    w->func = func;
+    w->data = data;
+    load->waiters = g_list_append(load->waiters, w);
+}
+
+/*
+ * Like image_cache_lookup(), but images that aren't cached are decoded in
+ * the background. @func is called with the image, right away if it's
+ * cached, or from the main loop later on. It doesn't own the image.
+ */
+void image_cache_load(const char *filename, image_cache_func func, gpointer data)
+{
+    load_image(filename, func, data);
+}
+
+/* Like image_cache_peek(), for the icon of @filename */
+GdkPixbuf *image_cache_peek_icon(const char *filename)
+{
+    GdkPixbuf *pixbuf;
+    struct stat st;
+    char *key;
+
+    key = g_strconcat(ICON_KEY_PREFIX, filename, NULL);
+    pixbuf = cached_image(key, &st);
+    g_free(key);
+
+    return pixbuf;
+}
+
+/*
+ * Like image_cache_load(), for the icon of @filename. @func is given the
+ * name of the image, not the one of its icon.
+ */
+void image_cache_load_icon(const char *filename, image_cache_func func,
+    gpointer data)
+{
+    char *key;
+
+    key = g_strconcat(ICON_KEY_PREFIX, filename, NULL);
+    load_image(key, func, data);
+    g_free(key);
+}
+
+/*
+ * Decodes the images of @filenames in the background, if they aren't cached,
+ * so they can be shown at once later. Prefetches asked before are dropped if
+ * they didn't start yet.
+ */
+void image_cache_prefetch(char **filenames, int n)
+{
+    struct stat st;
+    int i;
+
+    if (__entries == NULL)
+        image_cache_init();
+
+    if (__decoders == NULL)
+        return;
+
+    g_atomic_int_inc(&__prefetch_serial);
+
+    for (i = 0; i < n; i++) {
+        if ((filenames[i] == NULL) || (cached_image(filenames[i], &st) != NULL))
+            continue;
+
+        start_load(filenames[i], st.st_mtime, FALSE);
+    }
+}
+
+void image_cache_get_stats(struct image_cache_stats *stats)
+{
+    *stats = __stats;
+}
+
+void image_cache_destroy(void)
+{
+    if (__entries == NULL)
+        return;
+
+    g_debug("image cache: %lu hits, %lu misses, %lu evictions", __stats.hits,
+            __stats.misses, __stats.evictions);
+
+    /* skips the prefetches, decoded images aren't delivered anymore */
+    if (__decoders != NULL) {
+        g_atomic_int_inc(&__prefetch_serial);
+        g_thread_pool_free(__decoders, FALSE, TRUE);
+        __decoders = NULL;
+    }
+
+    g_hash_table_destroy(__loads);
+    g_queue_free(__lru);
+    g_hash_table_destroy(__entries);
+    g_object_unref(__default_image);
+    g_object_unref(__default_icon);
+    __loads = NULL;
+    __entries = NULL;
+    __lru = NULL;
+    __default_image = NULL;
+    __default_icon = NULL;
+}
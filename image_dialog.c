@@ -6,122 +6,169 @@
 #include <stdlib.h>
 #include <string.h>
 #include <libintl.h>
-#include <sys/stat.h>
-#include <sys/wait.h>
-#include <unistd.h>
 
 #include "gtkollection.h"
 #include "cover_image.xpm"
 
-struct plugin_st {
-    int                 n_images;
+/* buttons of the web images in each row of web_cover_dlg() */
+#define IMAGES_PER_ROW              4
+
+/* The page of web images shown by web_cover_dlg() */
+struct web_search {
+    GtkWidget           *dialog;
+    GtkWidget           **bt_img;
+    GtkWidget           *label;
+    struct image_search *search;
+    const char          *query;
+    int                 start;
+    int                 page_size;
+    GBytes              **images;       /* still encoded, by button */
     unsigned long long  total;
 };
 
-static char *create_new_filename(void)
+static void s_bt_img_clicked(GtkButton *bt, struct web_search *ws)
 {
-    char path[256]={0}, *name;
+    int id;
 
-    name = strrand(13);
-    snprintf(path, sizeof(path), "%s/%s", UNSAVED_IMG_TMP_DIR, name);
-    free(name);
+    id = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(bt), "bt-id"));
 
-    return strdup(path);
+    if (ws->images[id] != NULL)
+        g_signal_emit_by_name(ws->dialog, "response", id);
 }
 
-static int run_web_image_plugin(struct plugin_st *p_st, const char *query, int start)
+static void dlg_set_bt_img(struct web_search *ws, int i, GdkPixbuf *pixbuf)
 {
-    char ret[64]={0}, tmp[32]={0};
-    int fd[2], c_status;
-    pid_t pid;
-    const char *args[] = {
-        "/usr/share/gtkollection/pl_images", "/usr/share/gtkollection/pl_images",
-        "-q", "-s", NULL
-    };
-
-    if (pipe(fd) == -1) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"),
-                    gettext("Error starting environment to run the image plugin."));
+    GtkWidget *image;
 
-        return 0;
-    }
+    image = gtk_image_new_from_pixbuf(pixbuf);
+    gtk_button_set_label(GTK_BUTTON(ws->bt_img[i]), "");
+    gtk_button_set_image(GTK_BUTTON(ws->bt_img[i]), image);
+    gtk_widget_set_sensitive(ws->bt_img[i], (ws->images[i] != NULL));
+}
 
-    snprintf(tmp, sizeof(tmp), "%d", start);
-    pid = fork();
+/* Shows the default cover on every button, until the new images are found */
+static void dlg_clear_bt_img(struct web_search *ws)
+{
+    GdkPixbuf *pixbuf;
+    int i;
 
-    if (pid < 0) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"),
-                    gettext("Error resizing image to temporary file."));
+    pixbuf = gdk_pixbuf_new_from_xpm_data(__default_cover_image);
 
-        return 0;
-    } else if (pid == 0) {
-        dup2(fd[1], 1);
-        execl(IMAGE_PLUGIN, IMAGE_PLUGIN, args[2], query, args[3], tmp,
-              (char *)NULL);
+    for (i = 0; i < ws->page_size; i++) {
+        if (ws->images[i] != NULL) {
+            g_bytes_unref(ws->images[i]);
+            ws->images[i] = NULL;
+        }
 
-        close(fd[0]);
-        _exit(0);
+        dlg_set_bt_img(ws, i, pixbuf);
     }
 
-    close(fd[1]);
-    read(fd[0], ret, sizeof(ret) - 1);
-    close(fd[0]);
-    waitpid(pid, &c_status, WUNTRACED);
-    sscanf(ret, "%d,%llu", &p_st->n_images, &p_st->total);
+    g_object_unref(pixbuf);
+}
 
-    if (p_st->n_images < 0) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"),
-                    gettext("No network connection. Check your network settings!"));
+static void image_found(int index, GBytes *bytes, GdkPixbuf *pixbuf,
+    gpointer data)
+{
+    struct web_search *ws = (struct web_search *)data;
 
-        return 0;
-    }
+    if (index >= ws->page_size)
+        return;
 
-    return 1;
+    ws->images[index] = g_bytes_ref(bytes);
+    dlg_set_bt_img(ws, index, pixbuf);
 }
 
-static void s_bt_img_clicked(GtkButton *bt, GtkDialog *dialog)
+static void search_done(GPtrArray *images, unsigned long long total,
+    const char *error, gpointer data)
 {
-    int id;
-    char filename[128]={0};
+    struct web_search *ws = (struct web_search *)data;
+    char *text;
 
-    id = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(bt), "bt-id"));
-    snprintf(filename, sizeof(filename), "%s/image_%d.jpg", WEB_IMG_TMP_DIR, id);
+    ws->search = NULL;
+
+    if (error != NULL) {
+        gtk_label_set_text(GTK_LABEL(ws->label), error);
+        return;
+    }
+
+    ws->total = total;
 
-    if (!access(filename, 0x00))
-        g_signal_emit_by_name(dialog, "response", id);
+    /* while this page is looked at, so Next shows the following one at once */
+    if (total > (unsigned long long)(ws->start + ws->page_size)) {
+        gtk_dialog_set_response_sensitive(GTK_DIALOG(ws->dialog),
+                                          GTK_RESPONSE_NONE, TRUE);
+
+        image_search_prefetch(ws->query, ws->start + ws->page_size);
+    }
+
+    if (images->len == 0)
+        gtk_label_set_text(GTK_LABEL(ws->label), gettext("No images found."));
+    else {
+        text = g_strdup_printf(gettext("About %llu images found."), total);
+        gtk_label_set_text(GTK_LABEL(ws->label), text);
+        g_free(text);
+    }
 }
 
-static void dlg_set_bt_img(GtkWidget **bt_img)
+/*
+ * Replaces the search being made, if any, with the page at @start. Next is
+ * only enabled once the search tells whether there are more pages.
+ */
+static void start_search(struct web_search *ws, const char *query, int start)
 {
-    GtkWidget *image;
-    GdkPixbuf *pixbuf;
-    int i;
-    char filename[128];
-
-    for (i = 0; (i < 4); i++) {
-        memset(filename, 0, sizeof(filename));
-        snprintf(filename, sizeof(filename), "%s/image_%d.jpg", WEB_IMG_TMP_DIR, i);
-
-        if (!access(filename, 0x00)) {
-            image = gtk_image_new_from_file(filename);
-            pixbuf = gtk_image_get_pixbuf(GTK_IMAGE(image));
-        } else {
-            image = gtk_image_new();
-            pixbuf = gdk_pixbuf_new_from_xpm_data(__default_cover_image);
-        }
+    if (ws->search != NULL)
+        image_search_cancel(ws->search);
+
+    dlg_clear_bt_img(ws);
+    gtk_dialog_set_response_sensitive(GTK_DIALOG(ws->dialog), GTK_RESPONSE_NONE,
+                                      FALSE);
+
+    ws->query = query;
+    ws->start = start;
+    ws->search = image_search_start(query, start, image_found, search_done, ws);
+
+    if (ws->search == NULL)
+        gtk_label_set_text(GTK_LABEL(ws->label),
+                           gettext("The image provider can't be used. Check "
+                                   "your installation!"));
+    else
+        gtk_label_set_text(GTK_LABEL(ws->label), gettext("Searching..."));
+}
+
+/* Saves the chosen image @b as a thumbnail, like resize_image() */
+static char *save_web_image(GBytes *b)
+{
+    char *filename;
+    GError *error=NULL;
+    gconstpointer data;
+    gsize size;
+
+    filename = create_unsaved_image_filename();
+    data = g_bytes_get_data(b, &size);
+
+    if (!image_create_thumbnail_from_data(data, size, filename, &error)) {
+        display_msg(GTK_MESSAGE_ERROR, gettext("Error"),
+                    gettext("Error resizing image to temporary file: %s"),
+                    (error != NULL) ? error->message
+                                    : gettext("unknown image format"));
+
+        if (error != NULL)
+            g_error_free(error);
+
+        free(filename);
 
-        gtk_image_set_from_pixbuf(GTK_IMAGE(image), pixbuf);
-        gtk_button_set_label(GTK_BUTTON(bt_img[i]), "");
-        gtk_button_set_image(GTK_BUTTON(bt_img[i]), image);
+        return NULL;
     }
+
+    return filename;
 }
 
 static char *web_cover_dlg(const char *query)
 {
-    GtkWidget *dialog, *dlg_box, *hbox, **bt_img;
-    char *filename=NULL, bt_image_name[128]={0};
-    int i, loop=1, result, start=0;
-    struct plugin_st p_st;
+    GtkWidget *dialog, *dlg_box, *table, **bt_img;
+    char *filename=NULL;
+    int i, loop=1, result, start=0, rows;
+    struct web_search ws;
 
     dialog = gtk_dialog_new_with_buttons(gettext("Select an image"),
                                          GTK_WINDOW(ui_get_mainwindow()),
@@ -131,32 +178,44 @@ static char *web_cover_dlg(const char *query)
                                          GTK_STOCK_CANCEL, GTK_RESPONSE_ACCEPT,
                                          NULL);
 
-    gtk_widget_set_size_request(dialog, 660, 230);
+    memset(&ws, 0, sizeof(struct web_search));
+    ws.dialog = dialog;
+    ws.page_size = image_search_page_size();
+    rows = (ws.page_size + IMAGES_PER_ROW - 1) / IMAGES_PER_ROW;
+
+    gtk_widget_set_size_request(dialog, 660, 80 + rows * 170);
     dlg_box = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
-    hbox = gtk_hbox_new(FALSE, 5);
+    table = gtk_table_new(rows, IMAGES_PER_ROW, TRUE);
+    gtk_table_set_row_spacings(GTK_TABLE(table), 5);
+    gtk_table_set_col_spacings(GTK_TABLE(table), 5);
 
     /* create buttons */
-    bt_img = malloc(sizeof(GtkWidget *) * 4);
+    bt_img = malloc(sizeof(GtkWidget *) * ws.page_size);
+    ws.bt_img = bt_img;
+    ws.images = calloc(ws.page_size, sizeof(GBytes *));
 
-    for (i = 0; i < 4; i++) {
+    for (i = 0; i < ws.page_size; i++) {
         bt_img[i] = gtk_button_new_with_label("Image");
         g_object_set_data(G_OBJECT(bt_img[i]), "bt-id", GINT_TO_POINTER(i));
-        g_signal_connect(bt_img[i], "clicked", G_CALLBACK(s_bt_img_clicked), dialog);
+        g_signal_connect(bt_img[i], "clicked", G_CALLBACK(s_bt_img_clicked), &ws);
 
-        gtk_box_pack_start(GTK_BOX(hbox), bt_img[i], TRUE, TRUE, 0);
+        gtk_table_attach_defaults(GTK_TABLE(table), bt_img[i],
+                                  i % IMAGES_PER_ROW, i % IMAGES_PER_ROW + 1,
+                                  i / IMAGES_PER_ROW, i / IMAGES_PER_ROW + 1);
     }
 
+    ws.label = gtk_label_new(NULL);
+
     /* run dialog */
-    gtk_container_add(GTK_CONTAINER(dlg_box), hbox);
+    gtk_container_add(GTK_CONTAINER(dlg_box), table);
+    gtk_box_pack_start(GTK_BOX(dlg_box), ws.label, FALSE, FALSE, 0);
     gtk_widget_show_all(dialog);
     ui_prepend_mainwindow(dialog);
 
-    do {
-        if (!run_web_image_plugin(&p_st, query, start))
-            break;
-        else
-            dlg_set_bt_img(bt_img);
+    /* results are shown while the dialog runs */
+    start_search(&ws, query, start);
 
+    do {
         result = gtk_dialog_run(GTK_DIALOG(dialog));
 
         switch (result) {
@@ -165,19 +224,17 @@ static char *web_cover_dlg(const char *query)
                 break;
 
             case GTK_RESPONSE_REJECT: /* prev */
-                if ((start - 4) < 0)
+                if ((start - ws.page_size) < 0)
                     start = 0;
                 else
-                    start -= 4;
+                    start -= ws.page_size;
 
+                start_search(&ws, query, start);
                 break;
 
             case GTK_RESPONSE_NONE: /* next */
-                if (p_st.total > (unsigned long long)(start + 4))
-                    start += 4;
-                else
-                    start = p_st.total;
-
+                start += ws.page_size;
+                start_search(&ws, query, start);
                 break;
 
             case GTK_RESPONSE_DELETE_EVENT:
@@ -185,15 +242,20 @@ static char *web_cover_dlg(const char *query)
                 break;
 
             default:
-                snprintf(bt_image_name, sizeof(bt_image_name),
-                         "%s/image_%d.jpg", WEB_IMG_TMP_DIR, result);
-
-                filename = strdup(bt_image_name);
+                filename = save_web_image(ws.images[result]);
                 loop = 0;
                 break;
         }
     } while (loop);
 
+    if (ws.search != NULL)
+        image_search_cancel(ws.search);
+
+    for (i = 0; i < ws.page_size; i++)
+        if (ws.images[i] != NULL)
+            g_bytes_unref(ws.images[i]);
+
+    free(ws.images);
     ui_remove_mainwindow(dialog);
     gtk_widget_destroy(dialog);
     free(bt_img);
@@ -201,7 +263,8 @@ static char *web_cover_dlg(const char *query)
     return filename;
 }
 
-static GString *create_label_text(struct db_collection *c)
+/* Tells which $name and $N variables a web query may use */
+GString *create_web_query_label(struct db_collection *c)
 {
     GString *s=NULL;
     struct db_field *f;
@@ -226,8 +289,12 @@ static GString *create_label_text(struct db_collection *c)
     return s;
 }
 
-static char *parse_text_entry(const char *text, struct db_collection *c,
-    struct dlg_line *line)
+/*
+ * Gives the web query @text with its variables replaced by the name of @c
+ * and the values @cells of one of its entries.
+ */
+char *parse_web_query(const char *text, struct db_collection *c,
+    const char **cells)
 {
     GString *s;
     char *r=NULL, token[4];
@@ -242,8 +309,7 @@ static char *parse_text_entry(const char *text, struct db_collection *c,
         snprintf(token, sizeof(token), "$%d", i + 1);
 
         if (strstr(s->str, token) != NULL) {
-            g_string_replace(s, token,
-                             (const char *)g_list_nth_data(line->column, i));
+            g_string_replace(s, token, cells[i]);
         }
     }
 
@@ -274,7 +340,7 @@ static char *web_query_dlg(struct db_collection *c, struct dlg_line *line)
     dlg_box = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
 
     vbox = gtk_vbox_new(FALSE, 3);
-    text = create_label_text(c);
+    text = create_web_query_label(c);
     label = gtk_label_new(text->str);
     t_entry = gtk_entry_new();
 
@@ -292,7 +358,7 @@ static char *web_query_dlg(struct db_collection *c, struct dlg_line *line)
 
         if (result == GTK_RESPONSE_ACCEPT) {
             entry_text = gtk_entry_get_text(GTK_ENTRY(t_entry));
-            query = parse_text_entry(entry_text, c, line);
+            query = parse_web_query(entry_text, c, line->cells);
 
             if (query != NULL)
                 loop = 0;
@@ -307,26 +373,35 @@ static char *web_query_dlg(struct db_collection *c, struct dlg_line *line)
     return query;
 }
 
-static void move_image_to_tmp_dir(const char *old, const char *new)
+static char *resize_image(const char *filename)
 {
-    mode_t mode;
+    char *resized_filename;
+    GError *error=NULL;
 
-    mode = S_IWUSR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+    resized_filename = create_unsaved_image_filename();
 
-    if (access(UNSAVED_IMG_TMP_DIR, 0x00) == -1)
-        mkdir(UNSAVED_IMG_TMP_DIR, mode);
+    if (!image_create_thumbnail(filename, resized_filename, &error)) {
+        display_msg(GTK_MESSAGE_ERROR, gettext("Error"),
+                    gettext("Error resizing image to temporary file: %s"),
+                    error->message);
+
+        g_error_free(error);
+        free(resized_filename);
+
+        return NULL;
+    }
 
-    rename_file(old, new);
+    return resized_filename;
 }
 
 static char *get_cover_image_from_web(struct db_collection *c,
     struct dlg_line *line)
 {
-    char *query=NULL, *filename=NULL, *s;
+    char *query=NULL, *filename;
 
-    if (access(IMAGE_PLUGIN, 0x00) == -1) {
+    if (!image_plugin_load()) {
         display_msg(GTK_MESSAGE_ERROR, gettext("Error"),
-                    gettext("Image plugin not found. Check your installation!"));
+                    gettext("Image provider not found. Check your installation!"));
 
         return NULL;
     }
@@ -337,44 +412,9 @@ static char *get_cover_image_from_web(struct db_collection *c,
         return NULL;
 
     filename = web_cover_dlg(query);
+    free(query);
 
-    if (filename != NULL) {
-        s = create_new_filename();
-        move_image_to_tmp_dir(filename, s);
-        g_free(filename);
-
-        return s;
-    }
-
-    return NULL;
-}
-
-static char *resize_image(const char *filename)
-{
-    char *resized_filename;
-    pid_t pid;
-    int c_status;
-    const char *args[] = {
-        "/usr/bin/convert", "convert", "-resize", "150x150", NULL
-    };
-
-    resized_filename = create_new_filename();
-    pid = fork();
-
-    if (pid < 0) {
-        display_msg(GTK_MESSAGE_ERROR, gettext("Error"),
-                    gettext("Error resizing image to temporary file."));
-
-        return NULL;
-    } else if (pid == 0) {
-        execl(args[0], args[1], args[2], args[3], filename, resized_filename,
-              (char *)NULL);
-
-        _exit(0);
-    } else
-        waitpid(pid, &c_status, WUNTRACED);
-
-    return resized_filename;
+    return filename;
 }
 
 static char *get_cover_image_local(void)
@@ -410,12 +450,12 @@ static char *get_cover_image_local(void)
     return filename;
 }
 
-static int has_data_to_search(struct dlg_line *line)
+static int has_data_to_search(struct db_collection *c, struct dlg_line *line)
 {
-    GList *l;
+    int i;
 
-    for (l = g_list_first(line->column); l; l = l->next)
-        if (!strlen((const char *)l->data))
+    for (i = 0; i < c->active_fields; i++)
+        if (!strlen(line->cells[i]))
             return 0;
 
     return 1;
@@ -455,7 +495,7 @@ char *get_cover_image_file(struct db_collection *c, struct dlg_line *line)
         if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(rd_local)))
             filename = get_cover_image_local();
         else {
-            if (!has_data_to_search(line)) {
+            if (!has_data_to_search(c, line)) {
                 display_msg(GTK_MESSAGE_WARNING, gettext("Attention"),
                             gettext("All fields must be filled to use the web for "
                                     "this search"));
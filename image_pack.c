@@ -0,0 +1,612 @@
+
+/*
+ * Description: cover images packed into a single file.
+ *
+ * Images are appended to IMAGE_PACK_FILE and found through IMAGE_PACK_INDEX,
+ * a list of records with the offset and size of each one. Removing an image
+ * only appends a record saying so, the space is given back by compacting the
+ * pack on the database worker once enough of it is unused. Both files are
+ * mapped into memory and images are decoded straight from the mapping.
+ *
+ * Images are added, removed and compacted from the database worker only, and
+ * may be read from any thread.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "gtkollection.h"
+
+#define IMAGE_PACK_FILE             "images.pack"
+#define IMAGE_PACK_INDEX            "images.idx"
+#define IMAGE_PACK_MAGIC            "GTKPACK1"
+
+/* compacted once this much is unused, and more than half of the pack */
+#define IMAGE_PACK_COMPACT_MIN      (4 * 1024 * 1024)
+
+/* the mapping is reserved in steps this large, past the end of the pack */
+#define IMAGE_PACK_MAP_STEP         (64 * 1024 * 1024)
+
+/*
+ * Both files start with the same header. A compacted pack gets a new stamp,
+ * so a pack and an index that don't belong together are told apart.
+ */
+struct pack_header {
+    char        magic[8];
+    guint64     stamp;
+};
+
+/* Index record, a removed image has size 0 */
+struct pack_record {
+    char        digest[IMAGE_DIGEST_LENGTH];
+    guint32     size;
+    guint32     reserved;
+    guint64     offset;
+};
+
+struct pack_entry {
+    guint64     offset;
+    guint32     size;
+};
+
+struct image_pack {
+    int         fd;
+    int         index_fd;
+    guint64     size;
+    guint64     index_size;
+    guint64     unused;         /* bytes of removed images */
+    guint64     stamp;
+    guint8      *map;
+    size_t      map_size;
+    GHashTable  *entries;       /* by digest */
+    GRWLock     lock;           /* entries and map, changed by the worker */
+    int         compacting;
+};
+
+static struct image_pack *__pack = NULL;
+
+static char *pack_filename(const char *name, const char *suffix)
+{
+    char path[512]={0};
+
+    snprintf(path, sizeof(path), "%s/%s/%s/%s%s", getenv("HOME"), APP_CONFIG_PATH,
+             IMAGE_STORE_DIR, name, suffix);
+
+    return strdup(path);
+}
+
+static int write_at(int fd, const void *data, size_t size, guint64 offset)
+{
+    const guint8 *p = data;
+    ssize_t n;
+
+    while (size > 0) {
+        n = pwrite(fd, p, size, offset);
+
+        if (n <= 0)
+            return 0;
+
+        p += n;
+        size -= n;
+        offset += n;
+    }
+
+    return 1;
+}
+
+static int read_header(int fd, guint64 *stamp)
+{
+    struct pack_header h;
+
+    if ((pread(fd, &h, sizeof(h), 0) != sizeof(h)) ||
+        memcmp(h.magic, IMAGE_PACK_MAGIC, sizeof(h.magic)))
+    {
+        return 0;
+    }
+
+    *stamp = h.stamp;
+
+    return 1;
+}
+
+static int write_header(int fd, guint64 stamp)
+{
+    struct pack_header h;
+
+    memcpy(h.magic, IMAGE_PACK_MAGIC, sizeof(h.magic));
+    h.stamp = stamp;
+
+    return write_at(fd, &h, sizeof(h), 0);
+}
+
+static guint64 new_stamp(void)
+{
+    return ((guint64)g_random_int() << 32) | g_random_int();
+}
+
+/*
+ * Maps the pack again, with room for it to grow up to the next
+ * IMAGE_PACK_MAP_STEP, so images that are added are usually already in the
+ * mapping. Only the part up to the end of the pack may be read. Called with
+ * the lock held.
+ */
+static void map_pack(void)
+{
+    size_t length;
+    void *map;
+
+    if (__pack->map != NULL)
+        munmap(__pack->map, __pack->map_size);
+
+    __pack->map = NULL;
+    __pack->map_size = 0;
+    length = (__pack->size / IMAGE_PACK_MAP_STEP + 1) * IMAGE_PACK_MAP_STEP;
+    map = mmap(NULL, length, PROT_READ, MAP_SHARED, __pack->fd, 0);
+
+    if (map == MAP_FAILED)
+        return;
+
+    __pack->map = map;
+    __pack->map_size = length;
+}
+
+static void index_record(const struct pack_record *r)
+{
+    char digest[IMAGE_DIGEST_LENGTH + 1];
+    struct pack_entry *e;
+
+    memcpy(digest, r->digest, IMAGE_DIGEST_LENGTH);
+    digest[IMAGE_DIGEST_LENGTH] = 0;
+    e = g_hash_table_lookup(__pack->entries, digest);
+
+    if (e != NULL) {
+        __pack->unused += e->size;
+        g_hash_table_remove(__pack->entries, digest);
+    }
+
+    /* images cut short by a crash are left out */
+    if ((r->size == 0) || (r->offset + r->size > __pack->size))
+        return;
+
+    e = malloc(sizeof(struct pack_entry));
+
+    if (!e)
+        return;
+
+    e->offset = r->offset;
+    e->size = r->size;
+    g_hash_table_insert(__pack->entries, g_strdup(digest), e);
+}
+
+static void load_index(void)
+{
+    struct pack_record *records;
+    void *map;
+    size_t i, n;
+
+    if (__pack->index_size <= sizeof(struct pack_header))
+        return;
+
+    map = mmap(NULL, __pack->index_size, PROT_READ, MAP_SHARED, __pack->index_fd,
+               0);
+
+    if (map == MAP_FAILED)
+        return;
+
+    /* a record cut short by a crash is ignored */
+    records = (struct pack_record *)((guint8 *)map + sizeof(struct pack_header));
+    n = (__pack->index_size - sizeof(struct pack_header)) / sizeof(struct pack_record);
+
+    for (i = 0; i < n; i++)
+        index_record(&records[i]);
+
+    munmap(map, __pack->index_size);
+    __pack->index_size = sizeof(struct pack_header) + n * sizeof(struct pack_record);
+}
+
+/*
+ * A compaction interrupted after the new index took the place of the old
+ * one is finished here, one interrupted before is thrown away.
+ */
+static void recover_compaction(void)
+{
+    char *pack, *new_pack, *index, *new_index;
+    guint64 index_stamp, pack_stamp;
+    int fd, index_fd, done=0;
+
+    pack = pack_filename(IMAGE_PACK_FILE, "");
+    new_pack = pack_filename(IMAGE_PACK_FILE, ".new");
+    index = pack_filename(IMAGE_PACK_INDEX, "");
+    new_index = pack_filename(IMAGE_PACK_INDEX, ".new");
+    fd = open(new_pack, O_RDONLY);
+
+    if (fd != -1) {
+        index_fd = open(index, O_RDONLY);
+
+        if ((index_fd != -1) && read_header(index_fd, &index_stamp) &&
+            read_header(fd, &pack_stamp) && (index_stamp == pack_stamp))
+        {
+            done = (rename(new_pack, pack) == 0);
+        }
+
+        if (index_fd != -1)
+            close(index_fd);
+
+        close(fd);
+
+        if (!done)
+            unlink(new_pack);
+    }
+
+    unlink(new_index);
+    free(new_index);
+    free(index);
+    free(new_pack);
+    free(pack);
+}
+
+/* Tells whether @fd holds nothing more than a header, so nothing is lost */
+static int is_empty(int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) == -1)
+        return 0;
+
+    return st.st_size <= (off_t)sizeof(struct pack_header);
+}
+
+static int open_files(void)
+{
+    char *pack, *index;
+    struct stat st;
+    guint64 index_stamp;
+    int ret=0;
+
+    pack = pack_filename(IMAGE_PACK_FILE, "");
+    index = pack_filename(IMAGE_PACK_INDEX, "");
+    __pack->fd = open(pack, O_RDWR | O_CREAT, 0644);
+    __pack->index_fd = open(index, O_RDWR | O_CREAT, 0644);
+
+    if ((__pack->fd == -1) || (__pack->index_fd == -1))
+        goto end_block;
+
+    if (!read_header(__pack->fd, &__pack->stamp) ||
+        !read_header(__pack->index_fd, &index_stamp) ||
+        (__pack->stamp != index_stamp))
+    {
+        /*
+         * A pack and an index that don't belong together are left as they
+         * are, the images can't be found without the right index.
+         */
+        if (!is_empty(__pack->fd) || !is_empty(__pack->index_fd)) {
+            fprintf(stderr, "Error: %s and %s don't belong together\n", pack,
+                    index);
+
+            goto end_block;
+        }
+
+        __pack->stamp = new_stamp();
+
+        if ((ftruncate(__pack->fd, 0) == -1) || (ftruncate(__pack->index_fd, 0) == -1) ||
+            !write_header(__pack->fd, __pack->stamp) ||
+            !write_header(__pack->index_fd, __pack->stamp))
+        {
+            goto end_block;
+        }
+    }
+
+    if (fstat(__pack->fd, &st) == -1)
+        goto end_block;
+
+    __pack->size = st.st_size;
+
+    if (fstat(__pack->index_fd, &st) == -1)
+        goto end_block;
+
+    __pack->index_size = st.st_size;
+    ret = 1;
+
+end_block:
+    free(index);
+    free(pack);
+
+    return ret;
+}
+
+/*
+ * Opens the pack, creating it if it doesn't exist yet. Images that are packed
+ * can't be shown without it.
+ */
+int image_pack_open(void)
+{
+    char *dir;
+
+    dir = pack_filename("", "");
+    g_mkdir_with_parents(dir, 0755);
+    free(dir);
+
+    __pack = calloc(1, sizeof(struct image_pack));
+
+    if (!__pack)
+        return 0;
+
+    __pack->fd = -1;
+    __pack->index_fd = -1;
+    g_rw_lock_init(&__pack->lock);
+    __pack->entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free);
+    recover_compaction();
+
+    if (!open_files()) {
+        image_pack_close();
+        return 0;
+    }
+
+    load_index();
+    map_pack();
+
+    return 1;
+}
+
+void image_pack_close(void)
+{
+    if (__pack == NULL)
+        return;
+
+    if (__pack->map != NULL)
+        munmap(__pack->map, __pack->map_size);
+
+    if (__pack->fd != -1)
+        close(__pack->fd);
+
+    if (__pack->index_fd != -1)
+        close(__pack->index_fd);
+
+    g_hash_table_destroy(__pack->entries);
+    g_rw_lock_clear(&__pack->lock);
+    free(__pack);
+    __pack = NULL;
+}
+
+static int append_record(const char *digest, guint32 size, guint64 offset)
+{
+    struct pack_record r;
+
+    memset(&r, 0, sizeof(struct pack_record));
+    memcpy(r.digest, digest, IMAGE_DIGEST_LENGTH);
+    r.size = size;
+    r.offset = offset;
+
+    if (!write_at(__pack->index_fd, &r, sizeof(r), __pack->index_size))
+        return 0;
+
+    __pack->index_size += sizeof(r);
+
+    return 1;
+}
+
+/*
+ * Writes the pack again with the images still used, to new files that take
+ * the place of the current ones. The index goes first, see
+ * recover_compaction().
+ */
+static int compact_pack(gpointer data __attribute__((unused)))
+{
+    struct image_pack new_pack;
+    struct pack_entry *e, *new_e;
+    struct pack_record r;
+    GHashTableIter iter;
+    gpointer key, value;
+    char *pack, *new_pack_filename, *index, *new_index;
+    int ret=0;
+
+    pack = pack_filename(IMAGE_PACK_FILE, "");
+    new_pack_filename = pack_filename(IMAGE_PACK_FILE, ".new");
+    index = pack_filename(IMAGE_PACK_INDEX, "");
+    new_index = pack_filename(IMAGE_PACK_INDEX, ".new");
+
+    memset(&new_pack, 0, sizeof(struct image_pack));
+    new_pack.stamp = new_stamp();
+    new_pack.size = sizeof(struct pack_header);
+    new_pack.index_size = sizeof(struct pack_header);
+    new_pack.entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free);
+    new_pack.fd = open(new_pack_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    new_pack.index_fd = open(new_index, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if ((__pack->map == NULL) || (new_pack.fd == -1) || (new_pack.index_fd == -1) ||
+        !write_header(new_pack.fd, new_pack.stamp) ||
+        !write_header(new_pack.index_fd, new_pack.stamp))
+    {
+        goto end_block;
+    }
+
+    /* the map only changes on this thread, it's read without the lock */
+    g_hash_table_iter_init(&iter, __pack->entries);
+
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        e = (struct pack_entry *)value;
+        memset(&r, 0, sizeof(struct pack_record));
+        memcpy(r.digest, key, IMAGE_DIGEST_LENGTH);
+        r.size = e->size;
+        r.offset = new_pack.size;
+
+        if (!write_at(new_pack.fd, __pack->map + e->offset, e->size, r.offset) ||
+            !write_at(new_pack.index_fd, &r, sizeof(r), new_pack.index_size))
+        {
+            goto end_block;
+        }
+
+        new_e = malloc(sizeof(struct pack_entry));
+
+        if (!new_e)
+            goto end_block;
+
+        new_e->offset = r.offset;
+        new_e->size = r.size;
+        g_hash_table_insert(new_pack.entries, g_strdup(key), new_e);
+        new_pack.size += r.size;
+        new_pack.index_size += sizeof(r);
+    }
+
+    if ((fsync(new_pack.fd) == -1) || (fsync(new_pack.index_fd) == -1) ||
+        (rename(new_index, index) == -1))
+    {
+        goto end_block;
+    }
+
+    /* the index is already the new one, recover_compaction() finishes it */
+    rename(new_pack_filename, pack);
+
+    g_rw_lock_writer_lock(&__pack->lock);
+    close(__pack->fd);
+    close(__pack->index_fd);
+    g_hash_table_destroy(__pack->entries);
+    __pack->fd = new_pack.fd;
+    __pack->index_fd = new_pack.index_fd;
+    __pack->size = new_pack.size;
+    __pack->index_size = new_pack.index_size;
+    __pack->stamp = new_pack.stamp;
+    __pack->entries = new_pack.entries;
+    __pack->unused = 0;
+    map_pack();
+    g_rw_lock_writer_unlock(&__pack->lock);
+
+    new_pack.entries = NULL;
+    new_pack.fd = -1;
+    new_pack.index_fd = -1;
+    ret = 1;
+
+end_block:
+    if (new_pack.fd != -1)
+        close(new_pack.fd);
+
+    if (new_pack.index_fd != -1)
+        close(new_pack.index_fd);
+
+    if (new_pack.entries != NULL) {
+        g_hash_table_destroy(new_pack.entries);
+        unlink(new_pack_filename);
+        unlink(new_index);
+    }
+
+    __pack->compacting = 0;
+    free(new_index);
+    free(index);
+    free(new_pack_filename);
+    free(pack);
+
+    return ret;
+}
+
+/*
+ * Adds the contents of @filename to the pack as the image @digest, unless
+ * the pack already has it.
+ */
+int image_pack_add(const char *digest, const char *filename)
+{
+    struct pack_entry *e;
+    gchar *data;
+    gsize size;
+    int ret=0;
+
+    if ((__pack == NULL) || (strlen(digest) != IMAGE_DIGEST_LENGTH))
+        return 0;
+
+    if (g_hash_table_lookup(__pack->entries, digest) != NULL)
+        return 1;
+
+    if (!g_file_get_contents(filename, &data, &size, NULL))
+        return 0;
+
+    e = malloc(sizeof(struct pack_entry));
+
+    if (!e)
+        goto end_block;
+
+    e->offset = __pack->size;
+    e->size = size;
+
+    /* the image first, so a record never points past the pack */
+    if ((size == 0) || !write_at(__pack->fd, data, size, e->offset) ||
+        !append_record(digest, e->size, e->offset))
+    {
+        free(e);
+        goto end_block;
+    }
+
+    g_rw_lock_writer_lock(&__pack->lock);
+    g_hash_table_insert(__pack->entries, g_strdup(digest), e);
+    __pack->size += size;
+
+    if (__pack->size > __pack->map_size)
+        map_pack();
+
+    g_rw_lock_writer_unlock(&__pack->lock);
+    ret = 1;
+
+end_block:
+    g_free(data);
+
+    return ret;
+}
+
+/*
+ * Removes the image @digest from the pack. Its space is only given back when
+ * the pack is compacted, in the background.
+ */
+void image_pack_remove(const char *digest)
+{
+    struct pack_entry *e;
+
+    if (__pack == NULL)
+        return;
+
+    e = g_hash_table_lookup(__pack->entries, digest);
+
+    if ((e == NULL) || !append_record(digest, 0, 0))
+        return;
+
+    __pack->unused += e->size;
+    g_rw_lock_writer_lock(&__pack->lock);
+    g_hash_table_remove(__pack->entries, digest);
+    g_rw_lock_writer_unlock(&__pack->lock);
+
+    if (!__pack->compacting && (__pack->unused >= IMAGE_PACK_COMPACT_MIN) &&
+        (__pack->unused * 2 > __pack->size))
+    {
+        __pack->compacting = 1;
+
+        if (db_job_submit_background(compact_pack, NULL, NULL, NULL) == NULL)
+            __pack->compacting = 0;
+    }
+}
+
+/*
+ * Gives the image @digest scaled to @size, or as it was stored if @size is 0,
+ * decoded from the mapped pack without reading it first. NULL if it isn't
+ * packed.
+ */
+GdkPixbuf *image_pack_load(const char *digest, int size)
+{
+    GdkPixbuf *pixbuf=NULL;
+    struct pack_entry *e;
+
+    if (__pack == NULL)
+        return NULL;
+
+    g_rw_lock_reader_lock(&__pack->lock);
+    e = g_hash_table_lookup(__pack->entries, digest);
+
+    /* the mapping goes past the end of the pack */
+    if ((e != NULL) && (e->offset + e->size <= MIN(__pack->size, __pack->map_size)))
+        pixbuf = image_decode(__pack->map + e->offset, e->size, size, FALSE, NULL);
+
+    g_rw_lock_reader_unlock(&__pack->lock);
+
+    return pixbuf;
+}
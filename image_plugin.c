@@ -0,0 +1,509 @@
+
+/*
+ * Description: web image searches, through an image provider plugin.
+ *
+ * The provider is a shared library loaded from IMAGE_PROVIDER_DIR, chosen
+ * by the name setting of the [image_provider] group. Its searches are made
+ * by a thread of their own, one at a time. Each image is decoded by a pool
+ * of threads as soon as the provider hands it over, and delivered from the
+ * main loop, so it can be shown before the others are found. The search
+ * itself ends once all of them are delivered. See image_provider.h.
+ *
+ * Pages found are kept by web_cache.c. A page that is cached is delivered
+ * without waiting for the thread, and pages that will likely be asked next
+ * may be searched beforehand, after the ones asked for.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <libintl.h>
+#include <gmodule.h>
+
+#include "gtkollection.h"
+#include "image_provider.h"
+
+#define IMAGE_PROVIDER_GROUP        "image_provider"
+
+/* images asked from the provider at a time, unless page_size is set */
+#define IMAGE_SEARCH_COUNT          4
+#define IMAGE_SEARCH_COUNT_MAX      16
+
+#define IMAGE_DECODERS_MAX          4
+
+/* order searches wait in, see compare_searches() */
+#define SEARCH_ASKED                0
+#define SEARCH_PREFETCH             1
+#define SEARCH_BACKGROUND           2
+
+struct image_plugin {
+    GModule                         *module;
+    const struct image_provider     *provider;
+    void                            *state;
+    GThreadPool                     *searches;
+    GThreadPool                     *decoders;
+    int                             page_size;
+    gint                            stopped;
+};
+
+struct image_search {
+    struct image_plugin *plugin;
+    char                *query;
+    int                 start;
+    int                 count;
+    int                 priority;
+    guint               serial;
+    GPtrArray           *images;        /* GBytes */
+    unsigned long long  total;
+    char                *error;
+    gint                cancelled;
+    gint                decoding;       /* images not delivered yet */
+    int                 searched;       /* waits for them to end */
+    image_found_func    found;
+    image_search_func   func;
+    gpointer            data;
+};
+
+/* An image found, being decoded */
+struct found_image {
+    struct image_search *search;
+    int                 index;
+    GBytes              *bytes;
+    GdkPixbuf           *pixbuf;
+};
+
+static struct image_plugin *__plugin = NULL;
+static guint __search_serial = 0;
+
+static int is_cancelled(struct image_search *search)
+{
+    return g_atomic_int_get(&search->cancelled) ||
+           g_atomic_int_get(&search->plugin->stopped);
+}
+
+static int host_get_setting(const char *key, char *value, size_t size)
+{
+    char *s;
+
+    s = get_config_setting(IMAGE_PROVIDER_GROUP, key);
+
+    if (s == NULL)
+        return 0;
+
+    snprintf(value, size, "%s", s);
+    g_free(s);
+
+    return 1;
+}
+
+static void decode_image(struct image_search *search, int index, GBytes *bytes)
+{
+    struct found_image *fi;
+
+    /* only decoded to be shown, prefetched images are just cached */
+    if (search->found == NULL)
+        return;
+
+    fi = calloc(1, sizeof(struct found_image));
+
+    if (!fi)
+        return;
+
+    fi->search = search;
+    fi->index = index;
+    fi->bytes = g_bytes_ref(bytes);
+    g_atomic_int_inc(&search->decoding);
+    g_thread_pool_push(search->plugin->decoders, fi, NULL);
+}
+
+static int host_add_image(struct image_provider_search *ps, const void *data,
+    size_t size)
+{
+    struct image_search *search = (struct image_search *)ps;
+    GBytes *bytes;
+
+    if (is_cancelled(search) || ((int)search->images->len >= search->count))
+        return 0;
+
+    bytes = g_bytes_new(data, size);
+    g_ptr_array_add(search->images, bytes);
+    decode_image(search, search->images->len - 1, bytes);
+
+    return 1;
+}
+
+static void host_set_total(struct image_provider_search *ps,
+    unsigned long long total)
+{
+    ((struct image_search *)ps)->total = total;
+}
+
+static int host_is_cancelled(struct image_provider_search *ps)
+{
+    return is_cancelled((struct image_search *)ps);
+}
+
+static const struct image_provider_host __host = {
+    IMAGE_PROVIDER_ABI_VERSION,
+    host_get_setting,
+    host_add_image,
+    host_set_total,
+    host_is_cancelled
+};
+
+static void destroy_search(struct image_search *search)
+{
+    g_ptr_array_unref(search->images);
+    free(search->query);
+    free(search->error);
+    free(search);
+}
+
+static void finish_search(struct image_search *search)
+{
+    if ((search->func != NULL) && !g_atomic_int_get(&search->cancelled))
+        search->func(search->images, search->total, search->error,
+                     search->data);
+
+    destroy_search(search);
+}
+
+static gboolean search_finished(gpointer data)
+{
+    struct image_search *search = (struct image_search *)data;
+
+    search->searched = 1;
+
+    if (!g_atomic_int_get(&search->decoding))
+        finish_search(search);
+
+    return FALSE;
+}
+
+static gboolean image_decoded(gpointer data)
+{
+    struct found_image *fi = (struct found_image *)data;
+    struct image_search *search = fi->search;
+
+    if ((fi->pixbuf != NULL) && !g_atomic_int_get(&search->cancelled))
+        search->found(fi->index, fi->bytes, fi->pixbuf, search->data);
+
+    if (fi->pixbuf != NULL)
+        g_object_unref(fi->pixbuf);
+
+    g_bytes_unref(fi->bytes);
+    free(fi);
+
+    if (g_atomic_int_dec_and_test(&search->decoding) && search->searched)
+        finish_search(search);
+
+    return FALSE;
+}
+
+static void decoder_thread(gpointer data, gpointer user_data __attribute__((unused)))
+{
+    struct found_image *fi = (struct found_image *)data;
+    gconstpointer image;
+    gsize size;
+
+    if (!g_atomic_int_get(&fi->search->cancelled)) {
+        image = g_bytes_get_data(fi->bytes, &size);
+        fi->pixbuf = image_new_from_data(image, size, NULL);
+    }
+
+    g_idle_add(image_decoded, fi);
+}
+
+static int is_cacheable(struct image_plugin *plugin)
+{
+    return !(plugin->provider->flags & IMAGE_PROVIDER_NO_CACHE);
+}
+
+/* Gives 1 if the page of @search is cached, its images are then decoded */
+static int load_cached(struct image_search *search)
+{
+    guint i;
+
+    if (!web_cache_load(search->plugin->provider->name, search->query,
+                        search->start, search->count, search->images,
+                        &search->total))
+    {
+        return 0;
+    }
+
+    for (i = 0; i < search->images->len; i++)
+        decode_image(search, i, g_ptr_array_index(search->images, i));
+
+    return 1;
+}
+
+static void search_thread(gpointer data, gpointer user_data)
+{
+    struct image_search *search = (struct image_search *)data;
+    struct image_plugin *plugin = (struct image_plugin *)user_data;
+    const char *name = plugin->provider->name;
+    char *error=NULL;
+
+    /* it may have been prefetched while it waited */
+    if (is_cancelled(search) ||
+        (is_cacheable(plugin) &&
+         load_cached(search)))
+    {
+        goto end_block;
+    }
+
+    if (!plugin->provider->search(plugin->state,
+                                  (struct image_provider_search *)search,
+                                  search->query, search->start, search->count,
+                                  &error))
+    {
+        search->error = (error != NULL)
+                            ? error
+                            : strdup(gettext("The image search has failed."));
+    } else if (!is_cancelled(search) && is_cacheable(plugin))
+        web_cache_store(name, search->query, search->start, search->count,
+                        search->images, search->total);
+
+end_block:
+    g_idle_add(search_finished, search);
+}
+
+/*
+ * Searches asked for are made first, then prefetches and the searches made in
+ * the background, each in order.
+ */
+static gint compare_searches(gconstpointer a, gconstpointer b,
+    gpointer data __attribute__((unused)))
+{
+    const struct image_search *sa = a, *sb = b;
+
+    if (sa->priority != sb->priority)
+        return sa->priority - sb->priority;
+
+    return (gint)(sa->serial - sb->serial);
+}
+
+static char *provider_filename(void)
+{
+    char *name, *dir, *filename;
+
+    name = get_config_setting(IMAGE_PROVIDER_GROUP, "name");
+
+    /* covers of a local directory are searched without the web */
+    if (name == NULL)
+        name = g_strdup((getenv("GTKOLLECTION_IMAGE_DIR") != NULL) ? "local"
+                                                                   : "script");
+
+    dir = getenv("GTKOLLECTION_PLUGIN_DIR");
+    filename = g_strdup_printf("%s/ip_%s.%s",
+                               (dir != NULL) ? dir : IMAGE_PROVIDER_DIR, name,
+                               G_MODULE_SUFFIX);
+
+    g_free(name);
+
+    return filename;
+}
+
+/* Loads the image provider, if it isn't yet. Gives 0 if it can't be used. */
+int image_plugin_load(void)
+{
+    struct image_plugin *plugin;
+    image_provider_entry entry;
+    char *filename, *s;
+
+    if (__plugin != NULL)
+        return 1;
+
+    if (!g_module_supported())
+        return 0;
+
+    plugin = calloc(1, sizeof(struct image_plugin));
+
+    if (!plugin)
+        return 0;
+
+    filename = provider_filename();
+    plugin->module = g_module_open(filename, G_MODULE_BIND_LOCAL);
+    g_free(filename);
+
+    if (plugin->module == NULL) {
+        fprintf(stderr, "Error: %s\n", g_module_error());
+        goto end_block;
+    }
+
+    if (!g_module_symbol(plugin->module, IMAGE_PROVIDER_SYMBOL,
+                         (gpointer *)&entry) ||
+        ((plugin->provider = entry()) == NULL) ||
+        (plugin->provider->abi_version != IMAGE_PROVIDER_ABI_VERSION))
+    {
+        fprintf(stderr, "Error: %s isn't a valid image provider\n",
+                g_module_name(plugin->module));
+
+        goto end_block;
+    }
+
+    s = get_config_setting(IMAGE_PROVIDER_GROUP, "page_size");
+    plugin->page_size = (s != NULL) ? atoi(s) : IMAGE_SEARCH_COUNT;
+    plugin->page_size = CLAMP(plugin->page_size, 1, IMAGE_SEARCH_COUNT_MAX);
+    g_free(s);
+
+    plugin->state = plugin->provider->init(&__host);
+
+    if (plugin->state == NULL)
+        goto end_block;
+
+    /* providers don't have to be thread safe */
+    plugin->searches = g_thread_pool_new(search_thread, plugin, 1, FALSE, NULL);
+    plugin->decoders = g_thread_pool_new(decoder_thread, NULL,
+                                         MIN(g_get_num_processors(),
+                                             IMAGE_DECODERS_MAX),
+                                         FALSE, NULL);
+
+    if ((plugin->searches == NULL) || (plugin->decoders == NULL)) {
+        if (plugin->searches != NULL)
+            g_thread_pool_free(plugin->searches, TRUE, TRUE);
+
+        if (plugin->decoders != NULL)
+            g_thread_pool_free(plugin->decoders, TRUE, TRUE);
+
+        plugin->provider->uninit(plugin->state);
+        goto end_block;
+    }
+
+    g_thread_pool_set_sort_function(plugin->searches, compare_searches, NULL);
+    web_cache_init();
+    __plugin = plugin;
+
+    return 1;
+
+end_block:
+    if (plugin->module != NULL)
+        g_module_close(plugin->module);
+
+    free(plugin);
+
+    return 0;
+}
+
+static struct image_search *new_search(const char *query, int start,
+    image_found_func found, image_search_func func, gpointer data)
+{
+    struct image_search *search;
+
+    search = calloc(1, sizeof(struct image_search));
+
+    if (!search)
+        return NULL;
+
+    search->plugin = __plugin;
+    search->query = strdup(query);
+    search->start = start;
+    search->count = __plugin->page_size;
+    search->serial = __search_serial++;
+    search->images = g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+    search->found = found;
+    search->func = func;
+    search->data = data;
+
+    return search;
+}
+
+static struct image_search *start_search(const char *query, int start,
+    image_found_func found, image_search_func func, gpointer data, int priority)
+{
+    struct image_search *search;
+
+    if (!image_plugin_load())
+        return NULL;
+
+    search = new_search(query, start, found, func, data);
+
+    if (!search)
+        return NULL;
+
+    search->priority = priority;
+
+    /* still delivered from the main loop, as if it had been searched */
+    if (is_cacheable(__plugin) && load_cached(search))
+        g_idle_add(search_finished, search);
+    else
+        g_thread_pool_push(__plugin->searches, search, NULL);
+
+    return search;
+}
+
+/*
+ * Searches a page of images about @query, from the result @start on. @found
+ * is called from the main loop with each image as soon as it's decoded, then
+ * @func once the search ends, unless it's cancelled first. The images belong
+ * to the search and must be referenced to be kept. Gives NULL if there is no
+ * image provider.
+ */
+struct image_search *image_search_start(const char *query, int start,
+    image_found_func found, image_search_func func, gpointer data)
+{
+    return start_search(query, start, found, func, data, SEARCH_ASKED);
+}
+
+/*
+ * Like image_search_start(), for searches nobody is waiting for. They are
+ * only made once every other search is done. @found may be NULL, images
+ * aren't decoded then.
+ */
+struct image_search *image_search_start_background(const char *query,
+    int start, image_found_func found, image_search_func func, gpointer data)
+{
+    return start_search(query, start, found, func, data, SEARCH_BACKGROUND);
+}
+
+/*
+ * Searches the page of @query from the result @start on into the cache, once
+ * there are no other searches to make, so it's at hand when asked for.
+ */
+void image_search_prefetch(const char *query, int start)
+{
+    struct image_search *search;
+
+    if (!image_plugin_load() || !is_cacheable(__plugin) ||
+        web_cache_has(__plugin->provider->name, query, start,
+                      __plugin->page_size))
+    {
+        return;
+    }
+
+    search = new_search(query, start, NULL, NULL, NULL);
+
+    if (!search)
+        return;
+
+    search->priority = SEARCH_PREFETCH;
+    g_thread_pool_push(__plugin->searches, search, NULL);
+}
+
+/* Cancels a pending @search, its functions won't be called anymore */
+void image_search_cancel(struct image_search *search)
+{
+    /* the provider stops adding images, the search is freed when it returns */
+    g_atomic_int_set(&search->cancelled, 1);
+}
+
+/* Gives how many images a search finds at most */
+int image_search_page_size(void)
+{
+    return image_plugin_load() ? __plugin->page_size : IMAGE_SEARCH_COUNT;
+}
+
+void image_plugin_stop(void)
+{
+    if (__plugin == NULL)
+        return;
+
+    /* waits for the running search, the queued ones are dropped */
+    g_atomic_int_set(&__plugin->stopped, 1);
+    g_thread_pool_free(__plugin->searches, TRUE, TRUE);
+    g_thread_pool_free(__plugin->decoders, TRUE, TRUE);
+    __plugin->provider->uninit(__plugin->state);
+    g_module_close(__plugin->module);
+    free(__plugin);
+    __plugin = NULL;
+}
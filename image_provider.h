@@ -0,0 +1,74 @@
+
+/*
+ * Description: interface of the image provider plugins.
+ *
+ * A provider is a shared library exporting IMAGE_PROVIDER_SYMBOL, a function
+ * that gives its struct image_provider. It only needs this header, it doesn't
+ * have to link against gtk or glib.
+ *
+ * Searches are made one at a time, from a thread of their own, so providers
+ * may block while they run. Images are handed over as they are found, still
+ * encoded, the way they would be kept in a file.
+ */
+
+#ifndef _IMAGE_PROVIDER_H
+#define _IMAGE_PROVIDER_H			1
+
+#include <stddef.h>
+
+/* changed whenever the structures below change */
+#define IMAGE_PROVIDER_ABI_VERSION      2
+
+#define IMAGE_PROVIDER_SYMBOL           "gtkollection_image_provider"
+
+/* its results are cheap to find again, they aren't cached */
+#define IMAGE_PROVIDER_NO_CACHE         (1 << 0)
+
+/* A search, as seen by the provider */
+struct image_provider_search;
+
+/* What gtkollection offers to providers */
+struct image_provider_host {
+    unsigned int    abi_version;
+
+    /*
+     * Copies the setting @key of the provider, from the [image_provider]
+     * group of the config file, into @value. Gives 0 if it's not set.
+     */
+    int             (*get_setting)(const char *key, char *value, size_t size);
+
+    /*
+     * Adds an image to the results of @search. Gives 0 if it's not wanted
+     * anymore, because the search was cancelled or has enough images.
+     */
+    int             (*add_image)(struct image_provider_search *search,
+                                 const void *data, size_t size);
+
+    /* Sets the estimated number of results of @search */
+    void            (*set_total)(struct image_provider_search *search,
+                                 unsigned long long total);
+
+    int             (*is_cancelled)(struct image_provider_search *search);
+};
+
+struct image_provider {
+    unsigned int    abi_version;    /* IMAGE_PROVIDER_ABI_VERSION */
+    const char      *name;
+    unsigned int    flags;
+
+    /* Gives the state of the provider, NULL if it can't be used */
+    void            *(*init)(const struct image_provider_host *host);
+    void            (*uninit)(void *state);
+
+    /*
+     * Searches up to @count images about @query, from the result @start on.
+     * Gives 0 if it fails, with @error pointing to a malloc()ed message.
+     */
+    int             (*search)(void *state, struct image_provider_search *search,
+                              const char *query, int start, int count,
+                              char **error);
+};
+
+typedef const struct image_provider *(*image_provider_entry)(void);
+
+#endif
@@ -0,0 +1,364 @@
+
+/*
+ * Description: downscaling of cover images.
+ *
+ * Images are scaled in two passes, first down the columns and then along the
+ * rows, every output pixel being a weighted sum of the input pixels under
+ * it. Reductions to half the size or less are area averages, smaller ones
+ * are bilinear. Weights are fixed point, so the column pass, which reads
+ * every input pixel, runs with SSE2 or AVX2 when the processor has them.
+ *
+ * Channels are averaged as they are, alpha isn't premultiplied. Covers are
+ * hardly ever transparent.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+#include "gtkollection.h"
+
+/* the weights of each output pixel add up to 1 << WEIGHT_BITS */
+#define WEIGHT_BITS                 14
+
+/* fraction bits of the values kept between both passes */
+#define ROW_BITS                    7
+
+#define COLUMN_SHIFT                (WEIGHT_BITS - ROW_BITS)
+#define ROW_SHIFT                   (WEIGHT_BITS + ROW_BITS)
+
+/* Input pixels used by each output pixel along one direction */
+struct scale_taps {
+    int     size;       /* output pixels */
+    int     n;          /* taps of each one */
+    int     stride;     /* @n rounded up to pairs, the extra weight is 0 */
+    int     *first;     /* first input pixel of each output one */
+    gint16  *weights;   /* @stride of them for each output pixel */
+};
+
+/*
+ * Sums @n rows, an even number, weighted by @weights, from byte @x to @len.
+ * Results keep ROW_BITS of fraction.
+ */
+typedef void (*column_func)(const guchar **rows, const gint16 *weights, int n,
+                            gint16 *out, int x, int len);
+
+static column_func __scale_column = NULL;
+static const char *__kernel = NULL;
+
+static void free_taps(struct scale_taps *t)
+{
+    free(t->first);
+    free(t->weights);
+}
+
+/*
+ * Rounds the weights of @n taps, so they still add up to exactly one. Their
+ * running sum is what gets rounded, so each weight is within 1 of its exact
+ * value and none is negative.
+ */
+static void set_weights(gint16 *weights, const double *w, int n)
+{
+    double sum=0, total=0;
+    long last=0, next;
+    int k;
+
+    for (k = 0; k < n; k++)
+        sum += w[k];
+
+    for (k = 0; k < n; k++) {
+        total += w[k];
+        next = (k == n - 1) ? (1 << WEIGHT_BITS)
+                            : lround(total / sum * (1 << WEIGHT_BITS));
+
+        weights[k] = (gint16)(next - last);
+        last = next;
+    }
+}
+
+static int compute_taps(struct scale_taps *t, int in, int out)
+{
+    double scale, start, end, center, *w;
+    int i, k, first, area;
+
+    scale = (double)in / out;
+    area = (scale >= 2);
+
+    t->size = out;
+    t->n = MIN(area ? (int)ceil(scale) + 1 : 2, in);
+    t->stride = (t->n + 1) & ~1;
+    t->first = malloc(out * sizeof(int));
+    t->weights = calloc(out * t->stride, sizeof(gint16));
+    w = malloc(t->n * sizeof(double));
+
+    if (!t->first || !t->weights || !w) {
+        free_taps(t);
+        free(w);
+
+        return 0;
+    }
+
+    for (i = 0; i < out; i++) {
+        if (area) {
+            /* how much of each input pixel the output one covers */
+            start = i * scale;
+            end = start + scale;
+            first = MIN((int)start, in - t->n);
+
+            for (k = 0; k < t->n; k++)
+                w[k] = MAX(0, MIN(end, first + k + 1) - MAX(start, first + k));
+        } else {
+            center = CLAMP((i + 0.5) * scale - 0.5, 0, in - 1);
+            first = MIN((int)center, in - t->n);
+            w[0] = 1 - (center - first);
+
+            if (t->n > 1)
+                w[1] = center - first;
+        }
+
+        t->first[i] = first;
+        set_weights(t->weights + i * t->stride, w, t->n);
+    }
+
+    free(w);
+
+    return 1;
+}
+
+static void scale_column_c(const guchar **rows, const gint16 *weights, int n,
+    gint16 *out, int x, int len)
+{
+    gint32 sum;
+    int k;
+
+    for (; x < len; x++) {
+        sum = 1 << (COLUMN_SHIFT - 1);
+
+        for (k = 0; k < n; k++)
+            sum += weights[k] * rows[k][x];
+
+        out[x] = sum >> COLUMN_SHIFT;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+/* Weights of rows @k and @k + 1, as multiplied by pmaddwd */
+static gint32 weight_pair(const gint16 *weights, int k)
+{
+    gint32 pair;
+
+    memcpy(&pair, weights + k, sizeof(gint32));
+
+    return pair;
+}
+
+/*
+ * Pixels of two rows are interleaved as 16 bit values, so pmaddwd multiplies
+ * and adds both rows at once, 8 bytes at a time.
+ */
+__attribute__((target("sse2")))
+static void scale_column_sse2(const guchar **rows, const gint16 *weights, int n,
+    gint16 *out, int x, int len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << (COLUMN_SHIFT - 1));
+    __m128i lo, hi, a, b, w;
+    int k;
+
+    for (; x + 8 <= len; x += 8) {
+        lo = round;
+        hi = round;
+
+        for (k = 0; k < n; k += 2) {
+            a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(rows[k] + x)),
+                                  zero);
+
+            b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(rows[k + 1] + x)),
+                                  zero);
+
+            w = _mm_set1_epi32(weight_pair(weights, k));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+        }
+
+        lo = _mm_srai_epi32(lo, COLUMN_SHIFT);
+        hi = _mm_srai_epi32(hi, COLUMN_SHIFT);
+        _mm_storeu_si128((__m128i *)(out + x), _mm_packs_epi32(lo, hi));
+    }
+
+    scale_column_c(rows, weights, n, out, x, len);
+}
+
+/*
+ * Like scale_column_sse2(), 16 bytes at a time. Unpacking and packing work
+ * on each 128 bit lane, so the values come out in order.
+ */
+__attribute__((target("avx2")))
+static void scale_column_avx2(const guchar **rows, const gint16 *weights, int n,
+    gint16 *out, int x, int len)
+{
+    const __m256i round = _mm256_set1_epi32(1 << (COLUMN_SHIFT - 1));
+    __m256i lo, hi, a, b, w;
+    int k;
+
+    for (; x + 16 <= len; x += 16) {
+        lo = round;
+        hi = round;
+
+        for (k = 0; k < n; k += 2) {
+            a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(rows[k] + x)));
+            b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(rows[k + 1] + x)));
+            w = _mm256_set1_epi32(weight_pair(weights, k));
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+        }
+
+        lo = _mm256_srai_epi32(lo, COLUMN_SHIFT);
+        hi = _mm256_srai_epi32(hi, COLUMN_SHIFT);
+        _mm256_storeu_si256((__m256i *)(out + x), _mm256_packs_epi32(lo, hi));
+    }
+
+    scale_column_sse2(rows, weights, n, out, x, len);
+}
+#endif
+
+/* Picks the column pass for this processor, once */
+static void select_kernel(void)
+{
+    static gsize initialized = 0;
+
+    if (!g_once_init_enter(&initialized))
+        return;
+
+    __scale_column = scale_column_c;
+    __kernel = "c";
+
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        __scale_column = scale_column_avx2;
+        __kernel = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        __scale_column = scale_column_sse2;
+        __kernel = "sse2";
+    }
+#endif
+
+    g_once_init_leave(&initialized, 1);
+}
+
+/* Name of the column pass in use: avx2, sse2 or c */
+const char *image_scale_kernel(void)
+{
+    select_kernel();
+
+    return __kernel;
+}
+
+static void scale_row(const gint16 *in, const struct scale_taps *t, int channels,
+    guchar *out)
+{
+    const gint16 *src, *w;
+    gint32 sum;
+    int x, c, k;
+
+    for (x = 0; x < t->size; x++) {
+        src = in + t->first[x] * channels;
+        w = t->weights + x * t->stride;
+
+        for (c = 0; c < channels; c++) {
+            sum = 1 << (ROW_SHIFT - 1);
+
+            for (k = 0; k < t->n; k++)
+                sum += w[k] * src[k * channels + c];
+
+            *out++ = CLAMP(sum >> ROW_SHIFT, 0, 255);
+        }
+    }
+}
+
+/*
+ * Gives @src scaled to @width x @height, like gdk_pixbuf_scale_simple(). It
+ * may be @src itself, with a new reference, if it already has that size.
+ */
+GdkPixbuf *image_scale(GdkPixbuf *src, int width, int height)
+{
+    struct scale_taps tx, ty;
+    GdkPixbuf *dst;
+    const guchar *pixels, **rows=NULL;
+    guchar *dst_pixels;
+    gint16 *tmp=NULL;
+    int src_width, src_height, channels, stride, dst_stride, y, k;
+
+    src_width = gdk_pixbuf_get_width(src);
+    src_height = gdk_pixbuf_get_height(src);
+    channels = gdk_pixbuf_get_n_channels(src);
+
+    if ((src_width == width) && (src_height == height))
+        return g_object_ref(src);
+
+    if ((gdk_pixbuf_get_colorspace(src) != GDK_COLORSPACE_RGB) ||
+        (gdk_pixbuf_get_bits_per_sample(src) != 8) ||
+        ((channels != 3) && (channels != 4)))
+    {
+        return gdk_pixbuf_scale_simple(src, width, height, GDK_INTERP_BILINEAR);
+    }
+
+    select_kernel();
+    dst = gdk_pixbuf_new(GDK_COLORSPACE_RGB, gdk_pixbuf_get_has_alpha(src), 8,
+                         width, height);
+
+    if (dst == NULL)
+        return NULL;
+
+    if (!compute_taps(&tx, src_width, width)) {
+        g_object_unref(dst);
+        return NULL;
+    }
+
+    if (!compute_taps(&ty, src_height, height)) {
+        free_taps(&tx);
+        g_object_unref(dst);
+
+        return NULL;
+    }
+
+    rows = malloc(ty.stride * sizeof(guchar *));
+    tmp = malloc(src_width * channels * sizeof(gint16));
+
+    if (!rows || !tmp) {
+        g_object_unref(dst);
+        dst = NULL;
+        goto end_block;
+    }
+
+    pixels = gdk_pixbuf_get_pixels(src);
+    stride = gdk_pixbuf_get_rowstride(src);
+    dst_pixels = gdk_pixbuf_get_pixels(dst);
+    dst_stride = gdk_pixbuf_get_rowstride(dst);
+
+    for (y = 0; y < height; y++) {
+        /* the padding row has no weight, any row will do */
+        for (k = 0; k < ty.stride; k++)
+            rows[k] = pixels + (ty.first[y] + MIN(k, ty.n - 1)) * stride;
+
+        __scale_column(rows, ty.weights + y * ty.stride, ty.stride, tmp, 0,
+                       src_width * channels);
+
+        scale_row(tmp, &tx, channels, dst_pixels + y * dst_stride);
+    }
+
+end_block:
+    free(rows);
+    free(tmp);
+    free_taps(&tx);
+    free_taps(&ty);
+
+    return dst;
+}
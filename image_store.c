@@ -0,0 +1,280 @@
+
+/*
+ * Description: cover images stored by their contents.
+ *
+ * Each image is named after the SHA-1 of its contents, under IMAGE_STORE_DIR,
+ * so identical covers are kept once and shared by every entry using them,
+ * whatever their collection. How many entries use an image is counted by the
+ * database, which removes the unused ones.
+ *
+ * Images may also be kept in a single pack file instead, see image_pack.c.
+ * Their names are then IMAGE_PACK_PREFIX followed by the digest.
+ *
+ * Every image gets an icon of ICON_SIZE for the list when it's stored, kept
+ * and removed along with it.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "gtkollection.h"
+
+#define READ_BUFFER_SIZE            (64 * 1024)
+
+#define ICON_SUFFIX                 ".icon"
+
+/* new images go to the pack */
+static int __pack_images = 0;
+
+static char *image_checksum(const char *filename)
+{
+    GChecksum *checksum;
+    unsigned char buffer[READ_BUFFER_SIZE];
+    char *digest=NULL;
+    ssize_t n;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+
+    if (fd == -1)
+        return NULL;
+
+    checksum = g_checksum_new(G_CHECKSUM_SHA1);
+
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+        g_checksum_update(checksum, buffer, n);
+
+    if (n == 0)
+        digest = g_strdup(g_checksum_get_string(checksum));
+
+    g_checksum_free(checksum);
+    close(fd);
+
+    return digest;
+}
+
+/*
+ * Packed images can be shown whatever the storage mode is, so the pack is
+ * always opened.
+ */
+void image_store_init(struct storage_settings *storage)
+{
+    __pack_images = (storage->images == STORAGE_IMAGES_PACK);
+
+    if (!image_pack_open() && __pack_images) {
+        fprintf(stderr, "Error: can't open the image pack, images are kept as "
+                        "files\n");
+
+        __pack_images = 0;
+    }
+}
+
+void image_store_uninit(void)
+{
+    image_pack_close();
+}
+
+int image_store_is_packed(const char *filename)
+{
+    return g_str_has_prefix(filename, IMAGE_PACK_PREFIX);
+}
+
+/*
+ * Gives the name that the image @filename has inside the store, NULL if it
+ * can't be read.
+ */
+char *image_store_filename(const char *filename)
+{
+    char path[512]={0}, *digest;
+
+    digest = image_checksum(filename);
+
+    if (digest == NULL)
+        return NULL;
+
+    if (__pack_images)
+        snprintf(path, sizeof(path), "%s%s", IMAGE_PACK_PREFIX, digest);
+    else {
+        /* spread over subdirectories, so none of them gets too large */
+        snprintf(path, sizeof(path), "%s/%s/%s/%.2s/%s", getenv("HOME"),
+                 APP_CONFIG_PATH, IMAGE_STORE_DIR, digest, digest);
+    }
+
+    g_free(digest);
+
+    return strdup(path);
+}
+
+/*
+ * Gives the name of the icon of the stored image @filename. The pack only
+ * holds digests, so packed icons are named after the SHA-1 of their image
+ * name.
+ */
+static char *icon_filename(const char *filename)
+{
+    char *digest, *name;
+
+    if (!image_store_is_packed(filename))
+        return g_strdup_printf("%s%s", filename, ICON_SUFFIX);
+
+    digest = g_compute_checksum_for_string(G_CHECKSUM_SHA1, filename, -1);
+    name = g_strdup_printf("%s%s", IMAGE_PACK_PREFIX, digest);
+    g_free(digest);
+
+    return name;
+}
+
+/*
+ * Makes the icon of the image @filename, stored as @store_filename. Images
+ * without one are still listed, their icon is scaled when it's loaded.
+ */
+static void store_icon(const char *filename, const char *store_filename)
+{
+    char *icon, *tmp;
+
+    icon = icon_filename(store_filename);
+
+    if (!image_store_is_packed(icon)) {
+        if (access(icon, 0x00) == -1)
+            image_create_icon(filename, icon);
+
+        g_free(icon);
+        return;
+    }
+
+    /* beside @filename, whose own icon may be there */
+    tmp = g_strdup_printf("%s%s.tmp", filename, ICON_SUFFIX);
+
+    if (image_create_icon(filename, tmp))
+        image_pack_add(icon + strlen(IMAGE_PACK_PREFIX), tmp);
+
+    remove(tmp);
+    g_free(tmp);
+    g_free(icon);
+}
+
+/*
+ * Moves the image @filename into the store as @store_filename, given by
+ * image_store_filename(). If the store already has it, @filename is only
+ * removed. Gives 0 if it can't be stored.
+ */
+int image_store_add(const char *filename, const char *store_filename)
+{
+    char *dir;
+    int ret;
+
+    if (image_store_is_packed(store_filename)) {
+        if (!image_pack_add(store_filename + strlen(IMAGE_PACK_PREFIX), filename))
+            return 0;
+
+        store_icon(filename, store_filename);
+        remove(filename);
+        return 1;
+    }
+
+    if (!access(store_filename, 0x00)) {
+        store_icon(store_filename, store_filename);
+        remove(filename);
+        return 1;
+    }
+
+    dir = g_path_get_dirname(store_filename);
+    ret = (g_mkdir_with_parents(dir, 0755) == 0) &&
+          (rename_file(filename, store_filename) == 0);
+
+    if (ret)
+        store_icon(store_filename, store_filename);
+
+    g_free(dir);
+
+    return ret;
+}
+
+/* Removes an image that no entry uses anymore, with its icon */
+void image_store_remove(const char *filename)
+{
+    char *icon;
+
+    icon = icon_filename(filename);
+
+    if (image_store_is_packed(filename)) {
+        image_pack_remove(filename + strlen(IMAGE_PACK_PREFIX));
+        image_pack_remove(icon + strlen(IMAGE_PACK_PREFIX));
+    } else {
+        remove(filename);
+        remove(icon);
+    }
+
+    g_free(icon);
+}
+
+/*
+ * Adds the image @filename to the pack, leaving the file where it is. Gives
+ * its new name, NULL if it can't be added.
+ */
+char *image_store_pack(const char *filename)
+{
+    char path[512]={0}, *digest;
+
+    digest = image_checksum(filename);
+
+    if (digest == NULL)
+        return NULL;
+
+    if (image_pack_add(digest, filename)) {
+        snprintf(path, sizeof(path), "%s%s", IMAGE_PACK_PREFIX, digest);
+        store_icon(filename, path);
+    }
+
+    g_free(digest);
+
+    return (path[0] != 0) ? strdup(path) : NULL;
+}
+
+/* Gives the image @filename scaled to THUMBNAIL_SIZE, NULL if it can't be read */
+GdkPixbuf *image_store_load(const char *filename)
+{
+    if (image_store_is_packed(filename))
+        return image_pack_load(filename + strlen(IMAGE_PACK_PREFIX),
+                               THUMBNAIL_SIZE);
+
+    return image_load(filename, THUMBNAIL_SIZE, FALSE, NULL);
+}
+
+/*
+ * Gives the icon of the image @filename, NULL if it can't be read. Images
+ * stored before icons were made have theirs scaled from the cover.
+ */
+GdkPixbuf *image_store_load_icon(const char *filename)
+{
+    GdkPixbuf *pixbuf, *icon;
+    char *name;
+
+    name = icon_filename(filename);
+
+    if (image_store_is_packed(name))
+        pixbuf = image_pack_load(name + strlen(IMAGE_PACK_PREFIX), 0);
+    else
+        pixbuf = gdk_pixbuf_new_from_file(name, NULL);
+
+    g_free(name);
+
+    if (pixbuf != NULL)
+        return pixbuf;
+
+    if (!image_store_is_packed(filename))
+        return image_load(filename, ICON_SIZE, TRUE, NULL);
+
+    pixbuf = image_pack_load(filename + strlen(IMAGE_PACK_PREFIX), 0);
+
+    if (pixbuf == NULL)
+        return NULL;
+
+    icon = image_scale_to_fit(pixbuf, ICON_SIZE);
+    g_object_unref(pixbuf);
+
+    return icon;
+}
@@ -4,6 +4,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <libintl.h>
 
 #include "gtkollection.h"
@@ -11,6 +12,7 @@
 int main(int argc, char **argv)
 {
     struct app_settings settings;
+    int n;
 
     init_gettext(APP_NAME, "");
     srand(time(NULL));
@@ -21,15 +23,31 @@ int main(int argc, char **argv)
 
     load_config_file(&settings);
 
-    if (!db_init()) {
+    if (!db_init(&settings.storage)) {
         fprintf(stderr, gettext("Error initialing database.\n"));
         return -1;
     }
 
+    image_store_init(&settings.storage);
+
+    /* moves the images kept as files into the pack, without the UI */
+    if ((argc > 1) && !strcmp(argv[1], "--pack-images")) {
+        n = db_pack_images();
+
+        if (n >= 0)
+            printf(gettext("%d images packed.\n"), n);
+
+        db_uninit();
+        image_store_uninit();
+
+        return (n < 0) ? -1 : 0;
+    }
+
     init_ui(&argc, &argv, &settings);
     run_ui(&settings);
     exit_ui(&settings);
     db_uninit();
+    image_store_uninit();
 
     save_config_file(settings);
     return 0;
@@ -0,0 +1,195 @@
+
+/*
+ * Description: compares creating cover thumbnails in process against running
+ *              ImageMagick's convert for each one, as it used to be done, and
+ *              against gdk-pixbuf's own scaling.
+ *
+ * The scaling itself is then measured alone, image_scale() against
+ * gdk_pixbuf_scale_simple(), on the already decoded images.
+ *
+ * Usage: bench_thumbnail [-n runs] <image>...
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "gtkollection.h"
+
+#define DEFAULT_RUNS                50
+#define THUMB_FILENAME              "/tmp/gtkollection_bench_thumb"
+
+static int run_convert(const char *filename)
+{
+    pid_t pid;
+    int c_status;
+
+    pid = fork();
+
+    if (pid < 0)
+        return 0;
+    else if (pid == 0) {
+        execl("/usr/bin/convert", "convert", "-resize", "150x150", filename,
+              THUMB_FILENAME, (char *)NULL);
+
+        _exit(127);
+    }
+
+    waitpid(pid, &c_status, 0);
+
+    return WIFEXITED(c_status) && (WEXITSTATUS(c_status) == 0);
+}
+
+/* How thumbnails were made before image_scale() */
+static int run_gdk_pixbuf(const char *filename)
+{
+    GdkPixbuf *pixbuf;
+    int ret;
+
+    pixbuf = gdk_pixbuf_new_from_file_at_scale(filename, THUMBNAIL_SIZE,
+                                               THUMBNAIL_SIZE, TRUE, NULL);
+
+    if (pixbuf == NULL)
+        return 0;
+
+    ret = gdk_pixbuf_save(pixbuf, THUMB_FILENAME, "jpeg", NULL, "quality", "90",
+                          NULL);
+
+    g_object_unref(pixbuf);
+
+    return ret;
+}
+
+static int run_pixbuf(const char *filename)
+{
+    GError *error=NULL;
+
+    if (!image_create_thumbnail(filename, THUMB_FILENAME, &error)) {
+        fprintf(stderr, "Error: %s\n", error->message);
+        g_error_free(error);
+
+        return 0;
+    }
+
+    return 1;
+}
+
+static void bench(const char *name, int (*run)(const char *), char **filenames,
+    int n, int runs)
+{
+    gint64 t;
+    int i, j;
+
+    t = g_get_monotonic_time();
+
+    for (i = 0; i < runs; i++) {
+        for (j = 0; j < n; j++) {
+            if (!run(filenames[j])) {
+                printf("%-12s failed on %s\n", name, filenames[j]);
+                return;
+            }
+        }
+    }
+
+    t = g_get_monotonic_time() - t;
+    printf("%-12s %8.2f ms per image\n", name, t / 1000.0 / runs / n);
+}
+
+static GdkPixbuf *scale_gdk_pixbuf(GdkPixbuf *pixbuf, int width, int height)
+{
+    return gdk_pixbuf_scale_simple(pixbuf, width, height, GDK_INTERP_BILINEAR);
+}
+
+/* Scales every decoded image to fit in THUMBNAIL_SIZE, in input MPixels/s */
+static void bench_scale(const char *name,
+    GdkPixbuf *(*scale)(GdkPixbuf *, int, int), GdkPixbuf **images, int n,
+    int runs)
+{
+    GdkPixbuf *pixbuf;
+    double pixels=0;
+    gint64 t;
+    int i, j, width, height;
+
+    t = g_get_monotonic_time();
+
+    for (i = 0; i < runs; i++) {
+        for (j = 0; j < n; j++) {
+            width = gdk_pixbuf_get_width(images[j]);
+            height = gdk_pixbuf_get_height(images[j]);
+            pixels += (double)width * height;
+
+            if (width > height) {
+                height = MAX(height * THUMBNAIL_SIZE / width, 1);
+                width = THUMBNAIL_SIZE;
+            } else {
+                width = MAX(width * THUMBNAIL_SIZE / height, 1);
+                height = THUMBNAIL_SIZE;
+            }
+
+            pixbuf = scale(images[j], width, height);
+            g_object_unref(pixbuf);
+        }
+    }
+
+    t = g_get_monotonic_time() - t;
+    printf("%-12s %8.2f ms per image %8.1f MPixels/s\n", name,
+           t / 1000.0 / runs / n, pixels / t);
+}
+
+int main(int argc, char **argv)
+{
+    GdkPixbuf **images;
+    char name[32];
+    int runs = DEFAULT_RUNS, i, n=0, opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n')
+            runs = atoi(optarg);
+        else
+            break;
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-n runs] <image>...\n", argv[0]);
+        return 1;
+    }
+
+    if (runs <= 0)
+        runs = DEFAULT_RUNS;
+
+    printf("%d images, %d runs\n\nThumbnails:\n", argc - optind, runs);
+    bench("convert", run_convert, argv + optind, argc - optind, runs);
+    bench("gdk-pixbuf", run_gdk_pixbuf, argv + optind, argc - optind, runs);
+    bench("pixbuf", run_pixbuf, argv + optind, argc - optind, runs);
+    unlink(THUMB_FILENAME);
+
+    images = malloc((argc - optind) * sizeof(GdkPixbuf *));
+
+    if (!images)
+        return 1;
+
+    for (i = optind; i < argc; i++) {
+        images[n] = gdk_pixbuf_new_from_file(argv[i], NULL);
+
+        if (images[n] == NULL)
+            fprintf(stderr, "Error: can't read %s\n", argv[i]);
+        else
+            n++;
+    }
+
+    if (n > 0) {
+        snprintf(name, sizeof(name), "scale %s", image_scale_kernel());
+        printf("\nScaling to %d:\n", THUMBNAIL_SIZE);
+        bench_scale("gdk-pixbuf", scale_gdk_pixbuf, images, n, runs);
+        bench_scale(name, image_scale, images, n, runs);
+    }
+
+    for (i = 0; i < n; i++)
+        g_object_unref(images[i]);
+
+    free(images);
+
+    return 0;
+}
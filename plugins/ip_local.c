@@ -0,0 +1,344 @@
+
+/*
+ * Description: image provider searching the images of a local directory.
+ *
+ * An image is found when every word of the query is in its name, in the
+ * names of the directories it's in, which work as its tags, or in a file
+ * named like it with ".tags" added. The directory is the directory setting,
+ * or GTKOLLECTION_IMAGE_DIR.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <libintl.h>
+#include <sys/stat.h>
+
+#include "image_provider.h"
+
+/* directories deeper than this aren't searched */
+#define MAX_DEPTH                   8
+
+/* larger files aren't taken as covers */
+#define MAX_IMAGE_SIZE              (16 * 1024 * 1024)
+
+#define MAX_TAGS_SIZE               1024
+
+struct local_provider {
+    const struct image_provider_host    *host;
+    char                                directory[4096];
+};
+
+struct match_list {
+    char    **paths;
+    int     n;
+    int     size;
+};
+
+static const char *__extensions[] = {
+    ".jpg", ".jpeg", ".png", ".gif", ".bmp", NULL
+};
+
+static int is_image(const char *name)
+{
+    const char *ext;
+    int i;
+
+    ext = strrchr(name, '.');
+
+    if (ext == NULL)
+        return 0;
+
+    for (i = 0; __extensions[i] != NULL; i++)
+        if (!strcasecmp(ext, __extensions[i]))
+            return 1;
+
+    return 0;
+}
+
+static void lowercase(char *s)
+{
+    for (; *s; s++)
+        *s = tolower((unsigned char)*s);
+}
+
+/* Splits @query into lowercase words, the quotes around it are dropped */
+static char **split_query(const char *query)
+{
+    char **words, *s, *w, *save=NULL;
+    int n=0;
+
+    s = strdup(query);
+
+    if (!s)
+        return NULL;
+
+    lowercase(s);
+    words = calloc(strlen(s) / 2 + 2, sizeof(char *));
+
+    if (!words) {
+        free(s);
+        return NULL;
+    }
+
+    for (w = strtok_r(s, " \t\"", &save); w; w = strtok_r(NULL, " \t\"", &save))
+        words[n++] = strdup(w);
+
+    free(s);
+
+    return words;
+}
+
+static void free_words(char **words)
+{
+    int i;
+
+    for (i = 0; words[i] != NULL; i++)
+        free(words[i]);
+
+    free(words);
+}
+
+static int has_words(char **words, const char *text)
+{
+    int i;
+
+    for (i = 0; words[i] != NULL; i++)
+        if (strstr(text, words[i]) == NULL)
+            return 0;
+
+    return 1;
+}
+
+static void read_tags(const char *path, char *tags, size_t size)
+{
+    char filename[4096 + 8];
+    FILE *f;
+    size_t n;
+
+    tags[0] = 0;
+    snprintf(filename, sizeof(filename), "%s.tags", path);
+    f = fopen(filename, "r");
+
+    if (!f)
+        return;
+
+    n = fread(tags, 1, size - 1, f);
+    tags[n] = 0;
+    fclose(f);
+}
+
+static void add_match(struct match_list *l, const char *path)
+{
+    char **paths;
+
+    if (l->n == l->size) {
+        paths = realloc(l->paths, sizeof(char *) * (l->size + 64));
+
+        if (!paths)
+            return;
+
+        l->paths = paths;
+        l->size += 64;
+    }
+
+    l->paths[l->n++] = strdup(path);
+}
+
+/* @dir_tags has the names of the directories above @dir, and its own */
+static int scan_dir(const char *dir, const char *dir_tags, char **words,
+    struct match_list *l, int depth)
+{
+    DIR *d;
+    struct dirent *e;
+    struct stat st;
+    char path[4096], tags[MAX_TAGS_SIZE], *text;
+
+    d = opendir(dir);
+
+    if (!d)
+        return 0;
+
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.')
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+
+        if (stat(path, &st) == -1)
+            continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            if (depth < MAX_DEPTH) {
+                text = malloc(strlen(dir_tags) + strlen(e->d_name) + 2);
+
+                if (text != NULL) {
+                    sprintf(text, "%s %s", dir_tags, e->d_name);
+                    scan_dir(path, text, words, l, depth + 1);
+                    free(text);
+                }
+            }
+        } else if (S_ISREG(st.st_mode) && is_image(e->d_name)) {
+            read_tags(path, tags, sizeof(tags));
+            text = malloc(strlen(dir_tags) + strlen(e->d_name) + strlen(tags) + 3);
+
+            if (text != NULL) {
+                sprintf(text, "%s %s %s", dir_tags, e->d_name, tags);
+                lowercase(text);
+
+                if (has_words(words, text))
+                    add_match(l, path);
+
+                free(text);
+            }
+        }
+    }
+
+    closedir(d);
+
+    return 1;
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void *read_image(const char *path, size_t *size)
+{
+    struct stat st;
+    void *data;
+    FILE *f;
+
+    f = fopen(path, "r");
+
+    if (!f)
+        return NULL;
+
+    if ((fstat(fileno(f), &st) == -1) || (st.st_size == 0) ||
+        (st.st_size > MAX_IMAGE_SIZE) || ((data = malloc(st.st_size)) == NULL))
+    {
+        fclose(f);
+        return NULL;
+    }
+
+    *size = fread(data, 1, st.st_size, f);
+    fclose(f);
+
+    if (*size != (size_t)st.st_size) {
+        free(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+static int local_search(void *state, struct image_provider_search *search,
+    const char *query, int start, int count, char **error)
+{
+    struct local_provider *p = (struct local_provider *)state;
+    struct match_list l;
+    char **words, msg[4200];
+    void *data;
+    size_t size;
+    int i, ret=1;
+
+    words = split_query(query);
+
+    if (!words) {
+        *error = strdup(gettext("Out of memory."));
+        return 0;
+    }
+
+    memset(&l, 0, sizeof(struct match_list));
+
+    if (!scan_dir(p->directory, "", words, &l, 0)) {
+        snprintf(msg, sizeof(msg), gettext("Image directory %s not found."),
+                 p->directory);
+
+        *error = strdup(msg);
+        ret = 0;
+        goto end_block;
+    }
+
+    /* the same query always gives the same pages */
+    qsort(l.paths, l.n, sizeof(char *), compare_paths);
+    p->host->set_total(search, l.n);
+
+    for (i = start; (i < l.n) && (i < start + count); i++) {
+        if (p->host->is_cancelled(search))
+            break;
+
+        data = read_image(l.paths[i], &size);
+
+        if (data == NULL)
+            continue;
+
+        ret = p->host->add_image(search, data, size);
+        free(data);
+
+        if (!ret)
+            break;
+    }
+
+    ret = 1;
+
+end_block:
+    for (i = 0; i < l.n; i++)
+        free(l.paths[i]);
+
+    free(l.paths);
+    free_words(words);
+
+    return ret;
+}
+
+static void *local_init(const struct image_provider_host *host)
+{
+    struct local_provider *p;
+    const char *dir;
+
+    p = calloc(1, sizeof(struct local_provider));
+
+    if (!p)
+        return NULL;
+
+    p->host = host;
+
+    if (!host->get_setting("directory", p->directory, sizeof(p->directory))) {
+        dir = getenv("GTKOLLECTION_IMAGE_DIR");
+
+        if (dir == NULL) {
+            fprintf(stderr, "Error: no image directory to search\n");
+            free(p);
+
+            return NULL;
+        }
+
+        snprintf(p->directory, sizeof(p->directory), "%s", dir);
+    }
+
+    return p;
+}
+
+static void local_uninit(void *state)
+{
+    free(state);
+}
+
+static const struct image_provider __provider = {
+    IMAGE_PROVIDER_ABI_VERSION,
+    "local",
+    IMAGE_PROVIDER_NO_CACHE,
+    local_init,
+    local_uninit,
+    local_search
+};
+
+const struct image_provider *gtkollection_image_provider(void)
+{
+    return &__provider;
+}
@@ -0,0 +1,350 @@
+
+/*
+ * Description: image provider running the pl_images script.
+ *
+ * The script, or the one given by the script setting, is started once with
+ * --serve and kept running. Searches are sent to it one per line:
+ *
+ *   search <id> <start> <count> <query>  ->  image <id> <n>, for each image
+ *                                            ok <id> <number of images> <total>
+ *                                            error <id> <message>
+ *   cancel <id>
+ *
+ * Its images are downloaded at once and left in SCRIPT_TMP_DIR/<id> as
+ * image_<n>.jpg, from where each one is read into memory and removed as soon
+ * as it's announced.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <libintl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "image_provider.h"
+
+#define IMAGE_SCRIPT                "/opt/gtkollection/plugins/pl_images"
+#define SCRIPT_TMP_DIR              "/tmp/gtkollection_web"
+
+/* seconds a search may take, the script is restarted after that */
+#define SEARCH_TIMEOUT              60
+
+/* how often a cancelled search is noticed while waiting, in ms */
+#define POLL_INTERVAL               250
+
+#define MAX_IMAGE_SIZE              (16 * 1024 * 1024)
+
+struct script_provider {
+    const struct image_provider_host    *host;
+    char                                script[4096];
+    pid_t                               pid;
+    int                                 in;     /* its input */
+    int                                 out;    /* its output */
+    char                                buf[4096];
+    size_t                              len;
+    int                                 next_id;
+};
+
+static void stop_script(struct script_provider *p)
+{
+    if (p->pid <= 0)
+        return;
+
+    close(p->in);
+    close(p->out);
+    kill(p->pid, SIGTERM);
+    waitpid(p->pid, NULL, 0);
+    p->pid = 0;
+    p->len = 0;
+}
+
+static int start_script(struct script_provider *p)
+{
+    int in[2], out[2];
+
+    if (pipe(in) == -1)
+        return 0;
+
+    if (pipe(out) == -1) {
+        close(in[0]);
+        close(in[1]);
+
+        return 0;
+    }
+
+    p->pid = fork();
+
+    if (p->pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        execl(p->script, p->script, "--serve", (char *)NULL);
+        _exit(127);
+    }
+
+    close(in[0]);
+    close(out[1]);
+
+    if (p->pid == -1) {
+        close(in[1]);
+        close(out[0]);
+        p->pid = 0;
+
+        return 0;
+    }
+
+    /* scripts started later must not keep them open */
+    fcntl(in[1], F_SETFD, FD_CLOEXEC);
+    fcntl(out[0], F_SETFD, FD_CLOEXEC);
+    p->in = in[1];
+    p->out = out[0];
+    p->len = 0;
+
+    return 1;
+}
+
+static int send_request(struct script_provider *p, const char *request)
+{
+    size_t n = strlen(request);
+    ssize_t ret;
+
+    while (n > 0) {
+        ret = write(p->in, request, n);
+
+        if (ret <= 0)
+            return 0;
+
+        request += ret;
+        n -= ret;
+    }
+
+    return 1;
+}
+
+static void *read_image(const char *path, size_t *size)
+{
+    struct stat st;
+    void *data;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+
+    if (fd == -1)
+        return NULL;
+
+    if ((fstat(fd, &st) == -1) || (st.st_size == 0) ||
+        (st.st_size > MAX_IMAGE_SIZE) || ((data = malloc(st.st_size)) == NULL))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    *size = read(fd, data, st.st_size);
+    close(fd);
+
+    if (*size != (size_t)st.st_size) {
+        free(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+/* Hands the image @n of the search @id over, removing it */
+static void add_image(struct script_provider *p,
+    struct image_provider_search *search, int id, int n)
+{
+    char path[512];
+    void *data;
+    size_t size;
+
+    snprintf(path, sizeof(path), "%s/%d/image_%d.jpg", SCRIPT_TMP_DIR, id, n);
+    data = read_image(path, &size);
+
+    if (data != NULL) {
+        p->host->add_image(search, data, size);
+        free(data);
+    }
+
+    remove(path);
+}
+
+/*
+ * Waits for the answer to the search @id, into @line, handing its images over
+ * as they are announced. Answers of cancelled searches are skipped. Gives 1
+ * if it came, 0 if the search was cancelled, -1 if the script has stopped and
+ * -2 if it's stuck.
+ */
+static int read_answer(struct script_provider *p,
+    struct image_provider_search *search, int id, char *line, size_t size)
+{
+    struct pollfd pfd;
+    time_t deadline;
+    char *nl, request[64];
+    ssize_t n;
+    int answer_id, image;
+
+    deadline = time(NULL) + SEARCH_TIMEOUT;
+
+    for (;;) {
+        while ((nl = memchr(p->buf, '\n', p->len)) != NULL) {
+            *nl = 0;
+            snprintf(line, size, "%s", p->buf);
+            p->len -= (nl + 1 - p->buf);
+            memmove(p->buf, nl + 1, p->len);
+
+            if ((sscanf(line, "%*s %d", &answer_id) != 1) || (answer_id != id))
+                continue;
+
+            if (strncmp(line, "image ", 6))
+                return 1;
+
+            if (sscanf(line, "%*s %*d %d", &image) == 1)
+                add_image(p, search, id, image);
+        }
+
+        if (p->host->is_cancelled(search)) {
+            /* it skips the search, or stops downloading its images */
+            snprintf(request, sizeof(request), "cancel %d\n", id);
+            send_request(p, request);
+
+            return 0;
+        }
+
+        if ((time(NULL) > deadline) || (p->len == sizeof(p->buf)))
+            return -2;
+
+        pfd.fd = p->out;
+        pfd.events = POLLIN;
+
+        if (poll(&pfd, 1, POLL_INTERVAL) <= 0)
+            continue;
+
+        n = read(p->out, p->buf + p->len, sizeof(p->buf) - p->len);
+
+        if (n <= 0)
+            return -1;
+
+        p->len += n;
+    }
+}
+
+static int script_search(void *state, struct image_provider_search *search,
+    const char *query, int start, int count, char **error)
+{
+    struct script_provider *p = (struct script_provider *)state;
+    unsigned long long total=0;
+    char *request, *s, line[4096], message[512]={0}, dir[256];
+    int id, n_images=0, ret;
+
+    if ((p->pid == 0) && !start_script(p)) {
+        *error = strdup(gettext("The image plugin can't be run. Check your "
+                                "installation!"));
+
+        return 0;
+    }
+
+    id = p->next_id++;
+    request = malloc(strlen(query) + 64);
+
+    if (!request) {
+        *error = strdup(gettext("Out of memory."));
+        return 0;
+    }
+
+    sprintf(request, "search %d %d %d %s", id, start, count, query);
+
+    /* the query is the rest of the line */
+    for (s = request; *s; s++)
+        if ((*s == '\n') || (*s == '\r'))
+            *s = ' ';
+
+    strcat(request, "\n");
+
+    ret = send_request(p, request);
+    free(request);
+
+    if (ret)
+        ret = read_answer(p, search, id, line, sizeof(line));
+    else
+        ret = -1;
+
+    snprintf(dir, sizeof(dir), "%s/%d", SCRIPT_TMP_DIR, id);
+    rmdir(dir);
+
+    if (ret == 0)
+        return 1;
+
+    if (ret < 0) {
+        stop_script(p);
+        *error = strdup((ret == -2) ? gettext("The image search took too long.")
+                                    : gettext("The image plugin has stopped."));
+
+        return 0;
+    }
+
+    if (!strncmp(line, "ok ", 3) &&
+        (sscanf(line, "%*s %*d %d %llu", &n_images, &total) == 2))
+    {
+        p->host->set_total(search, total);
+        return 1;
+    }
+
+    sscanf(line, "%*s %*d %511[^\n]", message);
+    *error = strdup((message[0] != 0) ? message
+                                      : gettext("Invalid answer from the image "
+                                                "plugin."));
+
+    return 0;
+}
+
+static void *script_init(const struct image_provider_host *host)
+{
+    struct script_provider *p;
+
+    p = calloc(1, sizeof(struct script_provider));
+
+    if (!p)
+        return NULL;
+
+    p->host = host;
+    p->next_id = 1;
+
+    if (!host->get_setting("script", p->script, sizeof(p->script)))
+        snprintf(p->script, sizeof(p->script), "%s", IMAGE_SCRIPT);
+
+    /* writing to a script that has just exited must not end the application */
+    signal(SIGPIPE, SIG_IGN);
+
+    return p;
+}
+
+static void script_uninit(void *state)
+{
+    stop_script((struct script_provider *)state);
+    free(state);
+}
+
+static const struct image_provider __provider = {
+    IMAGE_PROVIDER_ABI_VERSION,
+    "script",
+    0,
+    script_init,
+    script_uninit,
+    script_search
+};
+
+const struct image_provider *gtkollection_image_provider(void)
+{
+    return &__provider;
+}
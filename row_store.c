@@ -0,0 +1,176 @@
+
+/*
+ * Description: storage of the values of collection rows.
+ *
+ * Every row is an array of a fixed number of cells pointing to strings, and
+ * both the arrays and the string bytes are packed into large chunks which
+ * are only released, all at once, with the store.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gtkollection.h"
+
+#define ROW_STORE_CHUNK_SIZE        (64 * 1024)
+
+struct row_store_chunk {
+    struct row_store_chunk  *next;
+    size_t                  size;
+    size_t                  used;
+    char                    data[];
+};
+
+struct row_store {
+    int                     n_cells;
+    struct row_store_chunk  *chunks;    /* the one in use is the head */
+};
+
+static struct row_store_chunk *new_chunk(size_t size)
+{
+    struct row_store_chunk *chunk;
+
+    chunk = malloc(sizeof(struct row_store_chunk) + size);
+
+    if (!chunk)
+        return NULL;
+
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+
+    return chunk;
+}
+
+static void *row_store_alloc(struct row_store *store, size_t size, size_t align)
+{
+    struct row_store_chunk *chunk = store->chunks;
+    size_t offset;
+
+    if (chunk != NULL) {
+        offset = (chunk->used + align - 1) & ~(align - 1);
+
+        if (offset + size <= chunk->size) {
+            chunk->used = offset + size;
+            return chunk->data + offset;
+        }
+    }
+
+    if (size > ROW_STORE_CHUNK_SIZE / 4) {
+        /* large values get a chunk of their own, keeping the current one */
+        chunk = new_chunk(size);
+
+        if (!chunk)
+            return NULL;
+
+        chunk->used = size;
+
+        if (store->chunks != NULL) {
+            chunk->next = store->chunks->next;
+            store->chunks->next = chunk;
+        } else
+            store->chunks = chunk;
+
+        return chunk->data;
+    }
+
+    chunk = new_chunk(ROW_STORE_CHUNK_SIZE);
+
+    if (!chunk)
+        return NULL;
+
+    chunk->next = store->chunks;
+    chunk->used = size;
+    store->chunks = chunk;
+
+    return chunk->data;
+}
+
+struct row_store *row_store_new(int n_cells)
+{
+    struct row_store *store;
+
+    store = malloc(sizeof(struct row_store));
+
+    if (!store)
+        return NULL;
+
+    store->n_cells = n_cells;
+    store->chunks = NULL;
+
+    return store;
+}
+
+void row_store_free(struct row_store *store)
+{
+    struct row_store_chunk *chunk, *next;
+
+    if (store == NULL)
+        return;
+
+    for (chunk = store->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+
+    free(store);
+}
+
+/* Gives the cells of a new row, all of them empty */
+const char **row_store_new_row(struct row_store *store)
+{
+    const char **cells;
+    int i;
+
+    cells = row_store_alloc(store, sizeof(char *) * store->n_cells,
+                            sizeof(char *));
+
+    if (!cells)
+        return NULL;
+
+    for (i = 0; i < store->n_cells; i++)
+        cells[i] = "";
+
+    return cells;
+}
+
+/* Copies @text into the store, NULL is stored as an empty string */
+const char *row_store_add_text(struct row_store *store, const char *text)
+{
+    size_t len;
+    char *s;
+
+    if ((text == NULL) || (*text == '\0'))
+        return "";
+
+    len = strlen(text) + 1;
+    s = row_store_alloc(store, len, 1);
+
+    if (!s)
+        return NULL;
+
+    memcpy(s, text, len);
+
+    return s;
+}
+
+/* Gives a new row holding a copy of @values */
+const char **row_store_copy_row(struct row_store *store, const char **values)
+{
+    const char **cells;
+    int i;
+
+    cells = row_store_new_row(store);
+
+    if (!cells)
+        return NULL;
+
+    for (i = 0; i < store->n_cells; i++) {
+        cells[i] = row_store_add_text(store, values[i]);
+
+        if (!cells[i])
+            return NULL;
+    }
+
+    return cells;
+}
@@ -0,0 +1,334 @@
+
+/*
+ * Description: cache of the pages of web image search results.
+ *
+ * Each page found by a provider is kept in a file of its own under
+ * WEB_CACHE_DIR, named after the SHA-1 of the provider name, the query, the
+ * result it starts at and its size, so going back to a page doesn't search it
+ * again.
+ * Pages expire after cache_ttl hours, and the least recently used ones are
+ * removed once the cache takes more than cache_size MiB, both in
+ * [image_provider]. A page read gets its access time set, its modification
+ * time still tells when it was searched.
+ *
+ * What the cache takes is counted as pages are stored, so the directory is
+ * only walked the first time and whenever it's over the limit, and then it's
+ * brought down to WEB_CACHE_PRUNE_PERCENT of it.
+ *
+ * Pages are stored from the search thread and may be read from any thread.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "gtkollection.h"
+
+#define WEB_CACHE_MAGIC             "GTKWEB01"
+#define WEB_CACHE_TTL               (7 * 24)        /* hours */
+#define WEB_CACHE_SIZE              32              /* MiB */
+#define WEB_CACHE_PRUNE_PERCENT     75
+
+/* A page file is this header, then the size and data of each image */
+struct page_header {
+    char        magic[8];
+    guint64     total;
+    guint32     n_images;
+    guint32     reserved;
+};
+
+struct cache_file {
+    char        *filename;
+    time_t      atime;
+    off_t       size;
+};
+
+static int __ttl = WEB_CACHE_TTL;
+static guint64 __size_limit = (guint64)WEB_CACHE_SIZE * 1024 * 1024;
+
+/* bytes taken by the pages, -1 until the directory is walked */
+static gint64 __used = -1;
+static GMutex __used_lock;
+
+static int config_integer(const char *key, int default_value)
+{
+    char *s;
+    int value;
+
+    s = get_config_setting("image_provider", key);
+
+    if (s == NULL)
+        return default_value;
+
+    value = atoi(s);
+    g_free(s);
+
+    return (value > 0) ? value : default_value;
+}
+
+/* Reads the cache settings, before any search is made */
+void web_cache_init(void)
+{
+    __ttl = config_integer("cache_ttl", WEB_CACHE_TTL);
+    __size_limit = (guint64)config_integer("cache_size", WEB_CACHE_SIZE) *
+                   1024 * 1024;
+}
+
+static char *cache_dir(void)
+{
+    return g_strdup_printf("%s/%s/%s", getenv("HOME"), APP_CONFIG_PATH,
+                           WEB_CACHE_DIR);
+}
+
+static char *page_filename(const char *provider, const char *query, int start,
+    int count)
+{
+    char *key, *digest, *dir, *filename;
+
+    key = g_strdup_printf("%s\n%d\n%d\n%s", provider, start, count, query);
+    digest = g_compute_checksum_for_string(G_CHECKSUM_SHA1, key, -1);
+    dir = cache_dir();
+    filename = g_strdup_printf("%s/%s", dir, digest);
+
+    g_free(dir);
+    g_free(digest);
+    g_free(key);
+
+    return filename;
+}
+
+static int is_expired(time_t mtime)
+{
+    return (time(NULL) - mtime) > (time_t)__ttl * 3600;
+}
+
+/* Marks a page as just used, keeping the time it was searched */
+static void touch_page(const char *filename)
+{
+    struct timespec times[2];
+
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_NOW;
+    times[1].tv_sec = 0;
+    times[1].tv_nsec = UTIME_OMIT;
+    utimensat(AT_FDCWD, filename, times, 0);
+}
+
+/*
+ * Adds the images of the cached page of @query, of @count results from @start
+ * on, to @images. Gives 0 if it isn't cached.
+ */
+int web_cache_load(const char *provider, const char *query, int start,
+    int count, GPtrArray *images, unsigned long long *total)
+{
+    struct page_header *h;
+    struct stat st;
+    char *filename, *data=NULL;
+    gsize size, offset;
+    guint32 i, n;
+    int ret=0;
+
+    filename = page_filename(provider, query, start, count);
+
+    if ((stat(filename, &st) == -1) ||
+        is_expired(st.st_mtime) ||
+        !g_file_get_contents(filename, &data, &size, NULL) ||
+        (size < sizeof(struct page_header)))
+    {
+        goto end_block;
+    }
+
+    h = (struct page_header *)data;
+
+    if (memcmp(h->magic, WEB_CACHE_MAGIC, sizeof(h->magic)))
+        goto end_block;
+
+    offset = sizeof(struct page_header);
+
+    for (i = 0; i < h->n_images; i++) {
+        if (offset + sizeof(guint32) > size)
+            break;
+
+        memcpy(&n, data + offset, sizeof(guint32));
+        offset += sizeof(guint32);
+
+        if (n > size - offset)
+            break;
+
+        g_ptr_array_add(images, g_bytes_new(data + offset, n));
+        offset += n;
+    }
+
+    /* a truncated page is searched again */
+    if (i < h->n_images) {
+        g_ptr_array_set_size(images, 0);
+        goto end_block;
+    }
+
+    *total = h->total;
+    ret = 1;
+    touch_page(filename);
+
+end_block:
+    g_free(data);
+    g_free(filename);
+
+    return ret;
+}
+
+static gint compare_files(gconstpointer a, gconstpointer b)
+{
+    const struct cache_file *fa = *(struct cache_file * const *)a;
+    const struct cache_file *fb = *(struct cache_file * const *)b;
+
+    return (fa->atime > fb->atime) - (fa->atime < fb->atime);
+}
+
+static void free_file(gpointer data)
+{
+    struct cache_file *f = (struct cache_file *)data;
+
+    g_free(f->filename);
+    free(f);
+}
+
+/*
+ * Removes the expired pages, then the least recently used ones while the
+ * cache is over WEB_CACHE_PRUNE_PERCENT of its limit. Called with
+ * __used_lock held, sets what is left in __used.
+ */
+static void prune_cache(const char *dir)
+{
+    struct cache_file *f;
+    struct stat st;
+    GPtrArray *files;
+    GDir *d;
+    const char *name;
+    char *filename;
+    guint64 used=0, target;
+    guint i;
+
+    target = __size_limit / 100 * WEB_CACHE_PRUNE_PERCENT;
+    d = g_dir_open(dir, 0, NULL);
+
+    if (d == NULL)
+        return;
+
+    files = g_ptr_array_new_with_free_func(free_file);
+
+    while ((name = g_dir_read_name(d)) != NULL) {
+        filename = g_build_filename(dir, name, NULL);
+
+        if ((stat(filename, &st) == -1) || is_expired(st.st_mtime)) {
+            remove(filename);
+            g_free(filename);
+            continue;
+        }
+
+        f = malloc(sizeof(struct cache_file));
+
+        if (!f) {
+            g_free(filename);
+            continue;
+        }
+
+        f->filename = filename;
+        f->atime = st.st_atime;
+        f->size = st.st_size;
+        used += st.st_size;
+        g_ptr_array_add(files, f);
+    }
+
+    g_dir_close(d);
+    g_ptr_array_sort(files, compare_files);
+
+    if (used > __size_limit) {
+        for (i = 0; (i < files->len) && (used > target); i++) {
+            f = g_ptr_array_index(files, i);
+            remove(f->filename);
+            used -= f->size;
+        }
+    }
+
+    g_ptr_array_unref(files);
+    __used = used;
+}
+
+/* Keeps the page of @images found for @query, of @count results from @start on */
+void web_cache_store(const char *provider, const char *query, int start,
+    int count, GPtrArray *images, unsigned long long total)
+{
+    struct page_header h;
+    GByteArray *page;
+    GBytes *b;
+    gconstpointer data;
+    gsize size;
+    guint32 n;
+    struct stat st;
+    guint i;
+    char *dir, *filename;
+    off_t old_size;
+
+    dir = cache_dir();
+
+    if (g_mkdir_with_parents(dir, 0755) == -1) {
+        g_free(dir);
+        return;
+    }
+
+    memset(&h, 0, sizeof(struct page_header));
+    memcpy(h.magic, WEB_CACHE_MAGIC, sizeof(h.magic));
+    h.total = total;
+    h.n_images = images->len;
+
+    page = g_byte_array_new();
+    g_byte_array_append(page, (guint8 *)&h, sizeof(struct page_header));
+
+    for (i = 0; i < images->len; i++) {
+        b = g_ptr_array_index(images, i);
+        data = g_bytes_get_data(b, &size);
+        n = size;
+        g_byte_array_append(page, (guint8 *)&n, sizeof(guint32));
+        g_byte_array_append(page, data, size);
+    }
+
+    /* written aside and renamed, readers never see half a page */
+    filename = page_filename(provider, query, start, count);
+    old_size = (stat(filename, &st) == 0) ? st.st_size : 0;
+
+    /* a page that couldn't be written leaves the count as it was */
+    if (!g_file_set_contents(filename, (gchar *)page->data, page->len, NULL))
+        old_size = page->len;
+
+    g_mutex_lock(&__used_lock);
+
+    if (__used >= 0)
+        __used += (gint64)page->len - old_size;
+
+    if ((__used < 0) || ((guint64)__used > __size_limit))
+        prune_cache(dir);
+
+    g_mutex_unlock(&__used_lock);
+
+    g_free(filename);
+    g_byte_array_unref(page);
+    g_free(dir);
+}
+
+/* Tells whether a page is cached, without reading it */
+int web_cache_has(const char *provider, const char *query, int start, int count)
+{
+    struct stat st;
+    char *filename;
+    int ret;
+
+    filename = page_filename(provider, query, start, count);
+    ret = (stat(filename, &st) == 0) && !is_expired(st.st_mtime);
+
+    g_free(filename);
+
+    return ret;
+}